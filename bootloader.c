@@ -37,6 +37,10 @@ void jump_to_app() {
     /* just for paranoia's sake */
     HAL_FLASH_Lock();
 
+    /* The reset flags stay set until cleared, boot_get_reason() would take
+       every later reset for this one */
+    RCC->RSR |= RCC_RSR_RMVF;
+
   pFunction Jump_To_Application;
 
   /* load this address into function pointer */
@@ -69,3 +73,97 @@ void reset_to_uf2_bootloader(void) {
 
   NVIC_SystemReset();
 }
+
+boot_stats_t boot_stats;
+
+/*
+ * Why the bootloader runs, from the reset flags and the boot signature left
+ * by pre_clock_init(). Clears both, call once before halInit(): it may
+ * reset the backup domain. jump_to_app() clears the flags when the
+ * application starts instead.
+ */
+boot_reason_t boot_get_reason(void) {
+    uint32_t rsr = RCC->RSR;
+    boot_reason_t reason;
+
+    // the application's request first, in case a flag of an earlier reset
+    // wasn't cleared. A power-on sets the pin and brown-out flags too, a
+    // software reset the pin flag
+    if ((rsr & RCC_RSR_SFTRSTF) && (RTC->BKP0R == BOOTLOADER_RTC_SIGNATURE ||
+                                    RTC->BKP0R == BENCH_RTC_SIGNATURE)) {
+        reason = BOOT_APP;
+    } else if (rsr & (RCC_RSR_PORRSTF | RCC_RSR_BORRSTF)) {
+        reason = BOOT_POWER_ON;
+    } else if (rsr & RCC_RSR_SFTRSTF) {
+        reason = BOOT_SOFT_RESET;
+    } else {
+        reason = BOOT_EXTERNAL;
+    }
+
+    RCC->RSR |= RCC_RSR_RMVF;
+    boot_stats.bench = RTC->BKP0R == BENCH_RTC_SIGNATURE;
+    if (RTC->BKP0R == BOOTLOADER_RTC_SIGNATURE || boot_stats.bench) {
+        PWR->CR1 |= PWR_CR1_DBP;
+        RTC->BKP0R = 0;
+    }
+    boot_stats.reason = reason;
+    return reason;
+}
+
+/*
+ * How long the D+ pull-up stays off after the start. Nothing was connected
+ * before a power-on. A software reset takes the previous device off the bus
+ * in a known state, a short disconnect lets the hub report it. After any
+ * other reset the host may still hold a session with the previous device,
+ * it gets the full time to drop it.
+ */
+uint32_t boot_disconnect_ms(boot_reason_t reason) {
+    switch (reason) {
+    case BOOT_POWER_ON:
+        return 0;
+    case BOOT_APP:
+    case BOOT_SOFT_RESET:
+        return 20;
+    default:
+        return 1500;
+    }
+}
+
+const char *boot_reason_name(boot_reason_t reason) {
+    switch (reason) {
+    case BOOT_POWER_ON:
+        return "power-on";
+    case BOOT_APP:
+        return "application";
+    case BOOT_SOFT_RESET:
+        return "software reset";
+    default:
+        return "external reset";
+    }
+}
+
+#if CH_CFG_ST_FREQUENCY % 1000 != 0
+#error "HAL_GetTick() needs a whole number of system ticks per millisecond"
+#endif
+
+/*
+ * Millisecond tick for the timeouts of the HAL flash driver. The system time
+ * wraps long before 2^32 ms, so the elapsed ticks are added to a counter
+ * that wraps at 2^32 ms as the HAL expects. It stays monotonic as long as
+ * it's called at least once per wrap of the system time.
+ */
+uint32_t HAL_GetTick(void) {
+    static systime_t last;
+    static sysinterval_t ticks;
+    static uint32_t ms;
+
+    chSysLock();
+    systime_t now = chVTGetSystemTimeX();
+    ticks += chTimeDiffX(last, now);
+    last = now;
+    ms += ticks / (CH_CFG_ST_FREQUENCY / 1000);
+    ticks %= CH_CFG_ST_FREQUENCY / 1000;
+    uint32_t res = ms;
+    chSysUnlock();
+    return res;
+}
@@ -1,3 +1,6 @@
+#ifndef BOOTLOADER_H
+#define BOOTLOADER_H
+
 #include "hal.h"
 
 #define BOOTLOADER_RTC_SIGNATURE    0x71a21877
@@ -6,6 +9,30 @@
 #define HF2_RTC_SIGNATURE           0x39a63a78
 #define SLEEP_RTC_ARG               0x10b37889
 #define SLEEP2_RTC_ARG              0x7e3353b7
+#define BENCH_RTC_SIGNATURE         0x6265e7c4 // Start the bootloader in benchmark mode
+
+// Why the bootloader runs, decides how long USB stays disconnected
+typedef enum {
+    BOOT_POWER_ON,      // power-on or brown-out, the host has no session with us
+    BOOT_APP,           // reset_to_uf2_bootloader() from the application
+    BOOT_SOFT_RESET,    // other software reset, the bootloader's own after an update
+    BOOT_EXTERNAL,      // reset pin, watchdog or debugger, the host may be in any state
+} boot_reason_t;
+
+typedef struct {
+    boot_reason_t reason;
+    uint32_t disconnect_ms;     // time the D+ pull-up was held off after the start
+    uint32_t configured_ms;     // start of the kernel to SET_CONFIGURATION, 0 until then
+    bool bench;                 // started with BENCH_RTC_SIGNATURE
+} boot_stats_t;
+
+extern boot_stats_t boot_stats;
 
 void jump_to_app(void);
+bool check_bootloader_button(void);
 void reset_to_uf2_bootloader(void);
+boot_reason_t boot_get_reason(void);
+uint32_t boot_disconnect_ms(boot_reason_t reason);
+const char *boot_reason_name(boot_reason_t reason);
+
+#endif /* BOOTLOADER_H */
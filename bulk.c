@@ -0,0 +1,268 @@
+/**
+ * @file    bulk.c
+ * @brief   Raw bulk flashing interface source.
+ * @details Speaks the protocol of bulkproto.h on the vendor interface,
+ *          for programming without the FAT emulation and without the host
+ *          mounting the drive. Writes go through write_payload(), the same
+ *          path as UF2 blocks written to the drive.
+ *
+ * @addtogroup bulk
+ * @{
+ */
+
+#include "hal.h"
+
+#include "bulk.h"
+#include "bulkproto.h"
+#include "flash.h"
+#include "ghostfat.h"
+#include "uf2.h"
+
+#include <string.h>
+
+/*===========================================================================*/
+/* Driver local definitions.                                                 */
+/*===========================================================================*/
+
+#define BULK_PAGE_SIZE                  256U
+
+/*===========================================================================*/
+/* Driver local variables.                                                   */
+/*===========================================================================*/
+
+static THD_WORKING_AREA(waBulk, BULK_THREAD_STACK_SIZE);
+
+static uint8_t cmd_buf[BULK_MAX_TRANSFER] __attribute__((aligned(4)));
+static uint8_t rsp_buf[BULK_MAX_TRANSFER] __attribute__((aligned(4)));
+
+/*
+ * Bytes written to a 256 byte page that aren't queued yet. Commands can
+ * carry 476 bytes, consecutive writes are collected into whole pages so
+ * every page is queued once.
+ */
+static struct {
+  uint32_t addr;
+  uint32_t len;
+  uint8_t data[BULK_PAGE_SIZE];
+} page __attribute__((aligned(4)));
+
+/* writes or erases were queued since the last sync */
+static bool dirty;
+/* a page was refused by write_payload(), reported by the next sync */
+static bool write_error;
+
+/*===========================================================================*/
+/* Driver local functions.                                                   */
+/*===========================================================================*/
+
+ITCM_CODE static void bulk_flush_page(void) {
+  if (page.len > 0) {
+    if (write_payload(page.addr, page.data, page.len) != HAL_SUCCESS) {
+      write_error = true;
+    }
+    page.len = 0;
+  }
+}
+
+ITCM_CODE static void bulk_write(uint32_t addr, const uint8_t *data, uint32_t len) {
+  while (len > 0) {
+    if (page.len > 0 && addr != page.addr + page.len) {
+      bulk_flush_page();
+    }
+    if (page.len == 0) {
+      page.addr = addr;
+    }
+
+    uint32_t n = BULK_PAGE_SIZE - (addr % BULK_PAGE_SIZE);
+    if (n > len) {
+      n = len;
+    }
+    memcpy(page.data + page.len, data, n);
+    page.len += n;
+    addr += n;
+    data += n;
+    len -= n;
+
+    if (addr % BULK_PAGE_SIZE == 0) {
+      bulk_flush_page();
+    }
+  }
+  dirty = true;
+}
+
+/*
+ * Queue the pending page and wait until everything is programmed, then
+ * verify the written sectors. Returns HAL_SUCCESS when all went well.
+ */
+ITCM_CODE static bool bulk_sync(bool verify) {
+  bulk_flush_page();
+  bool err = flash_sync() != HAL_SUCCESS;
+  if (verify && flash_verify() != HAL_SUCCESS) {
+    err = true;
+  }
+  if (write_error) {
+    err = true;
+    write_error = false;
+  }
+  dirty = false;
+  return err ? HAL_FAILED : HAL_SUCCESS;
+}
+
+ITCM_CODE static bool in_flash(uint32_t addr, uint32_t size) {
+  return addr >= BOARD_FLASH_BASE && size <= BOARD_FLASH_SIZE &&
+         addr - BOARD_FLASH_BASE <= BOARD_FLASH_SIZE - size;
+}
+
+ITCM_CODE static bool in_user_flash(uint32_t addr, uint32_t size) {
+  return addr >= USER_FLASH_START && size <= USER_FLASH_END - USER_FLASH_START &&
+         addr - USER_FLASH_START <= USER_FLASH_END - USER_FLASH_START - size;
+}
+
+/*
+ * Handle a command, fills in the response and returns the length of its
+ * data part.
+ */
+ITCM_CODE static uint32_t bulk_command(const bulk_cmd_t *cmd, const uint8_t *data,
+                                       bulk_rsp_t *rsp, uint8_t *out) {
+  switch (cmd->cmd) {
+  case BULK_CMD_INFO: {
+    bulk_info_t info;
+    memset(&info, 0, sizeof(info));
+    info.version = BULK_PROTO_VERSION;
+    info.flash_start = USER_FLASH_START;
+    info.flash_end = USER_FLASH_END;
+    info.max_payload = BULK_MAX_PAYLOAD;
+    info.family = UF2_FAMILY;
+    strncpy(info.board, BOARD_ID, sizeof(info.board) - 1);
+    memcpy(out, &info, sizeof(info));
+    return sizeof(info);
+  }
+
+  case BULK_CMD_WRITE:
+    if (cmd->len == 0 || cmd->len % 4 || cmd->addr % 4 ||
+        !in_user_flash(cmd->addr, cmd->len)) {
+      rsp->status = BULK_ERR_ARG;
+      return 0;
+    }
+    bulk_write(cmd->addr, data, cmd->len);
+    return 0;
+
+  case BULK_CMD_ERASE:
+    // device specific sectors can be written, with the UID, but not erased
+    if (!in_user_flash(cmd->addr, cmd->size)
+#ifdef DEVSPEC_FLASH_START
+        || cmd->addr + cmd->size > DEVSPEC_FLASH_START
+#endif
+        ) {
+      rsp->status = BULK_ERR_ARG;
+      return 0;
+    }
+    // erases what was written to the sectors before, the pending page too
+    bulk_flush_page();
+    if (flash_erase(cmd->addr, cmd->addr + cmd->size) != HAL_SUCCESS) {
+      rsp->status = BULK_ERR_ARG;
+    }
+    dirty = true;
+    return 0;
+
+  case BULK_CMD_READ:
+    if (cmd->size > BULK_MAX_PAYLOAD || !in_flash(cmd->addr, cmd->size)) {
+      rsp->status = BULK_ERR_ARG;
+      return 0;
+    }
+    if (dirty && bulk_sync(false) != HAL_SUCCESS) {
+      rsp->status = BULK_ERR_FLASH;
+    }
+    memcpy(out, (const void *)cmd->addr, cmd->size);
+    return cmd->size;
+
+  case BULK_CMD_CRC:
+    if (cmd->addr % 4 || cmd->size % 4 || !in_flash(cmd->addr, cmd->size)) {
+      rsp->status = BULK_ERR_ARG;
+      return 0;
+    }
+    if (dirty && bulk_sync(false) != HAL_SUCCESS) {
+      rsp->status = BULK_ERR_FLASH;
+    }
+    rsp->value = flash_crc32(0, (const uint8_t *)cmd->addr, cmd->size);
+    return 0;
+
+  case BULK_CMD_SYNC:
+  case BULK_CMD_RESET:
+    if (bulk_sync(true) != HAL_SUCCESS) {
+      rsp->status = BULK_ERR_FLASH;
+    }
+    return 0;
+  }
+
+  rsp->status = BULK_ERR_CMD;
+  return 0;
+}
+
+/*
+ * One command transfer in, one response transfer out.
+ */
+ITCM_CODE static THD_FUNCTION(bulk_thread, arg) {
+  USBDriver *usbp = arg;
+  const bulk_cmd_t *cmd = (const bulk_cmd_t *)cmd_buf;
+  bulk_rsp_t *rsp = (bulk_rsp_t *)rsp_buf;
+
+  chRegSetThreadName("usb_bulk");
+
+  while (true) {
+    msg_t msg = usbReceive(usbp, USB_BULK_DATA_EP, cmd_buf, sizeof(cmd_buf));
+    if (msg == MSG_RESET) {
+      // not configured yet, or reset by the host
+      chThdSleepMilliseconds(10);
+      continue;
+    }
+
+    memset(rsp, 0, sizeof(*rsp));
+    uint32_t len = 0;
+    if (msg < (msg_t)sizeof(*cmd) || cmd->len > BULK_MAX_PAYLOAD ||
+        msg != (msg_t)(sizeof(*cmd) + cmd->len)) {
+      rsp->status = BULK_ERR_CMD;
+    } else {
+      rsp->cmd = cmd->cmd;
+      rsp->tag = cmd->tag;
+      // not while the drive is writing an update
+      ghostfat_lock();
+      len = bulk_command(cmd, cmd_buf + sizeof(*cmd), rsp, rsp_buf + sizeof(*rsp));
+      ghostfat_unlock();
+    }
+    rsp->len = len;
+
+    len += sizeof(*rsp);
+    usbTransmit(usbp, USB_BULK_DATA_EP, rsp_buf, len);
+    if (len % usbp->epc[USB_BULK_DATA_EP]->in_maxsize == 0) {
+      usbTransmit(usbp, USB_BULK_DATA_EP, NULL, 0);
+    }
+
+    if (rsp->cmd == BULK_CMD_RESET && rsp->status == BULK_OK) {
+      // let the response go out first
+      chThdSleepMilliseconds(50);
+      NVIC_SystemReset();
+    }
+  }
+}
+
+/*===========================================================================*/
+/* Driver exported functions.                                                */
+/*===========================================================================*/
+
+/**
+ * @brief   Starts the bulk protocol thread.
+ *
+ * @param[in] usbp      USB driver, its configuration must enable
+ *                      @p USB_BULK_DATA_EP
+ *
+ * @api
+ */
+void bulkStart(USBDriver *usbp) {
+
+  osalDbgCheck(usbp != NULL);
+
+  chThdCreateStatic(waBulk, sizeof(waBulk), NORMALPRIO, bulk_thread, usbp);
+}
+
+/** @} */
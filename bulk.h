@@ -0,0 +1,53 @@
+/**
+ * @file    bulk.h
+ * @brief   Raw bulk flashing interface header.
+ *
+ * @addtogroup bulk
+ * @{
+ */
+
+#ifndef BULK_H
+#define BULK_H
+
+#include "hal.h"
+
+/*===========================================================================*/
+/* Driver constants.                                                         */
+/*===========================================================================*/
+
+#define USB_BULK_DATA_EP                0x02
+
+/*===========================================================================*/
+/* Driver pre-compile time settings.                                         */
+/*===========================================================================*/
+
+/**
+ * @brief   Stack size of the bulk protocol thread.
+ */
+#if !defined(BULK_THREAD_STACK_SIZE)
+#define BULK_THREAD_STACK_SIZE          1024
+#endif
+
+/*===========================================================================*/
+/* Derived constants and error checks.                                       */
+/*===========================================================================*/
+
+#if !HAL_USE_USB || !USB_USE_WAIT
+#error "bulk.c requires HAL_USE_USB and USB_USE_WAIT"
+#endif
+
+/*===========================================================================*/
+/* External declarations.                                                    */
+/*===========================================================================*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  void bulkStart(USBDriver *usbp);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BULK_H */
+
+/** @} */
@@ -0,0 +1,93 @@
+/*
+ * Raw bulk flashing protocol, shared by the bootloader (bulk.c) and the
+ * host tool (tools/uf2bulk.c).
+ *
+ * Every command is a single bulk OUT transfer on the vendor interface: a
+ * bulk_cmd_t header followed by len data bytes. The device answers every
+ * command with a single bulk IN transfer: a bulk_rsp_t header followed by
+ * len data bytes. A transfer that is a multiple of the packet size is
+ * ended by a zero length packet. All fields are little endian.
+ *
+ * Writes are queued on the same flash path as UF2 blocks on the drive and
+ * are programmed per sector, SYNC waits until everything is programmed and
+ * checks the written sectors with the flash CRC unit.
+ */
+
+#ifndef BULKPROTO_H
+#define BULKPROTO_H
+
+#include <stdint.h>
+
+#define BULK_PROTO_VERSION  1
+
+// vendor interface of the bootloader
+#define BULK_INTERFACE_CLASS    0xFF
+#define BULK_INTERFACE_SUBCLASS 0x55    // 'U'
+#define BULK_INTERFACE_PROTOCOL 0x46    // 'F'
+
+// largest data part of a command or response, the data part of a UF2 block
+#define BULK_MAX_PAYLOAD    476
+// buffer size for a command or response, a multiple of the packet size
+#define BULK_MAX_TRANSFER   512
+
+enum {
+    BULK_CMD_INFO = 1,  // -> bulk_info_t
+    BULK_CMD_WRITE,     // addr, data: queue data for flashing at addr
+    BULK_CMD_ERASE,     // addr, size: erase the sectors, sector aligned
+    BULK_CMD_READ,      // addr, size: -> size bytes of flash
+    BULK_CMD_CRC,       // addr, size: -> value is the CRC of the flash range
+    BULK_CMD_SYNC,      // wait for queued writes, verify the written sectors
+    BULK_CMD_RESET,     // sync and reset into the application
+};
+
+enum {
+    BULK_OK = 0,
+    BULK_ERR_CMD,       // unknown command or malformed transfer
+    BULK_ERR_ARG,       // address, size or alignment not allowed
+    BULK_ERR_FLASH,     // programming or verification failed
+};
+
+typedef struct {
+    uint8_t cmd;
+    uint8_t tag;        // returned in the response
+    uint16_t len;       // length of the data following the header
+    uint32_t addr;
+    uint32_t size;
+} __attribute__((packed)) bulk_cmd_t;
+
+typedef struct {
+    uint8_t cmd;
+    uint8_t tag;
+    uint8_t status;
+    uint8_t reserved0;
+    uint32_t value;     // command specific, the CRC for BULK_CMD_CRC
+    uint16_t len;       // length of the data following the header
+    uint16_t reserved1;
+} __attribute__((packed)) bulk_rsp_t;
+
+typedef struct {
+    uint32_t version;       // BULK_PROTO_VERSION
+    uint32_t flash_start;   // writable range
+    uint32_t flash_end;
+    uint32_t max_payload;   // BULK_MAX_PAYLOAD
+    uint32_t family;        // UF2 family ID
+    char board[32];         // board name, zero terminated
+} __attribute__((packed)) bulk_info_t;
+
+/*
+ * CRC of a flash range as returned by BULK_CMD_CRC, the algorithm of the
+ * flash CRC unit: CRC-32 polynomial, initial value 0, no reflection, over
+ * little endian 32-bit words.
+ */
+static inline uint32_t bulk_crc32(uint32_t crc, const uint8_t *data, uint32_t len) {
+    for (uint32_t i = 0; i + 4 <= len; i += 4) {
+        crc ^= (uint32_t)data[i] | (uint32_t)data[i + 1] << 8 |
+               (uint32_t)data[i + 2] << 16 | (uint32_t)data[i + 3] << 24;
+        for (unsigned j = 0; j < 32; j++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+#endif /* BULKPROTO_H */
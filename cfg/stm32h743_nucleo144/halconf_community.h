@@ -119,7 +119,7 @@
  * @brief   Enables the USB_MSD subsystem.
  */
 #if !defined(HAL_USE_USB_MSD) || defined(__DOXYGEN__)
-#define HAL_USE_USB_MSD             TRUE
+#define HAL_USE_USB_MSD             FALSE
 #endif
 
 /*===========================================================================*/
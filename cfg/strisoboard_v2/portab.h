@@ -31,8 +31,16 @@
 
 #define USBDEVICESTRING BOARD_NAME
 #define USBMFGSTRING "Striso"
-#define BOARD_FLASH_SECTORS 16
-#define BOARD_FLASH_SIZE (2 * 1024 * 1024)
+#define BOARD_FLASH_BASE 0x08000000
+
+/*
+ * Flash geometry as runs of equally sized sectors in address order, parts
+ * with non-uniform sectors get a run per sector size:
+ * X(arg, start, number of sectors, sector size, bank, number of the first sector in the bank)
+ */
+#define BOARD_FLASH_LAYOUT(X, arg)                                            \
+  X(arg, BOARD_FLASH_BASE,            8, 128 * 1024, FLASH_BANK_1, 0)        \
+  X(arg, BOARD_FLASH_BASE + 0x100000, 8, 128 * 1024, FLASH_BANK_2, 0)
 
 // UF2 Family ID - picked at random
 #define UF2_FAMILY 0xa21e1295 // Striso board v2.0 - STM32H7
@@ -58,6 +66,12 @@
 /* Derived constants and error checks.                                       */
 /*===========================================================================*/
 
+#define BOARD_FLASH_RUN_SECTORS(arg, start, count, size, bank, snb) + (count)
+#define BOARD_FLASH_RUN_BYTES(arg, start, count, size, bank, snb) + (count) * (size)
+
+#define BOARD_FLASH_SECTORS (0 BOARD_FLASH_LAYOUT(BOARD_FLASH_RUN_SECTORS, 0))
+#define BOARD_FLASH_SIZE (0 BOARD_FLASH_LAYOUT(BOARD_FLASH_RUN_BYTES, 0))
+
 /*===========================================================================*/
 /* Module data structures and types.                                         */
 /*===========================================================================*/
@@ -0,0 +1,16 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include "hal.h"
+#include "chprintf.h"
+
+extern BaseSequentialStream *GlobalDebugChannel;
+
+// Print to the debug serial port, dropped until main() has started it
+#define dbg_printf(...) do {                                                  \
+    if (GlobalDebugChannel != NULL) {                                         \
+        chprintf(GlobalDebugChannel, __VA_ARGS__);                            \
+    }                                                                         \
+} while (0)
+
+#endif /* DEBUG_H */
@@ -1,32 +1,79 @@
 #include "hal.h"
 #include "portab.h"
+#include "uf2cfg.h"
+#include "flash.h"
+#include "debug.h"
 #include "stm32h7xx_hal_flash.h"
 #include "stm32h7xx_hal_flash_ex.h"
+#include <string.h>
 
-/* flash parameters that we should not really know */
-static struct {
-	uint32_t	sector_number;
+/* smallest programmable unit, a 256-bit flash word */
+#define FLASH_WORD_SIZE (FLASH_NB_32BITWORD_IN_FLASHWORD * sizeof(uint32_t))
+
+/* a sector erase takes 2 s typical, 4 s max */
+#define FLASH_ERASE_TIMEOUT     TIME_MS2I(5000)
+#define FLASH_PROGRAM_TIMEOUT   TIME_MS2I(10)
+
+#if FLASH_USE_IRQ
+#if !defined(STM32_FLASH_IRQ_PRIORITY)
+#define STM32_FLASH_IRQ_PRIORITY 10
+#endif
+#define FLASH_IRQ_HANDLER Vector50
+
+/* interrupts for the end of an erase/program operation and its errors */
+#if defined(FLASH_CR_OPERRIE)
+#define FLASH_IT_OPERATION (FLASH_CR_EOPIE | FLASH_CR_WRPERRIE | FLASH_CR_PGSERRIE | \
+                            FLASH_CR_STRBERRIE | FLASH_CR_INCERRIE | FLASH_CR_OPERRIE)
+#else
+#define FLASH_IT_OPERATION (FLASH_CR_EOPIE | FLASH_CR_WRPERRIE | FLASH_CR_PGSERRIE | \
+                            FLASH_CR_STRBERRIE | FLASH_CR_INCERRIE)
+#endif
+#endif /* FLASH_USE_IRQ */
+
+/* the erase granularity is a sector, regions must not share sectors */
+#if !FLASH_SECTOR_BOUNDARY(USER_FLASH_START) || FLASH_SECTOR_INDEX(USER_FLASH_START) == 0
+#error "USER_FLASH_START must be at the start of a sector after the bootloader"
+#endif
+#if !FLASH_SECTOR_BOUNDARY(USER_FLASH_END)
+#error "USER_FLASH_END must be at the end of a sector"
+#endif
+#if APP_LOAD_ADDRESS < USER_FLASH_START || APP_LOAD_ADDRESS >= USER_FLASH_END
+#error "APP_LOAD_ADDRESS must be in the user flash"
+#endif
+#ifdef USE_CONFIGFILE
+#if !FLASH_SECTOR_BOUNDARY(CFGUF2_ADDRESS) || CFGUF2_ADDRESS < USER_FLASH_START
+#error "CFGUF2_ADDRESS must be at the start of a sector in the user flash"
+#endif
+#if FLASH_SECTOR_INDEX(APP_LOAD_ADDRESS) == FLASH_SECTOR_INDEX(CFGUF2_ADDRESS)
+#error "APP_LOAD_ADDRESS and CFGUF2_ADDRESS must be in different sectors"
+#endif
+#endif
+#ifdef DEVSPEC_FLASH_START
+#if !FLASH_SECTOR_BOUNDARY(DEVSPEC_FLASH_START) || APP_LOAD_ADDRESS >= DEVSPEC_FLASH_START
+#error "DEVSPEC_FLASH_START must be at the start of a sector after APP_LOAD_ADDRESS"
+#endif
+#endif
+
+/* flash geometry from the board layout */
+#define FLASH_RUN_ENTRY(arg, start, count, size, bank, snb) {start, count, size, bank, snb},
+
+static const struct {
+	uint32_t	start;
+	uint32_t	count;
 	uint32_t	size;
 	uint32_t	bank;
-} flash_sectors[] = {
-	{0x00, 128 * 1024, FLASH_BANK_1},
-	{0x01, 128 * 1024, FLASH_BANK_1},
-	{0x02, 128 * 1024, FLASH_BANK_1},
-	{0x03, 128 * 1024, FLASH_BANK_1},
-	{0x04, 128 * 1024, FLASH_BANK_1},
-	{0x05, 128 * 1024, FLASH_BANK_1},
-	{0x06, 128 * 1024, FLASH_BANK_1},
-	{0x07, 128 * 1024, FLASH_BANK_1},
-	{0x00, 128 * 1024, FLASH_BANK_2},
-	{0x01, 128 * 1024, FLASH_BANK_2},
-	{0x02, 128 * 1024, FLASH_BANK_2},
-	{0x03, 128 * 1024, FLASH_BANK_2},
-	{0x04, 128 * 1024, FLASH_BANK_2},
-	{0x05, 128 * 1024, FLASH_BANK_2},
-	{0x06, 128 * 1024, FLASH_BANK_2},
-	{0x07, 128 * 1024, FLASH_BANK_2},
+	uint32_t	sector_number;
+} flash_runs[] = {
+	BOARD_FLASH_LAYOUT(FLASH_RUN_ENTRY, 0)
 };
 
+/* per sector geometry, filled in from flash_runs[] by flash_init() */
+static struct {
+	uint32_t	start;
+	uint32_t	sector_number;
+	uint32_t	size;
+	uint32_t	bank;
+} flash_sectors[BOARD_FLASH_SECTORS];
 
 uint32_t flash_func_sector_size(unsigned sector) {
 	if (sector < BOARD_FLASH_SECTORS) {
@@ -38,9 +85,133 @@ uint32_t flash_func_sector_size(unsigned sector) {
 
 static uint8_t erasedSectors[BOARD_FLASH_SECTORS];
 
-static bool is_blank(uint32_t addr, uint32_t size) {
+flash_stats_t flash_stats;
+
+/* number of UF2 payloads that can be waiting to be programmed */
+#define FLASH_QUEUE_LEN 16
+
+/* a pending UF2 payload */
+typedef struct {
+	uint32_t dst;
+	uint32_t len;
+	bool failsafe;
+	uint8_t data[256];
+} flash_job_t;
+
+static flash_job_t flash_jobs[FLASH_QUEUE_LEN];
+static MEMORYPOOL_DECL(flash_job_pool, sizeof(flash_job_t), PORT_NATURAL_ALIGN, NULL);
+static SEMAPHORE_DECL(flash_jobs_free, FLASH_QUEUE_LEN);
+
+/*
+ * Every bank has its own controller (CR/SR/CCR), so each bank gets a worker
+ * thread that owns it: one operation can be in flight per bank. A worker
+ * only touches the erasedSectors[] entries of its own bank.
+ */
+typedef struct {
+	uint32_t bank;
+	volatile uint32_t *cr;
+	volatile uint32_t *sr;
+	volatile uint32_t *ccr;
+	mailbox_t mb;
+	msg_t mb_buf[FLASH_QUEUE_LEN];
+	unsigned sector;            // sector being collected, BOARD_FLASH_SECTORS if none
+	bool failsafe;
+	uint8_t *buf;               // contents of the sector being collected
+#if FLASH_USE_IRQ
+	binary_semaphore_t done;    // signaled by the flash interrupt
+	uint32_t errors;            // error flags cleared by the flash interrupt
+#endif
+} flash_bank_t;
+
+static flash_bank_t flash_banks[2] = {
+	{.bank = FLASH_BANK_1, .cr = &FLASH->CR1, .sr = &FLASH->SR1, .ccr = &FLASH->CCR1},
+	{.bank = FLASH_BANK_2, .cr = &FLASH->CR2, .sr = &FLASH->SR2, .ccr = &FLASH->CCR2},
+};
+static THD_WORKING_AREA(waFlashBank1, 512);
+static THD_WORKING_AREA(waFlashBank2, 512);
+
+/* queued jobs that are not finished yet, flash_idle is signaled at zero */
+static uint32_t flash_pending;
+static bool flash_error;
+static BSEMAPHORE_DECL(flash_idle, true);
+/* one waiter for flash_idle at a time, it wakes a single thread */
+static MUTEX_DECL(flash_wait_mtx);
+
+/*
+ * Payloads are collected per sector in a RAM buffer and the sector is
+ * programmed in one go when it is complete, when a payload for another
+ * sector of the bank arrives or on flash_sync().
+ */
+#define FLASH_PAYLOAD_SIZE 256
+#define FLASH_SECTOR_MAX_SIZE (128 * 1024)
+#define FLASH_SECTOR_PAYLOADS (FLASH_SECTOR_MAX_SIZE / FLASH_PAYLOAD_SIZE)
+#define FLASH_RUN_LARGER(max, start, count, size, bank, snb) || (size) > (max)
+#if 0 BOARD_FLASH_LAYOUT(FLASH_RUN_LARGER, FLASH_SECTOR_MAX_SIZE)
+#error "sectors larger than FLASH_SECTOR_MAX_SIZE can't be collected"
+#endif
+/* posted to the workers by flash_sync() to write out the collected sectors */
+#define FLASH_MSG_FLUSH ((msg_t)1)
+/* posted to the workers by flash_reset() to forget the update */
+#define FLASH_MSG_RESET ((msg_t)2)
+
+/* a sector buffer per bank, in AXI SRAM (ram0) with the rest of .bss */
+static uint8_t flash_buf[2][FLASH_SECTOR_MAX_SIZE] __attribute__((aligned(32)));
+/* payloads received per sector */
+static uint8_t sectorReceived[BOARD_FLASH_SECTORS][FLASH_SECTOR_PAYLOADS / 8];
+static uint16_t sectorPayloads[BOARD_FLASH_SECTORS];
+/* sector was written out before */
+static uint8_t sectorFlushed[BOARD_FLASH_SECTORS];
+
+/* CRC polynomial of the flash CRC unit, CRC-32 (Ethernet) */
+#define CRC32_POLY 0x04C11DB7
+
+flash_crc_t flash_crc[BOARD_FLASH_SECTORS];
+/* filled in by flash_init(), in RAM so it can be read while bank 1 is busy */
+static uint32_t crc32_table[256];
+
+/* address range the current update is expected to cover */
+static struct {
+	uint32_t start;
+	uint32_t end;
+	bool failsafe;
+} erase_ahead;
+
+ITCM_CODE static uint32_t flash_sector_addr(unsigned sector) {
+	return flash_sectors[sector].start;
+}
+
+/*
+ * Find the sector containing addr, returns BOARD_FLASH_SECTORS if not found.
+ */
+ITCM_CODE static unsigned flash_find_sector(uint32_t addr, uint32_t *start, uint32_t *size) {
+	if (addr < BOARD_FLASH_BASE || addr - BOARD_FLASH_BASE >= BOARD_FLASH_SIZE) {
+		return BOARD_FLASH_SECTORS;
+	}
+
+	unsigned i = FLASH_SECTOR_INDEX(addr);
+	*start = flash_sectors[i].start;
+	*size = flash_sectors[i].size;
+	return i;
+}
+
+/*
+ * CRC as computed by the flash CRC unit: initial value 0, no reflection,
+ * little endian 32-bit words in address order, len is a multiple of 4.
+ */
+ITCM_CODE uint32_t flash_crc32(uint32_t crc, const uint8_t *data, uint32_t len) {
+	for (uint32_t i = 0; i + 4 <= len; i += 4) {
+		crc ^= (uint32_t)data[i] | (uint32_t)data[i + 1] << 8 |
+			(uint32_t)data[i + 2] << 16 | (uint32_t)data[i + 3] << 24;
+		for (unsigned j = 0; j < 4; j++) {
+			crc = (crc << 8) ^ crc32_table[crc >> 24];
+		}
+	}
+	return crc;
+}
+
+ITCM_CODE static bool is_blank(uint32_t addr, uint32_t size) {
 	for (unsigned i = 0; i < size; i += sizeof(uint32_t)) {
-		if (*(uint32_t*)(addr + i) != 0xffffffff) {
+		if (*(volatile const uint32_t *)(addr + i) != 0xffffffff) {
 			// DMESG("non blank: %p i=%d/%d", addr, i, size);
 			return false;
 		}
@@ -48,73 +219,712 @@ static bool is_blank(uint32_t addr, uint32_t size) {
 	return true;
 }
 
+ITCM_CODE static void flash_stats_add(uint32_t *counter, uint32_t n) {
+	chSysLock();
+	*counter += n;
+	chSysUnlock();
+}
+
+ITCM_CODE static void flash_stats_max(uint32_t *max, uint32_t n) {
+	chSysLock();
+	if (n > *max) {
+		*max = n;
+	}
+	chSysUnlock();
+}
+
+ITCM_CODE static void flash_unlock_bank(uint32_t bank) {
+	if (bank == FLASH_BANK_1) {
+		HAL_FLASHEx_Unlock_Bank1();
+	} else {
+		HAL_FLASHEx_Unlock_Bank2();
+	}
+#if FLASH_USE_IRQ
+	*flash_banks[bank - FLASH_BANK_1].cr |= FLASH_IT_OPERATION;
+#endif
+}
+
+ITCM_CODE static void flash_lock_bank(uint32_t bank) {
+	if (bank == FLASH_BANK_1) {
+		HAL_FLASHEx_Lock_Bank1();
+	} else {
+		HAL_FLASHEx_Lock_Bank2();
+	}
+}
+
+#if FLASH_USE_IRQ
 /*
- * Write flash, erase sector if necessary and not already erased.
+ * End of operation and error interrupt of both banks, wakes up the worker
+ * waiting on the bank.
+ */
+OSAL_IRQ_HANDLER(FLASH_IRQ_HANDLER) {
+	OSAL_IRQ_PROLOGUE();
+
+	for (unsigned i = 0; i < 2; i++) {
+		flash_bank_t *b = &flash_banks[i];
+		uint32_t flags = *b->sr & (FLASH_SR_EOP | FLASH_FLAG_ALL_ERRORS_BANK1);
+		if (flags) {
+			*b->ccr = flags;
+			osalSysLockFromISR();
+			b->errors |= flags & FLASH_FLAG_ALL_ERRORS_BANK1;
+			chBSemSignalI(&b->done);
+			osalSysUnlockFromISR();
+		}
+	}
+
+	OSAL_IRQ_EPILOGUE();
+}
+#endif /* FLASH_USE_IRQ */
+
+/*
+ * Wait for the write queue of a bank to drain and clear its error flags.
+ * Returns HAL_FAILED on errors or when the operation didn't finish in time.
  *
- * When failsafe=true don't check if the sector is empty to not fail on ECC errors.
+ * With FLASH_USE_IRQ the worker sleeps until the flash interrupt, otherwise
+ * it polls and yields so the worker of the other bank keeps its controller
+ * busy in the meantime.
  */
-void flash_write(uint32_t dst, const uint8_t *src, int len, bool failsafe) {
-	uint32_t addr = 0x08000000;
-	uint32_t sector = 0;
-	uint32_t size = 0;
+ITCM_CODE static bool flash_wait_bank(uint32_t bank, sysinterval_t timeout) {
+	flash_bank_t *b = &flash_banks[bank - FLASH_BANK_1];
+	systime_t start = chVTGetSystemTimeX();
+	uint32_t errors;
+	bool timedout = false;
 
-	for (unsigned i = 0; i < BOARD_FLASH_SECTORS; i++) {
-		size = flash_func_sector_size(i);
-		if (addr + size > dst) {
-			sector = i;
+#if FLASH_USE_IRQ
+	chSysLock();
+	while (*b->sr & FLASH_SR_QW) {
+		sysinterval_t elapsed = chTimeDiffX(start, chVTGetSystemTimeX());
+		if (elapsed >= timeout ||
+			chBSemWaitTimeoutS(&b->done, timeout - elapsed) == MSG_TIMEOUT) {
+			timedout = (*b->sr & FLASH_SR_QW) != 0;
 			break;
 		}
-		addr += size;
 	}
-	// sector = (dst - 0x08000000) / (128 * 1024);
-
-	if (sector == 0 || sector >= BOARD_FLASH_SECTORS) {// Bootloader sector should not be erased
-		return; //PANIC("invalid sector");
+	errors = b->errors | (*b->sr & FLASH_FLAG_ALL_ERRORS_BANK1);
+	b->errors = 0;
+	chSysUnlock();
+#else
+	while (*b->sr & FLASH_SR_QW) {
+		if (chTimeDiffX(start, chVTGetSystemTimeX()) >= timeout) {
+			timedout = (*b->sr & FLASH_SR_QW) != 0;
+			break;
+		}
+		chThdYield();
+	}
+	errors = *b->sr & FLASH_FLAG_ALL_ERRORS_BANK1;
+#endif
+	if (errors) {
+		*b->ccr = errors;
 	}
 
-	HAL_FLASH_Unlock();
+	return (errors || timedout) ? HAL_FAILED : HAL_SUCCESS;
+}
+
+/*
+ * Erase sector if not erased yet, only to be called by the worker of its bank.
+ * Returns true when an erase was actually performed.
+ *
+ * Doesn't use HAL_FLASHEx_Erase(), it takes the HAL lock and waits on both
+ * banks which would serialize the workers. FLASH_Erase_Sector() isn't used
+ * either, it runs from flash and would stall when erasing bank 1.
+ */
+ITCM_CODE static bool flash_erase_sector(unsigned sector, uint32_t addr, uint32_t size, bool failsafe) {
+	uint32_t bank = flash_sectors[sector].bank;
+	bool erased = false;
 
 	if (!erasedSectors[sector]) {
 		if (failsafe || !is_blank(addr, size)) {
-			FLASH_EraseInitTypeDef eraseInit;
-			eraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
-			eraseInit.Banks = flash_sectors[sector].bank;
-			eraseInit.Sector = flash_sectors[sector].sector_number;
-			eraseInit.NbSectors = 1;
-			eraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+			systime_t t = chVTGetSystemTimeX();
+			flash_unlock_bank(bank);
+			flash_wait_bank(bank, FLASH_PROGRAM_TIMEOUT);
+			volatile uint32_t *cr = flash_banks[bank - FLASH_BANK_1].cr;
+			*cr = (*cr & ~(FLASH_CR_PSIZE | FLASH_CR_SNB)) | FLASH_VOLTAGE_RANGE_3 | FLASH_CR_SER |
+				(flash_sectors[sector].sector_number << FLASH_CR_SNB_Pos);
+			*cr |= FLASH_CR_START;
+			bool err = flash_wait_bank(bank, FLASH_ERASE_TIMEOUT);
+			*cr &= ~(FLASH_CR_SER | FLASH_CR_SNB);
+			flash_lock_bank(bank);
+			cacheBufferInvalidate(addr, size);
+			erased = true;
 
-			uint32_t sectorError = 0;
-			HAL_FLASHEx_Erase(&eraseInit, &sectorError);
+			uint32_t ms = TIME_I2MS(chTimeDiffX(t, chVTGetSystemTimeX()));
+			flash_stats_max(&flash_stats.erase_max_ms, ms);
+			if (err != HAL_SUCCESS) {
+				chSysLock();
+				flash_error = true;
+				chSysUnlock();
+			}
+			dbg_printf("erase sector %u: %u ms%s\r\n", sector, ms, err ? " FAILED" : "");
 
 			// if (!is_blank(addr, size) | (sectorError != 0xffffffff))
 			// 	PANIC("failed to erase!");
 		}
 		erasedSectors[sector] = 1; // don't erase anymore - we will continue writing here!
 	}
+	return erased;
+}
+
+/*
+ * Next sector of this bank to erase ahead of the incoming data,
+ * BOARD_FLASH_SECTORS if there's nothing to do.
+ */
+ITCM_CODE static unsigned flash_erase_ahead_next(uint32_t bank) {
+	for (unsigned sector = 0; sector < BOARD_FLASH_SECTORS; sector++) {
+		uint32_t addr = flash_sectors[sector].start;
+		uint32_t size = flash_sectors[sector].size;
+		// the range can shrink or be cancelled while we're busy
+		chSysLock();
+		bool in_range = addr < erase_ahead.end && addr + size > erase_ahead.start;
+		chSysUnlock();
+
+		if (sector > 0 && in_range && flash_sectors[sector].bank == bank && !erasedSectors[sector]) {
+			return sector;
+		}
+	}
+	return BOARD_FLASH_SECTORS;
+}
+
+/*
+ * Program a span of blank flash in whole flash words.
+ *
+ * dst must be flash word aligned and the span must not cross a bank boundary,
+ * a trailing partial flash word is padded with the erased value. Every flash
+ * word is programmed once, waiting for the write queue (QW) once per word.
+ */
+ITCM_CODE static bool flash_program(uint32_t bank, uint32_t dst, const uint8_t *src, uint32_t len) {
+	volatile uint32_t *cr = flash_banks[bank - FLASH_BANK_1].cr;
+	uint32_t word[FLASH_NB_32BITWORD_IN_FLASHWORD];
+	bool err = HAL_SUCCESS;
+
+	if (dst % FLASH_WORD_SIZE) {
+		return HAL_FAILED;
+	}
+
+	flash_wait_bank(bank, FLASH_PROGRAM_TIMEOUT);
+	*cr = (*cr & ~FLASH_CR_PSIZE) | FLASH_VOLTAGE_RANGE_3 | FLASH_CR_PG;
+
+	for (uint32_t i = 0; i < len && err == HAL_SUCCESS; i += FLASH_WORD_SIZE) {
+		const uint32_t *p = (const uint32_t *)(src + i);
+		if (len - i < FLASH_WORD_SIZE || ((uint32_t)p & 3)) {
+			memset(word, 0xff, sizeof(word));
+			memcpy(word, src + i, len - i < FLASH_WORD_SIZE ? len - i : FLASH_WORD_SIZE);
+			p = word;
+		}
 
-	// invalidate flash buffer after it may have been erased
-	cacheBufferInvalidate(dst, len);
-	// check if flash is really empty, otherwise ECC errors might be created
-	if (!is_blank(dst, len)) {
-		// PANIC("flash to write is not empty");
-		// TODO: better error handling
-		while (true) {
-			usbDisconnectBus(&USBD1);
-			palToggleLine(PORTAB_BLINK_LED);
-			chThdSleepMilliseconds(30);
+		volatile uint32_t *d = (volatile uint32_t *)(dst + i);
+		__ISB();
+		__DSB();
+		for (unsigned w = 0; w < FLASH_NB_32BITWORD_IN_FLASHWORD; w++) {
+			d[w] = p[w];
 		}
+		__ISB();
+		__DSB();
+
+		err = flash_wait_bank(bank, FLASH_PROGRAM_TIMEOUT);
 	}
 
-	for (int i = 0; i < len; i += 4) {
-		HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, dst + i, (uint32_t)src + i);
+	*cr &= ~FLASH_CR_PG;
+	__DSB();
+	return err;
+}
+
+enum {
+	FLASH_SAME,         // flash already holds the sector contents
+	FLASH_PROGRAM,      // only blank flash words differ
+	FLASH_ERASE,        // programmed flash words differ
+};
+
+/*
+ * Compare a collected sector with the flash contents.
+ */
+ITCM_CODE static int flash_compare(const uint8_t *buf, uint32_t addr, uint32_t size) {
+	int res = FLASH_SAME;
+
+	cacheBufferInvalidate(addr, size);
+	for (uint32_t i = 0; i < size; i += FLASH_WORD_SIZE) {
+		if (memcmp(buf + i, (const void *)(addr + i), FLASH_WORD_SIZE) != 0) {
+			if (!is_blank(addr + i, FLASH_WORD_SIZE)) {
+				return FLASH_ERASE;
+			}
+			res = FLASH_PROGRAM;
+		}
 	}
+	return res;
+}
 
-	// TODO: implement error checking
-	// ccrc = CalcCRC32((uint8_t *)(SDRAM_BANK_ADDR + 0x010), flength);
+/*
+ * Program the flash words of a collected sector that differ from the
+ * (blank) flash, runs of consecutive flash words are programmed at once.
+ */
+ITCM_CODE static bool flash_program_sector(uint32_t bank, const uint8_t *buf, uint32_t addr, uint32_t size) {
+	bool err = HAL_SUCCESS;
+	uint32_t run = 0;
+	bool in_run = false;
+
+	flash_unlock_bank(bank);
+	for (uint32_t i = 0; i <= size; i += FLASH_WORD_SIZE) {
+		bool differs = i < size && memcmp(buf + i, (const void *)(addr + i), FLASH_WORD_SIZE) != 0;
+		if (differs && !in_run) {
+			run = i;
+			in_run = true;
+		} else if (!differs && in_run) {
+			if (flash_program(bank, addr + run, buf + run, i - run) != HAL_SUCCESS) {
+				err = HAL_FAILED;
+			}
+			in_run = false;
+		}
+	}
+	flash_lock_bank(bank);
+
+	return err;
+}
+
+/*
+ * Write out the sector being collected. A sector is only erased when it
+ * isn't erased yet, with USE_DIFFERENTIAL_FLASH only when programmed flash
+ * words differ and a sector that already matches is skipped.
+ */
+ITCM_CODE static bool flash_flush(flash_bank_t *b) {
+	unsigned sector = b->sector;
+	if (sector >= BOARD_FLASH_SECTORS) {
+		return HAL_SUCCESS;
+	}
 
-	// if (memcmp((void*)dst, src, len) != 0) {
-	// 	PANIC("failed to write");
-	// }
+	uint32_t addr = flash_sectors[sector].start;
+	uint32_t size = flash_sectors[sector].size;
+	b->sector = BOARD_FLASH_SECTORS;
+	sectorFlushed[sector] = 1;
+	// the buffer holds the final contents, payloads that overwrote each other included
+	flash_crc[sector].expected = flash_crc32(0, b->buf, size);
+	flash_crc[sector].written = true;
+	if (sectorPayloads[sector] < size / FLASH_PAYLOAD_SIZE) {
+		flash_stats_add(&flash_stats.flush_partial, 1);
+	}
 
-	HAL_FLASH_Lock();
+	if (!erasedSectors[sector]) {
+		bool erase = true;
+#ifdef USE_DIFFERENTIAL_FLASH
+		// failsafe mode erases unconditionally, the contents may have ECC errors
+		if (!b->failsafe) {
+			int cmp = flash_compare(b->buf, addr, size);
+			if (cmp == FLASH_SAME) {
+				flash_stats_add(&flash_stats.diff_skipped, 1);
+				return HAL_SUCCESS;
+			}
+			erase = cmp == FLASH_ERASE;
+			if (erase) {
+				flash_stats_add(&flash_stats.diff_rewritten, 1);
+			}
+		}
+#endif
+		systime_t te = chVTGetSystemTimeX();
+		if (erase && flash_erase_sector(sector, addr, size, b->failsafe)) {
+			flash_stats_add(&flash_stats.erase_sync, 1);
+			flash_stats_add(&flash_stats.erase_sync_ms, TIME_I2MS(chTimeDiffX(te, chVTGetSystemTimeX())));
+		}
+	}
+
+	if (flash_compare(b->buf, addr, size) == FLASH_ERASE) {
+		// payloads arrived for a sector that was written out already
+		erasedSectors[sector] = 0;
+		flash_erase_sector(sector, addr, size, true);
+	}
+
+	systime_t t = chVTGetSystemTimeX();
+	bool err = flash_program_sector(flash_sectors[sector].bank, b->buf, addr, size);
+	uint32_t us = TIME_I2US(chTimeDiffX(t, chVTGetSystemTimeX()));
+	flash_stats_add(&flash_stats.program, 1);
+	flash_stats_add(&flash_stats.program_us, us);
+	flash_stats_max(&flash_stats.program_max_us, us);
+
+	cacheBufferInvalidate(addr, size);
+	return err;
+}
+
+/*
+ * Start collecting a sector, starting from its flash contents when it was
+ * written out before.
+ */
+ITCM_CODE static void flash_open(flash_bank_t *b, unsigned sector, bool failsafe) {
+	uint32_t addr = flash_sectors[sector].start;
+	uint32_t size = flash_sectors[sector].size;
+
+	b->sector = sector;
+	b->failsafe = failsafe;
+	if (sectorFlushed[sector]) {
+		cacheBufferInvalidate(addr, size);
+		memcpy(b->buf, (const void *)addr, size);
+	} else {
+		memset(b->buf, 0xff, size);
+	}
+}
+
+/*
+ * Add a queued payload to the sector being collected, runs on the worker
+ * of the bank the payload is in.
+ */
+ITCM_CODE static bool flash_do_job(flash_bank_t *b, const flash_job_t *job) {
+	uint32_t addr;
+	uint32_t size;
+	unsigned sector = flash_find_sector(job->dst, &addr, &size);
+	bool err = HAL_SUCCESS;
+
+	if (job->len == 0) {
+		// erase, drops what was collected for the sector
+		if (b->sector == sector) {
+			b->sector = BOARD_FLASH_SECTORS;
+		}
+		erasedSectors[sector] = 0;
+		flash_erase_sector(sector, addr, size, true);
+		flash_crc[sector].written = false;
+		memset(sectorReceived[sector], 0, sizeof(sectorReceived[sector]));
+		sectorPayloads[sector] = 0;
+		sectorFlushed[sector] = 1;
+		return HAL_SUCCESS;
+	}
+
+	if (b->sector != sector) {
+		err = flash_flush(b);
+		flash_open(b, sector, job->failsafe);
+	}
+
+	uint32_t offset = job->dst - addr;
+	unsigned i = offset / FLASH_PAYLOAD_SIZE;
+	memcpy(b->buf + offset, job->data, job->len);
+	if (!(sectorReceived[sector][i / 8] & (1 << (i % 8)))) {
+		sectorReceived[sector][i / 8] |= 1 << (i % 8);
+		sectorPayloads[sector]++;
+	}
+
+	if (sectorPayloads[sector] == size / FLASH_PAYLOAD_SIZE) {
+		if (flash_flush(b) != HAL_SUCCESS) {
+			err = HAL_FAILED;
+		}
+	}
+	return err;
+}
+
+/*
+ * Forget what the update did to the sectors of this bank, the next update
+ * starts from the flash contents as if nothing was written before.
+ */
+ITCM_CODE static void flash_forget(flash_bank_t *b) {
+	b->sector = BOARD_FLASH_SECTORS;
+	for (unsigned sector = 0; sector < BOARD_FLASH_SECTORS; sector++) {
+		if (flash_sectors[sector].bank == b->bank) {
+			erasedSectors[sector] = 0;
+			memset(sectorReceived[sector], 0, sizeof(sectorReceived[sector]));
+			sectorPayloads[sector] = 0;
+			sectorFlushed[sector] = 0;
+			memset(&flash_crc[sector], 0, sizeof(flash_crc[sector]));
+		}
+	}
+}
+
+/*
+ * Bank worker, collects the payloads queued for its bank and programs them
+ * per sector, erases sectors of the erase-ahead range while its queue is
+ * empty.
+ */
+ITCM_CODE static THD_FUNCTION(FlashBankThread, arg) {
+	flash_bank_t *b = arg;
+	chRegSetThreadName(b->bank == FLASH_BANK_1 ? "flash-bank1" : "flash-bank2");
+
+	while (true) {
+		unsigned sector = flash_erase_ahead_next(b->bank);
+		msg_t msg;
+
+		if (chMBFetchTimeout(&b->mb, &msg, sector < BOARD_FLASH_SECTORS ? TIME_IMMEDIATE : TIME_INFINITE) == MSG_OK) {
+			flash_job_t *job = (flash_job_t *)msg;
+			if (job == NULL) {
+				continue; // wake up, the erase-ahead range changed
+			}
+
+			systime_t t = chVTGetSystemTimeX();
+			bool err;
+			if (msg == FLASH_MSG_FLUSH) {
+				err = flash_flush(b);
+				job = NULL;
+			} else if (msg == FLASH_MSG_RESET) {
+				flash_forget(b);
+				err = HAL_SUCCESS;
+				job = NULL;
+			} else {
+				err = flash_do_job(b, job);
+				chPoolFree(&flash_job_pool, job);
+			}
+			flash_stats_add(&flash_stats.busy_ms[b->bank - FLASH_BANK_1], TIME_I2MS(chTimeDiffX(t, chVTGetSystemTimeX())));
+
+			chSysLock();
+			if (err != HAL_SUCCESS) {
+				flash_error = true;
+			}
+			if (--flash_pending == 0) {
+				chBSemSignalI(&flash_idle);
+			}
+			if (job != NULL) {
+				chSemSignalI(&flash_jobs_free);
+			}
+			chSchRescheduleS();
+			chSysUnlock();
+		} else {
+			systime_t t = chVTGetSystemTimeX();
+			chSysLock();
+			bool failsafe = erase_ahead.failsafe;
+			chSysUnlock();
+			if (flash_erase_sector(sector, flash_sector_addr(sector), flash_func_sector_size(sector), failsafe)) {
+				uint32_t ms = TIME_I2MS(chTimeDiffX(t, chVTGetSystemTimeX()));
+				flash_stats_add(&flash_stats.erase_ahead, 1);
+				flash_stats_add(&flash_stats.erase_ahead_ms, ms);
+				flash_stats_add(&flash_stats.busy_ms[b->bank - FLASH_BANK_1], ms);
+			}
+		}
+	}
+}
+
+/*
+ * Hint the address range an update is going to write, the sectors in
+ * [start, end) are erased in the background. An empty range cancels.
+ */
+ITCM_CODE void flash_erase_ahead(uint32_t start, uint32_t end, bool failsafe) {
+#ifdef USE_DIFFERENTIAL_FLASH
+	// sectors are compared before they're erased, except in failsafe mode
+	if (!failsafe) {
+		start = end = 0;
+	}
+#endif
+	chSysLock();
+	erase_ahead.start = start;
+	erase_ahead.end = end;
+	erase_ahead.failsafe = failsafe;
+	chSysUnlock();
+	if (start < end) {
+		for (unsigned i = 0; i < 2; i++) {
+			// a full mailbox means the worker is awake anyway
+			chMBPostTimeout(&flash_banks[i].mb, (msg_t)NULL, TIME_IMMEDIATE);
+		}
+	}
+}
+
+void flash_print_stats(void) {
+	int32_t saved = flash_stats.erase_ahead_ms + flash_stats.erase_sync_ms - flash_stats.stall_ms;
+	dbg_printf("erase: %u ahead (%u ms), %u sync (%u ms), stalled %u ms, saved %d ms\r\n",
+		flash_stats.erase_ahead, flash_stats.erase_ahead_ms,
+		flash_stats.erase_sync, flash_stats.erase_sync_ms,
+		flash_stats.stall_ms, saved);
+	dbg_printf("busy: bank1 %u ms, bank2 %u ms\r\n",
+		flash_stats.busy_ms[0], flash_stats.busy_ms[1]);
+	dbg_printf("latency: erase max %u ms, program sector avg %u us max %u us\r\n",
+		flash_stats.erase_max_ms,
+		flash_stats.program ? flash_stats.program_us / flash_stats.program : 0,
+		flash_stats.program_max_us);
+	dbg_printf("sectors: %u programmed, %u partial\r\n",
+		flash_stats.program, flash_stats.flush_partial);
+#ifdef USE_BENCHMARK
+	// 1000 us when the USB interrupt was never held up
+	dbg_printf("usb: longest SOF gap %u us\r\n", flash_stats.sof_gap_max_us);
+#endif
+#ifdef USE_DIFFERENTIAL_FLASH
+	dbg_printf("diff: %u sectors skipped, %u rewritten\r\n",
+		flash_stats.diff_skipped, flash_stats.diff_rewritten);
+#endif
+}
+
+void flash_init(void) {
+	unsigned sector = 0;
+	for (unsigned r = 0; r < sizeof(flash_runs) / sizeof(flash_runs[0]); r++) {
+		for (unsigned i = 0; i < flash_runs[r].count; i++, sector++) {
+			flash_sectors[sector].start = flash_runs[r].start + i * flash_runs[r].size;
+			flash_sectors[sector].sector_number = flash_runs[r].sector_number + i;
+			flash_sectors[sector].size = flash_runs[r].size;
+			flash_sectors[sector].bank = flash_runs[r].bank;
+		}
+	}
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i << 24;
+		for (unsigned j = 0; j < 8; j++) {
+			crc = (crc & 0x80000000) ? (crc << 1) ^ CRC32_POLY : crc << 1;
+		}
+		crc32_table[i] = crc;
+	}
+
+	chPoolLoadArray(&flash_job_pool, flash_jobs, FLASH_QUEUE_LEN);
+	for (unsigned i = 0; i < 2; i++) {
+		chMBObjectInit(&flash_banks[i].mb, flash_banks[i].mb_buf, FLASH_QUEUE_LEN);
+		flash_banks[i].sector = BOARD_FLASH_SECTORS;
+		flash_banks[i].buf = flash_buf[i];
+#if FLASH_USE_IRQ
+		chBSemObjectInit(&flash_banks[i].done, true);
+#endif
+	}
+#if FLASH_USE_IRQ
+	nvicEnableVector(FLASH_IRQn, STM32_FLASH_IRQ_PRIORITY);
+#endif
+	chThdCreateStatic(waFlashBank1, sizeof(waFlashBank1), LOWPRIO, FlashBankThread, &flash_banks[0]);
+	chThdCreateStatic(waFlashBank2, sizeof(waFlashBank2), LOWPRIO, FlashBankThread, &flash_banks[1]);
+}
+
+/*
+ * CRC all sectors written by the update with the flash CRC unit and compare
+ * with the CRC of the contents they were programmed with, call after
+ * flash_sync().
+ * Returns HAL_SUCCESS when all written sectors match.
+ */
+bool flash_verify(void) {
+	bool err = HAL_SUCCESS;
+
+	for (unsigned sector = 0; sector < BOARD_FLASH_SECTORS; sector++) {
+		if (!flash_crc[sector].written) {
+			continue;
+		}
+
+		FLASH_CRCInitTypeDef crcInit;
+		crcInit.TypeCRC = FLASH_CRC_SECTORS;
+		crcInit.BurstSize = FLASH_CRC_BURST_SIZE_256;
+		crcInit.Bank = flash_sectors[sector].bank;
+		crcInit.Sector = flash_sectors[sector].sector_number;
+		crcInit.NbSectors = 1;
+
+		systime_t t = chVTGetSystemTimeX();
+		flash_unlock_bank(crcInit.Bank);
+		if (HAL_FLASHEx_ComputeCRC(&crcInit, &flash_crc[sector].crc) != HAL_OK) {
+			flash_crc[sector].crc = ~flash_crc[sector].expected;
+		}
+		flash_lock_bank(crcInit.Bank);
+
+		flash_crc[sector].ok = flash_crc[sector].crc == flash_crc[sector].expected;
+		if (!flash_crc[sector].ok) {
+			err = HAL_FAILED;
+		}
+		dbg_printf("crc sector %u: %08x expected %08x, %u us\r\n", sector,
+			flash_crc[sector].crc, flash_crc[sector].expected,
+			TIME_I2US(chTimeDiffX(t, chVTGetSystemTimeX())));
+	}
+	return err;
+}
+
+/*
+ * Hand a job to the worker of the bank of sector, len 0 erases the sector.
+ */
+ITCM_CODE static void flash_post(unsigned sector, uint32_t dst, const uint8_t *src, uint32_t len, bool failsafe) {
+	systime_t t = chVTGetSystemTimeX();
+	chSemWait(&flash_jobs_free);
+	flash_stats_add(&flash_stats.stall_ms, TIME_I2MS(chTimeDiffX(t, chVTGetSystemTimeX())));
+
+	flash_job_t *job = chPoolAlloc(&flash_job_pool);
+	job->dst = dst;
+	job->len = len;
+	job->failsafe = failsafe;
+	if (len) {
+		memcpy(job->data, src, len);
+	}
+
+	chSysLock();
+	flash_pending++;
+	chSysUnlock();
+	chMBPostTimeout(&flash_banks[flash_sectors[sector].bank - FLASH_BANK_1].mb, (msg_t)job, TIME_INFINITE);
+}
+
+/*
+ * Queue a flash write, payloads are collected per sector and the sector is
+ * erased if necessary and programmed once it is complete. Blocks only while
+ * the queue is full.
+ *
+ * When failsafe=true don't check if the sector is empty to not fail on ECC errors.
+ * Returns HAL_SUCCESS when the payload was queued, programming errors are
+ * reported by flash_sync().
+ */
+ITCM_CODE bool flash_write(uint32_t dst, const uint8_t *src, int len, bool failsafe) {
+	uint32_t addr;
+	uint32_t size;
+	unsigned sector = flash_find_sector(dst, &addr, &size);
+
+	if (sector == 0 || sector >= BOARD_FLASH_SECTORS) {// Bootloader sector should not be erased
+		return HAL_FAILED; //PANIC("invalid sector");
+	}
+	if (len <= 0 || len > (int)sizeof(flash_jobs[0].data) || dst - addr + len > size) {
+		return HAL_FAILED;
+	}
+
+	flash_post(sector, dst, src, len, failsafe);
+
+	return HAL_SUCCESS;
+}
+
+/*
+ * Queue an erase of the sectors in [start, end), both must be sector
+ * boundaries. Payloads queued before are dropped, payloads queued after
+ * are written to the erased sectors.
+ * Returns HAL_SUCCESS when the erases were queued, errors are reported by
+ * flash_sync().
+ */
+ITCM_CODE bool flash_erase(uint32_t start, uint32_t end) {
+	uint32_t addr;
+	uint32_t size;
+	unsigned sector = flash_find_sector(start, &addr, &size);
+
+	if (sector == 0 || sector >= BOARD_FLASH_SECTORS || addr != start || end <= start) {
+		return HAL_FAILED;
+	}
+	if (end != BOARD_FLASH_BASE + BOARD_FLASH_SIZE &&
+		(flash_find_sector(end, &addr, &size) >= BOARD_FLASH_SECTORS || addr != end)) {
+		return HAL_FAILED;
+	}
+
+	for (addr = start; addr < end; addr += size) {
+		sector = flash_find_sector(addr, &addr, &size);
+		flash_post(sector, addr, NULL, 0, true);
+	}
+	return HAL_SUCCESS;
+}
+
+/*
+ * Post msg to both workers and wait until they are done with everything
+ * queued. Returns HAL_FAILED when a job failed since the last call.
+ * Callers from other threads wait their turn.
+ */
+ITCM_CODE static bool flash_post_all(msg_t msg) {
+	chMtxLock(&flash_wait_mtx);
+	chSysLock();
+	flash_pending += 2;
+	chSysUnlock();
+	for (unsigned i = 0; i < 2; i++) {
+		chMBPostTimeout(&flash_banks[i].mb, msg, TIME_INFINITE);
+	}
+
+	chSysLock();
+	while (flash_pending > 0) {
+		chBSemWaitTimeoutS(&flash_idle, TIME_INFINITE);
+	}
+	bool err = flash_error ? HAL_FAILED : HAL_SUCCESS;
+	flash_error = false;
+	chSysUnlock();
+	chMtxUnlock(&flash_wait_mtx);
+	return err;
+}
+
+/*
+ * Wait until all queued writes are programmed.
+ * Returns HAL_SUCCESS when all of them were programmed without errors.
+ */
+ITCM_CODE bool flash_sync(void) {
+	systime_t t = chVTGetSystemTimeX();
+
+	// let the workers write out the sectors they're collecting
+	bool err = flash_post_all(FLASH_MSG_FLUSH);
+
+	flash_stats_add(&flash_stats.stall_ms, TIME_I2MS(chTimeDiffX(t, chVTGetSystemTimeX())));
+	return err;
+}
+
+/*
+ * Drop the state of the current update after it failed: the erase-ahead
+ * range, which sectors were erased, collected and written, and their CRCs.
+ * A retry then erases and programs every sector again. Call after
+ * flash_sync().
+ */
+ITCM_CODE void flash_reset(void) {
+	flash_erase_ahead(0, 0, false);
+	flash_post_all(FLASH_MSG_RESET);
 }
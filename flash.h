@@ -1,3 +1,63 @@
+#ifndef FLASH_H
+#define FLASH_H
+
 #include "hal.h"
+#include "portab.h"
+#include "uf2cfg.h"
+
+/*
+ * Index of the sector containing addr, constant time and usable in #if.
+ * Addresses past the end give BOARD_FLASH_SECTORS.
+ */
+#define FLASH_RUN_INDEX(addr, start, count, size, bank, snb)                  \
+  + ((addr) < (start) ? 0 :                                                   \
+     ((addr) - (start)) / (size) < (count) ? ((addr) - (start)) / (size) : (count))
+#define FLASH_SECTOR_INDEX(addr) (0 BOARD_FLASH_LAYOUT(FLASH_RUN_INDEX, addr))
+
+/* addr is the start of a sector or the end of the flash */
+#define FLASH_RUN_BOUNDARY(addr, start, count, size, bank, snb)               \
+  || ((addr) >= (start) && (addr) <= (start) + (count) * (size) &&            \
+      ((addr) - (start)) % (size) == 0)
+#define FLASH_SECTOR_BOUNDARY(addr) (0 BOARD_FLASH_LAYOUT(FLASH_RUN_BOUNDARY, addr))
+
+typedef struct {
+	uint32_t erase_ahead;       // sectors erased in the background
+	uint32_t erase_ahead_ms;    // time spent on background erases
+	uint32_t erase_sync;        // sectors erased while writing
+	uint32_t erase_sync_ms;     // time spent on erases while writing
+	uint32_t stall_ms;          // time the write path waited for the flash
+	uint32_t busy_ms[2];        // time each bank spent erasing and programming
+	uint32_t erase_max_ms;      // slowest sector erase
+	uint32_t program;           // sectors programmed
+	uint32_t program_us;        // time spent programming sectors
+	uint32_t program_max_us;    // slowest sector
+	uint32_t flush_partial;     // sectors written out before all payloads arrived
+	uint32_t diff_skipped;      // sectors left untouched
+	uint32_t diff_rewritten;    // sectors erased after a differing payload
+#ifdef USE_BENCHMARK
+	uint32_t sof_gap_max_us;    // longest time between USB start of frame interrupts
+#endif
+} flash_stats_t;
+
+extern flash_stats_t flash_stats;
+
+typedef struct {
+	bool written;               // sector was written by the update
+	bool ok;                    // flash contents match what was programmed
+	uint32_t expected;          // CRC of the sector contents when programmed
+	uint32_t crc;               // CRC computed by the flash CRC unit
+} flash_crc_t;
+
+extern flash_crc_t flash_crc[BOARD_FLASH_SECTORS];
+
+void flash_init(void);
+bool flash_write(uint32_t dst, const uint8_t *src, int len, bool failsafe);
+bool flash_erase(uint32_t start, uint32_t end);
+bool flash_sync(void);
+void flash_reset(void);
+bool flash_verify(void);
+uint32_t flash_crc32(uint32_t crc, const uint8_t *data, uint32_t len);
+void flash_erase_ahead(uint32_t start, uint32_t end, bool failsafe);
+void flash_print_stats(void);
 
-void flash_write(uint32_t dst, const uint8_t *src, int len, bool failsafe);
+#endif /* FLASH_H */
@@ -46,36 +46,44 @@ int main(void) {
     reset_to_uf2_bootloader();
   }
 
-  HAL_FLASH_Unlock();
-
-  // erase first sector
-  FLASH_EraseInitTypeDef eraseInit;
-  eraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
-  eraseInit.Banks = FLASH_BANK_1;
-  eraseInit.Sector = 0;
-  eraseInit.NbSectors = 1;
-  eraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
-
-  uint32_t sectorError = 0;
-  HAL_FLASHEx_Erase(&eraseInit, &sectorError);
-
-
-  // if (!is_blank(addr, size) | (sectorError != 0xffffffff))
-  // 	PANIC("failed to erase!");
-
-  for (uint32_t i = 0; i < bindata_len; i += 4) {
-    // flash_program_word(dst + i, *(uint32_t*)(src + i));
-    HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, dst + i,
-                      (uint32_t)bindata + i);
-    palToggleLine(PORTAB_FLASHER_LED);
+  bool ok = false;
+  for (int attempt = 0; attempt < 3 && !ok; attempt++) {
+    HAL_FLASH_Unlock();
+
+    // erase first sector
+    FLASH_EraseInitTypeDef eraseInit;
+    eraseInit.TypeErase = FLASH_TYPEERASE_SECTORS;
+    eraseInit.Banks = FLASH_BANK_1;
+    eraseInit.Sector = 0;
+    eraseInit.NbSectors = 1;
+    eraseInit.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+
+    uint32_t sectorError = 0;
+    ok = HAL_FLASHEx_Erase(&eraseInit, &sectorError) == HAL_OK;
+    // don't verify against stale cache lines of the old bootloader
+    cacheBufferInvalidate((void *)dst, FLASH_SECTOR_SIZE);
+
+    // every program operation writes a whole 256-bit flash word
+    for (uint32_t i = 0; ok && i < bindata_len; i += FLASH_NB_32BITWORD_IN_FLASHWORD * 4) {
+      ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, dst + i,
+                             (uint32_t)bindata + i) == HAL_OK;
+      palToggleLine(PORTAB_FLASHER_LED);
+    }
+
+    HAL_FLASH_Lock();
+    cacheBufferInvalidate((void *)dst, bindata_len);
+
+    ok = ok && memcmp((void *)dst, bindata, bindata_len) == 0;
   }
 
-  // TODO: implement error checking
-  // ccrc = CalcCRC32((uint8_t *)(SDRAM_BANK_ADDR + 0x010), flength);
-
-  // if (memcmp((void*)dst, src, len) != 0) {
-  // 	PANIC("failed to write");
-  // }
+  if (!ok) {
+    // don't reset into a broken bootloader, keep power on so the flasher
+    // can be run again
+    while (true) {
+      palToggleLine(PORTAB_FLASHER_LED);
+      chThdSleepMilliseconds(100);
+    }
+  }
 
   // self destruct
   // note: writing flash that's not empty is dangerous, it could mess up ECC
@@ -86,8 +94,6 @@ int main(void) {
   // HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, APP_LOAD_ADDRESS, (uint32_t)&empty);
   // HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, APP_LOAD_ADDRESS + 4, (uint32_t)&empty);
 
-  HAL_FLASH_Lock();
-
   palClearLine(PORTAB_FLASHER_LED);
   reset_to_uf2_bootloader();
 }
@@ -26,6 +26,7 @@
 
 #include "ghostdisk.h"
 #include "ghostfat.h"
+#include "flash.h"
 
 #include <string.h>
 
@@ -48,16 +49,16 @@
 /*
  * Interface implementation.
  */
-static bool overflow(const GhostDisk *rd, uint32_t startblk, uint32_t n) {
+ITCM_CODE static bool overflow(const GhostDisk *rd, uint32_t startblk, uint32_t n) {
   return (startblk + n) > rd->blk_num;
 }
 
-static bool is_inserted(void *instance) {
+ITCM_CODE static bool is_inserted(void *instance) {
   (void)instance;
   return true;
 }
 
-static bool is_protected(void *instance) {
+ITCM_CODE static bool is_protected(void *instance) {
   GhostDisk *rd = instance;
   if (BLK_READY == rd->state) {
     return rd->readonly;
@@ -67,7 +68,7 @@ static bool is_protected(void *instance) {
   }
 }
 
-static bool connect(void *instance) {
+ITCM_CODE static bool connect(void *instance) {
   GhostDisk *rd = instance;
   if (BLK_STOP == rd->state) {
     rd->state = BLK_READY;
@@ -75,55 +76,69 @@ static bool connect(void *instance) {
   return HAL_SUCCESS;
 }
 
-static bool disconnect(void *instance) {
+/*
+ * The host ejected the medium, after a complete update the bootloader resets
+ * shortly after.
+ */
+ITCM_CODE static bool disconnect(void *instance) {
   GhostDisk *rd = instance;
   if (BLK_STOP != rd->state) {
+    if (!ghostfat_eject()) {
+      return HAL_FAILED;
+    }
     rd->state = BLK_STOP;
   }
   return HAL_SUCCESS;
 }
 
-static bool read(void *instance, uint32_t startblk,
+ITCM_CODE static bool read(void *instance, uint32_t startblk,
                  uint8_t *buffer, uint32_t n) {
 
-  // assert n == 1
   GhostDisk *rd = instance;
 
   if (overflow(rd, startblk, n)) {
     return HAL_FAILED;
   }
   else {
-    read_block(startblk, buffer);
+    for (uint32_t i = 0; i < n; i++) {
+      read_block(startblk + i, buffer + i * rd->blk_size);
+    }
     return HAL_SUCCESS;
   }
 }
 
-static bool write(void *instance, uint32_t startblk,
+ITCM_CODE static bool write(void *instance, uint32_t startblk,
                 const uint8_t *buffer, uint32_t n) {
 
-  // assert n == 1
   GhostDisk *rd = instance;
   if (overflow(rd, startblk, n)) {
     return HAL_FAILED;
   }
   else {
-    write_block(startblk, buffer);
+    for (uint32_t i = 0; i < n; i++) {
+      write_block(startblk + i, buffer + i * rd->blk_size);
+    }
     return HAL_SUCCESS;
   }
 }
 
-static bool sync(void *instance) {
+ITCM_CODE static bool sync(void *instance) {
 
   GhostDisk *rd = instance;
   if (BLK_READY != rd->state) {
     return HAL_FAILED;
   }
   else {
-    return HAL_SUCCESS;
+    // program the sectors still being collected, not while the bulk
+    // interface writes
+    ghostfat_lock();
+    bool err = flash_sync();
+    ghostfat_unlock();
+    return err;
   }
 }
 
-static bool get_info(void *instance, BlockDeviceInfo *bdip) {
+ITCM_CODE static bool get_info(void *instance, BlockDeviceInfo *bdip) {
 
   GhostDisk *rd = instance;
   if (BLK_READY != rd->state) {
@@ -26,6 +26,11 @@ DEALINGS IN THE SOFTWARE.
 #include "portab.h"
 #include "uf2.h"
 #include "flash.h"
+#include "bootloader.h"
+#include "ghostfat.h"
+#include "msd.h"
+#include "debug.h"
+#include "chprintf.h"
 #include <string.h>
 
 typedef struct {
@@ -71,7 +76,7 @@ typedef struct {
  * Length of text file string, terminated by \0 or invalid utf-8
  * and max 512 bytes long to fit in a single block.
  */
-size_t fileLength(const char *s) {
+ITCM_CODE size_t fileLength(const char *s) {
     const char *s0 = s;
     while (*s++ && *s < 0xf8 && s <= s0 + 512)
         ;
@@ -85,7 +90,7 @@ typedef struct {
 /**
  * Size of segmented file
  */
-size_t segmentedFileLength(uint32_t addr, int n) {
+ITCM_CODE size_t segmentedFileLength(uint32_t addr, int n) {
     FileSegment *f = (FileSegment*)addr;
     size_t size = 0;
     for (int i=0; i<n; i++) {
@@ -101,7 +106,7 @@ size_t segmentedFileLength(uint32_t addr, int n) {
 /**
  * Get segmented file sector
  */
-void segmentedFileGetSector(uint32_t addr, int n, int sectorIdx, uint8_t *data) {
+ITCM_CODE void segmentedFileGetSector(uint32_t addr, int n, int sectorIdx, uint8_t *data) {
     FileSegment *f = (FileSegment*)addr;
     unsigned int pfile = 0, psector = 0;
     unsigned int begin = sectorIdx * 512;
@@ -128,11 +133,29 @@ void segmentedFileGetSector(uint32_t addr, int n, int sectorIdx, uint8_t *data)
 
 #define VALID_FLASH_ADDR(addr, sz) (USER_FLASH_START <= (addr) && (addr) + (sz) <= USER_FLASH_END)
 
-struct TextFile {
+/*
+ * A file of the drive. The sectors are generated by read() when the host
+ * reads them, size() gives the size for the directory.
+ */
+typedef struct VirtualFile VirtualFile;
+struct VirtualFile {
     const char name[11];
-    const char *content;
+    uint32_t (*size)(const VirtualFile *f);
+    // sector is counted from the start of the file
+    void (*read)(const VirtualFile *f, uint32_t sector, uint8_t *data);
+    const char *content;        // text files
+    uint32_t addr;              // flash exported as UF2
+    uint32_t length;
+    struct Uf2Index *index;     // its non-blank blocks, for a sparse export
+    uint32_t reserve;           // clusters are allocated for at least this size
+    uint8_t flags;
 };
 
+// only listed in benchmark mode
+#define FILE_BENCH 0x01
+// sectors are the flash at addr, the host can read them in place
+#define FILE_MAPPED 0x02
+
 #define NUM_FAT_BLOCKS UF2_NUM_BLOCKS
 
 #define STR0(x) #x
@@ -152,68 +175,80 @@ const char indexFile[] = //
     "</body>"
     "</html>\n";
 
-// File list
-static const struct TextFile info[] = {
-    // Simple text files, max 512 bytes per file
-    {.name = "INFO_UF2TXT", .content = infoUf2File},
-    {.name = "INDEX   HTM", .content = indexFile},
-#ifdef FWVERSIONFILE
-    {.name = "INFO_FW TXT", .content = (char*)FWVERSIONFILE},
+// Result of the last update, filled in when it completes
+static char statusFile[512] = "No update\r\n";
+
+/*
+ * Drive layout. Every file starts on a cluster, ghostfat_init() allocates
+ * them in the order of the file table.
+ */
+#ifndef GHOSTFAT_SECTORS_PER_CLUSTER
+#define GHOSTFAT_SECTORS_PER_CLUSTER 1
 #endif
-    // Custom handled files
-    {.name = "CURRENT UF2"},
-#ifdef USE_CONFIGFILE
-    {.name = "CONFIG  UF2"},
-    {.name = "CONFIG  HTM"},
+#ifndef GHOSTFAT_FAT_COPIES
+#define GHOSTFAT_FAT_COPIES 2
 #endif
-};
-#define NUM_INFO (int)(sizeof(info) / sizeof(info[0]))
-#ifdef FWVERSIONFILE
-#define START_CUSTOM_FILES 3
-#else
-#define START_CUSTOM_FILES 2
+#define SECTORS_PER_CLUSTER GHOSTFAT_SECTORS_PER_CLUSTER
+#define CLUSTER_SIZE (SECTORS_PER_CLUSTER * 512)
+#define CLUSTERS(size) (((size) + CLUSTER_SIZE - 1) / CLUSTER_SIZE)
+
+// entries of the file table
+#ifndef GHOSTFAT_MAX_FILES
+#define GHOSTFAT_MAX_FILES 16
 #endif
 
-#define UF2_INDEX START_CUSTOM_FILES
 #define UF2_SIZE (BOARD_FLASH_SIZE * 2)
-#define UF2_SECTORS (UF2_SIZE / 512)
-#define UF2_FIRST_SECTOR (START_CUSTOM_FILES)
-#define UF2_LAST_SECTOR (uint32_t)(UF2_FIRST_SECTOR + UF2_SECTORS - 1)
-
 #ifdef USE_CONFIGFILE
-#define CFGUF2_INDEX (START_CUSTOM_FILES + 1)
 #define CFGUF2_SIZE (128 * 1024 * 2)
-#define CFGUF2_SECTORS (CFGUF2_SIZE / 512)
-#define CFGUF2_FIRST_SECTOR (UF2_LAST_SECTOR + 1)
-#define CFGUF2_LAST_SECTOR (CFGUF2_FIRST_SECTOR + CFGUF2_SECTORS - 1)
-
-size_t cfghtm_size;
-#define CFGHTM_INDEX (START_CUSTOM_FILES + 2)
-#define CFGHTM_SIZE cfghtm_size
-#define CFGHTM_SECTORS ((CFGHTM_SIZE + 511) / 512)
-#define CFGHTM_FIRST_SECTOR (CFGUF2_LAST_SECTOR + 1)
-#define CFGHTM_LAST_SECTOR (CFGHTM_FIRST_SECTOR + CFGHTM_SECTORS - 1)
+#endif
+#ifdef USE_BENCHMARK
+#define BENCHBIN_SIZE (4 * 1024 * 1024)
 #endif
 
 #define RESERVED_SECTORS 1
 #define ROOT_DIR_SECTORS 4
 #define CLUSTER_OFFSET 2
-#define SECTORS_PER_FAT ((NUM_FAT_BLOCKS * 2 + 511) / 512)
+#define TOTAL_SECTORS (NUM_FAT_BLOCKS - 2)
+
+/*
+ * Hosts tell FAT12 from FAT16 by the number of clusters. The FAT is sized
+ * for the clusters there would be without it, that's at most a sector more
+ * than needed.
+ */
+#define MAX_CLUSTERS (TOTAL_SECTORS / SECTORS_PER_CLUSTER)
+#define FAT_IS_FAT12 (MAX_CLUSTERS < 4085)
+#if FAT_IS_FAT12
+#define SECTORS_PER_FAT (((MAX_CLUSTERS + 2) * 3 / 2 + 1 + 511) / 512)
+#define FAT_MEDIA 0xff0
+#define FAT_EOC 0xfff
+#else
+#define SECTORS_PER_FAT (((MAX_CLUSTERS + 2) * 2 + 511) / 512)
+#define FAT_MEDIA 0xfff0
+#define FAT_EOC 0xffff
+#endif
 
 #define START_FAT0 RESERVED_SECTORS
-#define START_FAT1 (START_FAT0 + SECTORS_PER_FAT)
-#define START_ROOTDIR (START_FAT1 + SECTORS_PER_FAT)
+#define START_ROOTDIR (START_FAT0 + GHOSTFAT_FAT_COPIES * SECTORS_PER_FAT)
 #define START_CLUSTERS (START_ROOTDIR + ROOT_DIR_SECTORS)
+#define NUM_CLUSTERS ((TOTAL_SECTORS - START_CLUSTERS) / SECTORS_PER_CLUSTER)
+
+#if !FAT_IS_FAT12 && (NUM_CLUSTERS < 4085 || NUM_CLUSTERS > 65524)
+#error "No FAT type for this number of clusters, change UF2_NUM_BLOCKS or GHOSTFAT_SECTORS_PER_CLUSTER"
+#endif
 
 static const FAT_BootBlock BootBlock = {
     .JumpInstruction = {0xeb, 0x3c, 0x90},
     .OEMInfo = "UF2 UF2 ",
     .SectorSize = 512,
-    .SectorsPerCluster = 1,
+    .SectorsPerCluster = SECTORS_PER_CLUSTER,
     .ReservedSectors = RESERVED_SECTORS,
-    .FATCopies = 2,
+    .FATCopies = GHOSTFAT_FAT_COPIES,
     .RootDirectoryEntries = (ROOT_DIR_SECTORS * 512 / 32),
-    .TotalSectors16 = NUM_FAT_BLOCKS - 2,
+#if TOTAL_SECTORS < 0x10000
+    .TotalSectors16 = TOTAL_SECTORS,
+#else
+    .TotalSectors32 = TOTAL_SECTORS,
+#endif
     .MediaDescriptor = 0xF8,
     .SectorsPerFAT = SECTORS_PER_FAT,
     .SectorsPerTrack = 1,
@@ -221,29 +256,183 @@ static const FAT_BootBlock BootBlock = {
     .ExtendedBootSig = 0x29,
     .VolumeSerialNumber = 0x00420042,
     .VolumeLabel = VOLUME_LABEL,
+#if FAT_IS_FAT12
+    .FilesystemIdentifier = "FAT12   ",
+#else
     .FilesystemIdentifier = "FAT16   ",
+#endif
 };
 
-static uint32_t resetTime;
-static uint32_t ms;
+// reset after the update or on inactivity, and re-enumeration after a failed
+// update. The timers signal the thread that called ghostfat_init(), which
+// handles them in ghostfat_handle_events()
+static virtual_timer_t resetTimer;
+static virtual_timer_t remountTimer;
+static thread_t *timerThread;
+// set when a timer expired, cleared when it's restarted or stopped before the
+// event is handled
+static volatile bool resetDue;
+static volatile bool remountDue;
 static bool failsafe_mode = false;
+// taken by write_block() and by the bulk interface, so an update from one
+// doesn't interleave with writes or a sync from the other
+static MUTEX_DECL(writeMutex);
+
+#ifdef USE_BENCHMARK
+// benchmark mode: BENCH.BIN is generated and UF2 blocks are discarded, the
+// flash isn't touched
+static bool bench_mode = false;
+static struct {
+    systime_t readStart;    // first and last BENCH.BIN sector read
+    systime_t readEnd;
+    uint32_t readBytes;
+    systime_t sinkStart;    // first and last UF2 block written
+    systime_t sinkEnd;
+    uint32_t sinkBlocks;
+    uint32_t sinkBytes;     // payload of the discarded blocks
+    uint32_t fatSectors;    // FAT sectors generated
+    uint32_t fatCycles;     // and the time it took
+} bench;
+#endif
+
+// Clusters of the files in ascending order, one run per listed file that
+// isn't empty. Filled in by ghostfat_init(), the FAT sectors are generated
+// from it and the sectors of the files are looked up in it.
+typedef struct {
+    uint16_t first;
+    uint16_t last;
+    uint8_t file;               // index in the file table
+} ClusterRun;
+static ClusterRun clusterRuns[GHOSTFAT_MAX_FILES];
+static unsigned numClusterRuns;
+// start cluster of each file, 0 when it's empty or not listed
+static uint16_t fileCluster[GHOSTFAT_MAX_FILES];
+static bool fileListed[GHOSTFAT_MAX_FILES];
+// flash was written since the files were laid out
+static bool flashChanged;
+
+static void layout_files(void);
+
+// progress of the update, shown in STATUS.TXT and used to handle an eject
+enum {
+    UPDATE_NONE,
+    UPDATE_RECEIVING,
+    UPDATE_OK,
+    UPDATE_FAILED,          // until the drive re-enumerated with STATUS.TXT
+    UPDATE_FAILED_SHOWN,
+};
+static volatile uint8_t updateState = UPDATE_NONE;
+
+// time for the response to the eject to go out before resetting
+#define EJECT_RESET_DELAY 10
+
+ITCM_CODE static void reset_timer_cb(void *arg) {
+    (void)arg;
+    chSysLockFromISR();
+    resetDue = true;
+    chEvtSignalI(timerThread, GHOSTFAT_EVT_RESET);
+    chSysUnlockFromISR();
+}
+
+ITCM_CODE static void remount_timer_cb(void *arg) {
+    (void)arg;
+    chSysLockFromISR();
+    remountDue = true;
+    chEvtSignalI(timerThread, GHOSTFAT_EVT_REMOUNT);
+    chSysUnlockFromISR();
+}
 
-static void uf2_timer_start(int delay) {
-    resetTime = ms + delay;
+ITCM_CODE static void uf2_timer_start(int delay) {
+    chSysLock();
+    resetDue = false;
+    chVTSetI(&resetTimer, TIME_MS2I(delay), reset_timer_cb, NULL);
+    chSysUnlock();
 }
 
-// called roughly every 1ms
-void ghostfat_1ms(void) {
-    ms++;
+ITCM_CODE static void uf2_timer_stop(void) {
+    chSysLock();
+    resetDue = false;
+    chVTResetI(&resetTimer);
+    chSysUnlock();
+}
+
+ITCM_CODE static void remount_timer_start(int delay) {
+    chSysLock();
+    remountDue = false;
+    chVTSetI(&remountTimer, TIME_MS2I(delay), remount_timer_cb, NULL);
+    chSysUnlock();
+}
+
+ITCM_CODE static void remount_timer_stop(void) {
+    chSysLock();
+    remountDue = false;
+    chVTResetI(&remountTimer);
+    chSysUnlock();
+}
 
-    if (resetTime && ms >= resetTime) {
+/*
+ * Handles the expired timers, events is what the timer thread received of
+ * GHOSTFAT_EVENTS. May not return.
+ */
+ITCM_CODE void ghostfat_handle_events(eventmask_t events) {
+    if ((events & GHOSTFAT_EVT_RESET) && resetDue) {
+        // don't reset with writes still queued, and keep the bulk interface
+        // from queueing more
+        ghostfat_lock();
+        flash_sync();
         NVIC_SystemReset();
         while (1)
             ;
     }
+
+    if ((events & GHOSTFAT_EVT_REMOUNT) && remountDue) {
+        // re-enumerate so the host reads the new STATUS.TXT
+        remountDue = false;
+        if (USBD1.state == USB_UNINIT) {
+            // handed over by the application, there's no USB driver to
+            // re-enumerate with: restart with the bootloader's own drive
+            reset_to_uf2_bootloader();
+        }
+        usbDisconnectBus(&USBD1);
+        if (flashChanged) {
+            // the writes are synced, the UF2 exports may have changed size
+            layout_files();
+        }
+        chThdSleepMilliseconds(1000);
+        usbConnectBus(&USBD1);
+        if (updateState == UPDATE_FAILED) {
+            // the host reads STATUS.TXT now, an eject may reset
+            updateState = UPDATE_FAILED_SHOWN;
+        }
+    }
+}
+
+/*
+ * Write the verification result of the update to STATUS.TXT.
+ */
+static void update_status_file(bool synced, bool verified) {
+    char *p = statusFile;
+    char *end = statusFile + sizeof(statusFile);
+
+    p += chsnprintf(p, end - p, "Update %s\r\n", synced && verified ? "OK" : "FAILED");
+    if (synced && verified) {
+        p += chsnprintf(p, end - p, "Complete, eject the drive to start the firmware\r\n");
+    }
+    if (!synced) {
+        p += chsnprintf(p, end - p, "Flash write errors\r\n");
+    }
+    // one line per sector, 16 sectors fit in a single block
+    p += chsnprintf(p, end - p, "Sector CRC Expected\r\n");
+    for (unsigned i = 0; i < BOARD_FLASH_SECTORS; i++) {
+        if (flash_crc[i].written) {
+            p += chsnprintf(p, end - p, "%2u %08x %08x %s\r\n", i,
+                            flash_crc[i].crc, flash_crc[i].expected,
+                            flash_crc[i].ok ? "ok" : "BAD");
+        }
+    }
 }
 
-static void padded_memcpy(char *dst, const char *src, int len) {
+ITCM_CODE static void padded_memcpy(char *dst, const char *src, int len) {
     for (int i = 0; i < len; ++i) {
         if (*src)
             *dst = *src++;
@@ -253,7 +442,468 @@ static void padded_memcpy(char *dst, const char *src, int len) {
     }
 }
 
-int read_block(uint32_t block_no, uint8_t *data) {
+// first run that doesn't end before the cluster
+ITCM_CODE static unsigned find_cluster_run(uint32_t cluster) {
+    unsigned lo = 0, hi = numClusterRuns;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (clusterRuns[mid].last < cluster) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+#if FAT_IS_FAT12
+// FAT entry of a cluster, the clusters are looked up in ascending order
+ITCM_CODE static uint32_t fat_entry(uint32_t cluster, unsigned *run) {
+    if (cluster == 0) {
+        return FAT_MEDIA;
+    }
+    if (cluster == 1) {
+        return FAT_EOC;
+    }
+    while (*run < numClusterRuns && clusterRuns[*run].last < cluster) {
+        (*run)++;
+    }
+    if (*run == numClusterRuns || clusterRuns[*run].first > cluster) {
+        return 0;
+    }
+    return cluster == clusterRuns[*run].last ? FAT_EOC : cluster + 1;
+}
+#endif
+
+/*
+ * One sector of the FAT: the runs overlapping it are found with a binary
+ * search and filled in as chains, the rest stays free.
+ */
+ITCM_CODE static void fat_sector(uint32_t sectionIdx, uint8_t *data) {
+#if FAT_IS_FAT12
+    // pairs of 12 bit entries in 3 bytes, a pair can straddle two sectors
+    uint32_t begin = sectionIdx * 512;
+    uint32_t end = begin + 512;
+    unsigned run = find_cluster_run(begin / 3 * 2);
+
+    for (uint32_t pair = begin / 3; pair * 3 < end; pair++) {
+        uint32_t e0 = fat_entry(pair * 2, &run);
+        uint32_t e1 = fat_entry(pair * 2 + 1, &run);
+        uint8_t bytes[3] = {e0 & 0xff, (e0 >> 8) | ((e1 & 0xf) << 4), e1 >> 4};
+        for (uint32_t i = 0; i < 3; i++) {
+            uint32_t offset = pair * 3 + i;
+            if (offset >= begin && offset < end) {
+                data[offset - begin] = bytes[i];
+            }
+        }
+    }
+#else
+    uint16_t *fat = (uint16_t *)(void *)data;
+    uint32_t begin = sectionIdx * 256;
+    uint32_t end = begin + 256;
+
+    if (sectionIdx == 0) {
+        // media descriptor and the reserved cluster 1
+        fat[0] = FAT_MEDIA;
+        fat[1] = FAT_EOC;
+    }
+
+    for (unsigned r = find_cluster_run(begin);
+         r < numClusterRuns && clusterRuns[r].first < end; r++) {
+        uint32_t c = clusterRuns[r].first > begin ? clusterRuns[r].first : begin;
+        uint32_t stop = clusterRuns[r].last < end - 1 ? clusterRuns[r].last : end - 1;
+        for (; c < stop; c++) {
+            fat[c - begin] = c + 1;
+        }
+        fat[stop - begin] = stop == clusterRuns[r].last ? FAT_EOC : stop + 1;
+    }
+#endif
+}
+
+#ifdef USE_BENCHMARK
+// bytes per microsecond are MB/s, in hundredths
+static uint32_t bench_rate(uint32_t bytes, uint32_t us) {
+    return us ? (uint32_t)((uint64_t)bytes * 100 / us) : 0;
+}
+
+/*
+ * BENCH.TXT: the time the commands took on the device, from the CBW to the
+ * CSW, and the rates the host achieved including the time between commands.
+ * Padded to a full sector, the size in the directory.
+ */
+static void bench_report(const VirtualFile *f, uint32_t sector, uint8_t *data) {
+    static const char *const names[MSD_STATS_NUM] = {
+        "READ(10)", "WRITE(10)", "TEST UNIT", "SYNC CACHE", "other",
+    };
+    char *p = (char *)data;
+    char *end = p + 512;
+
+    (void)f;
+    if (sector != 0) {
+        return;
+    }
+    p += chsnprintf(p, end - p, "Benchmark mode, the flash is not accessed\r\n");
+    p += chsnprintf(p, end - p, "Command     Count  Avg us  Max us   MB/s\r\n");
+    for (unsigned i = 0; i < MSD_STATS_NUM; i++) {
+        const msd_cmd_stats_t *st = &USBMSD1.stats[i];
+        uint32_t rate = bench_rate(st->bytes, st->total_us);
+        p += chsnprintf(p, end - p, "%-10s %6u %7u %7u %3u.%02u\r\n", names[i], st->count,
+                        st->count ? st->total_us / st->count : 0, st->max_us,
+                        rate / 100, rate % 100);
+    }
+
+    uint32_t rate = bench_rate(bench.readBytes,
+                               TIME_I2US(chTimeDiffX(bench.readStart, bench.readEnd)));
+    p += chsnprintf(p, end - p, "BENCH.BIN read: %u bytes, %u.%02u MB/s\r\n",
+                    bench.readBytes, rate / 100, rate % 100);
+    rate = bench_rate(bench.sinkBytes, TIME_I2US(chTimeDiffX(bench.sinkStart, bench.sinkEnd)));
+    p += chsnprintf(p, end - p, "UF2 discarded: %u blocks, %u bytes, %u.%02u MB/s\r\n",
+                    bench.sinkBlocks, bench.sinkBytes, rate / 100, rate % 100);
+    p += chsnprintf(p, end - p, "FAT sector: %u cycles\r\n",
+                    bench.fatSectors ? bench.fatCycles / bench.fatSectors : 0);
+
+    if (p < end - 2) {
+        memset(p, ' ', end - 2 - p);
+        end[-2] = '\r';
+        end[-1] = '\n';
+    }
+}
+
+/*
+ * BENCH.BIN, every word holds its offset in the file.
+ */
+ITCM_CODE static void bench_fill(const VirtualFile *f, uint32_t sector, uint8_t *data) {
+    (void)f;
+    uint32_t *words = (uint32_t *)(void *)data;
+    uint32_t offset = sector * 512;
+
+    if (bench.readBytes == 0) {
+        bench.readStart = chVTGetSystemTimeX();
+    }
+    for (unsigned i = 0; i < 512 / 4; i++) {
+        words[i] = offset + i * 4;
+    }
+    bench.readEnd = chVTGetSystemTimeX();
+    bench.readBytes += 512;
+}
+
+/*
+ * A valid UF2 block written in benchmark mode. Once the host stops writing
+ * the drive is re-enumerated, so the host reads the new BENCH.TXT.
+ */
+ITCM_CODE static void bench_sink(const UF2_Block *bl) {
+    if (bench.sinkBlocks == 0) {
+        bench.sinkStart = chVTGetSystemTimeX();
+    }
+    bench.sinkEnd = chVTGetSystemTimeX();
+    bench.sinkBlocks++;
+    bench.sinkBytes += bl->payloadSize;
+    remount_timer_start(500);
+}
+
+ITCM_CODE static uint32_t fixed_size(const VirtualFile *f) {
+    return f->length;
+}
+#endif
+
+ITCM_CODE static uint32_t text_size(const VirtualFile *f) {
+    return f->content ? fileLength(f->content) : 0;
+}
+
+ITCM_CODE static void text_read(const VirtualFile *f, uint32_t sector, uint8_t *data) {
+    if (sector == 0 && f->content) {
+        memcpy(data, f->content, fileLength(f->content));
+    }
+}
+
+#ifdef GHOSTFAT_SPARSE_UF2
+/*
+ * Non-blank 256 byte blocks of a flash region exported as UF2. Blank blocks
+ * are left out of the file, a block of the file is found with the number of
+ * set bits before each word of the bitmap.
+ */
+typedef struct Uf2Index {
+    uint32_t *bits;             // bit set when the block isn't blank
+    uint16_t *rank;             // set bits in the words before
+    uint32_t count;             // set bits
+    bool valid;
+} Uf2Index;
+
+#define UF2_INDEX(name, len)                                \
+    static uint32_t name##Bits[(len) / 256 / 32];           \
+    static uint16_t name##Rank[(len) / 256 / 32];           \
+    static Uf2Index name = {name##Bits, name##Rank, 0, false}
+
+UF2_INDEX(currentIndex, BOARD_FLASH_SIZE);
+_Static_assert(BOARD_FLASH_SIZE % (256 * 32) == 0, "index takes whole words of blocks");
+#ifdef USE_CONFIGFILE
+UF2_INDEX(configIndex, CFGUF2_SIZE / 2);
+_Static_assert(CFGUF2_SIZE / 2 % (256 * 32) == 0, "index takes whole words of blocks");
+#endif
+
+static bool is_blank_block(const uint32_t *p) {
+    uint32_t acc = 0xffffffff;
+    for (int i = 0; i < 256 / 4; i++) {
+        acc &= p[i];
+    }
+    return acc == 0xffffffff;
+}
+
+static void uf2_index_scan(const VirtualFile *f) {
+    Uf2Index *ix = f->index;
+    const uint32_t *p = (const uint32_t *)f->addr;
+    uint32_t count = 0;
+
+    for (uint32_t w = 0; w < f->length / 256 / 32; w++) {
+        uint32_t bits = 0;
+        for (int b = 0; b < 32; b++, p += 256 / 4) {
+            if (!is_blank_block(p)) {
+                bits |= 1u << b;
+            }
+        }
+        ix->bits[w] = bits;
+        ix->rank[w] = count;
+        count += __builtin_popcount(bits);
+    }
+    ix->count = count;
+    ix->valid = true;
+}
+
+// flash block of block n of the file, n < count
+ITCM_CODE static uint32_t uf2_index_block(const Uf2Index *ix, uint32_t words, uint32_t n) {
+    // last word with at most n set bits before it
+    uint32_t lo = 0, hi = words - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (ix->rank[mid] <= n) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    uint32_t bits = ix->bits[lo];
+    for (uint32_t k = n - ix->rank[lo]; k > 0; k--) {
+        bits &= bits - 1;
+    }
+    return lo * 32 + __builtin_ctz(bits);
+}
+
+// scans when the files are laid out, the index is kept until flash is written
+ITCM_CODE static uint32_t uf2_size(const VirtualFile *f) {
+    if (!f->index->valid) {
+        uf2_index_scan(f);
+    }
+    return f->index->count * 512;
+}
+#else
+ITCM_CODE static uint32_t uf2_size(const VirtualFile *f) {
+    return f->length * 2;
+}
+#endif
+
+/*
+ * Flash exported as a UF2 file, 256 bytes per block.
+ */
+ITCM_CODE static void uf2_read(const VirtualFile *f, uint32_t sector, uint8_t *data) {
+#ifdef GHOSTFAT_SPARSE_UF2
+    uint32_t numBlocks = f->index->count;
+    if (sector >= numBlocks) {
+        // rest of the last cluster
+        return;
+    }
+    uint32_t words = f->length / 256 / 32;
+    uint32_t addr = f->addr + uf2_index_block(f->index, words, sector) * 256;
+#else
+    uint32_t addr = f->addr + sector * 256;
+    uint32_t numBlocks = f->length / 256;
+#endif
+    UF2_Block *bl = (void *)data;
+    bl->magicStart0 = UF2_MAGIC_START0;
+    bl->magicStart1 = UF2_MAGIC_START1;
+    bl->flags = UF2_FLAG_FAMILYID_PRESENT;
+    bl->targetAddr = addr;
+    bl->payloadSize = 256;
+    bl->blockNo = sector;
+    bl->numBlocks = numBlocks;
+    bl->familyID = UF2_FAMILY;
+    bl->magicEnd = UF2_MAGIC_END;
+
+    memcpy(bl->data, (void *)addr, bl->payloadSize);
+}
+
+#ifdef USE_CURRENTBIN
+/*
+ * Flash as a plain binary. With the sparse UF2 index the blank flash at the
+ * end is left out, the index of CURRENT.UF2 is up to date when this is laid
+ * out after it. The size is found once per layout, it's asked for on every
+ * read.
+ */
+#ifdef GHOSTFAT_SPARSE_UF2
+static uint32_t rawSize;
+static bool rawSizeValid;
+#endif
+
+ITCM_CODE static uint32_t raw_size(const VirtualFile *f) {
+#ifdef GHOSTFAT_SPARSE_UF2
+    if (rawSizeValid) {
+        return rawSize;
+    }
+    const Uf2Index *ix = f->index;
+    uint32_t first = (f->addr - BOARD_FLASH_BASE) / 256;
+    uint32_t b = first + f->length / 256;
+    while (b > first) {
+        uint32_t bits = ix->bits[(b - 1) / 32];
+        if (bits == 0 && b % 32 == 0 && b - 32 >= first) {
+            b -= 32;
+        } else if (bits & (1u << ((b - 1) % 32))) {
+            break;
+        } else {
+            b--;
+        }
+    }
+    // whole sectors, so every sector can be sent from flash
+    rawSize = ((b - first) * 256 + 511) / 512 * 512;
+    rawSizeValid = true;
+    return rawSize;
+#else
+    return f->length;
+#endif
+}
+
+ITCM_CODE static void raw_read(const VirtualFile *f, uint32_t sector, uint8_t *data) {
+    if (sector < f->size(f) / 512) {
+        memcpy(data, (void *)(f->addr + sector * 512), 512);
+    }
+}
+#endif
+
+#ifdef USE_CONFIGFILE
+static size_t cfghtm_size;
+
+ITCM_CODE static uint32_t cfghtm_file_size(const VirtualFile *f) {
+    (void)f;
+    return cfghtm_size;
+}
+
+ITCM_CODE static void cfghtm_read(const VirtualFile *f, uint32_t sector, uint8_t *data) {
+    (void)f;
+    segmentedFileGetSector(CONFIGHTM_FILE, CONFIGHTM_SEGMENTS, sector, data);
+}
+#endif
+
+#ifdef GHOSTFAT_SPARSE_UF2
+#define UF2_FILE_INDEX(ix) &ix
+#else
+#define UF2_FILE_INDEX(ix) NULL
+#endif
+#define TEXT_FILE(n, c) \
+    {.name = n, .size = text_size, .read = text_read, .content = c, .reserve = 512}
+#define UF2_FILE(n, a, l, ix) \
+    {.name = n, .size = uf2_size, .read = uf2_read, .addr = a, .length = l, .index = ix}
+
+// File list, INFO_UF2.TXT has to be first: it's the only file in failsafe mode
+static const VirtualFile files[] = {
+    // Simple text files, max 512 bytes per file
+    TEXT_FILE("INFO_UF2TXT", infoUf2File),
+    TEXT_FILE("INDEX   HTM", indexFile),
+    TEXT_FILE("STATUS  TXT", statusFile),
+#ifdef FWVERSIONFILE
+    TEXT_FILE("INFO_FW TXT", (char*)FWVERSIONFILE),
+#endif
+    UF2_FILE("CURRENT UF2", BOARD_FLASH_BASE, BOARD_FLASH_SIZE, UF2_FILE_INDEX(currentIndex)),
+#ifdef USE_CONFIGFILE
+    UF2_FILE("CONFIG  UF2", CFGUF2_ADDRESS, CFGUF2_SIZE / 2, UF2_FILE_INDEX(configIndex)),
+    {.name = "CONFIG  HTM", .size = cfghtm_file_size, .read = cfghtm_read},
+#endif
+#ifdef USE_CURRENTBIN
+    // after CURRENT.UF2, it uses its index
+    {.name = "CURRENT BIN", .size = raw_size, .read = raw_read, .addr = APP_LOAD_ADDRESS,
+     .length = USER_FLASH_END - APP_LOAD_ADDRESS, .index = UF2_FILE_INDEX(currentIndex),
+     .flags = FILE_MAPPED},
+#endif
+#ifdef USE_BENCHMARK
+    {.name = "BENCH   TXT", .size = fixed_size, .read = bench_report, .length = 512,
+     .flags = FILE_BENCH},
+    {.name = "BENCH   BIN", .size = fixed_size, .read = bench_fill, .length = BENCHBIN_SIZE,
+     .flags = FILE_BENCH},
+#endif
+};
+#define NUM_FILES (sizeof(files) / sizeof(files[0]))
+
+_Static_assert(NUM_FILES <= GHOSTFAT_MAX_FILES, "too many files, raise GHOSTFAT_MAX_FILES");
+_Static_assert(NUM_FILES < ROOT_DIR_SECTORS * 512 / 32, "root directory too small");
+
+// the files, and room for the host to write a new CURRENT.UF2 next to them
+_Static_assert(NUM_FILES + 2 * CLUSTERS(UF2_SIZE)
+#ifdef USE_CONFIGFILE
+               + CLUSTERS(CFGUF2_SIZE)
+#endif
+#ifdef USE_CURRENTBIN
+               + CLUSTERS(USER_FLASH_END - APP_LOAD_ADDRESS)
+#endif
+#ifdef USE_BENCHMARK
+               + CLUSTERS(BENCHBIN_SIZE)
+#endif
+               <= NUM_CLUSTERS, "UF2_NUM_BLOCKS is too small for the files and a new UF2 file");
+#ifdef USE_CURRENTBIN
+_Static_assert((USER_FLASH_END - APP_LOAD_ADDRESS) % 512 == 0, "CURRENT.BIN has to be whole sectors");
+#endif
+
+/*
+ * Allocate the clusters of the listed files, in the order of the table.
+ * The sizes are taken once, only text files change size later and they
+ * have a cluster reserved. After flash was written the files are laid out
+ * again before the drive re-enumerates.
+ */
+static void layout_files(void) {
+    uint32_t cluster = CLUSTER_OFFSET;
+
+#ifdef GHOSTFAT_SPARSE_UF2
+    for (unsigned i = 0; i < NUM_FILES; i++) {
+        if (files[i].index && flashChanged) {
+            files[i].index->valid = false;
+        }
+    }
+#ifdef USE_CURRENTBIN
+    rawSizeValid = false;
+#endif
+#endif
+    flashChanged = false;
+
+    numClusterRuns = 0;
+    for (unsigned i = 0; i < NUM_FILES; i++) {
+        const VirtualFile *f = &files[i];
+        fileListed[i] = !(failsafe_mode && i > 0);
+#ifdef USE_BENCHMARK
+        if ((f->flags & FILE_BENCH) && !bench_mode) {
+            fileListed[i] = false;
+        }
+#endif
+        fileCluster[i] = 0;
+        if (!fileListed[i]) {
+            continue;
+        }
+
+        uint32_t size = f->size(f);
+        uint32_t n = CLUSTERS(size > f->reserve ? size : f->reserve);
+        if (n == 0) {
+            continue;
+        }
+        if (cluster + n > NUM_CLUSTERS + CLUSTER_OFFSET) {
+            // doesn't fit, only CONFIG.HTM can grow this large
+            fileListed[i] = false;
+            continue;
+        }
+        fileCluster[i] = cluster;
+        clusterRuns[numClusterRuns].first = cluster;
+        clusterRuns[numClusterRuns].last = cluster + n - 1;
+        clusterRuns[numClusterRuns].file = i;
+        numClusterRuns++;
+        cluster += n;
+    }
+}
+
+ITCM_CODE int read_block(uint32_t block_no, uint8_t *data) {
     memset(data, 0, 512);
     uint32_t sectionIdx = block_no;
 
@@ -267,29 +917,15 @@ int read_block(uint32_t block_no, uint8_t *data) {
         // Send FAT0 or FAT1 (copy)
         sectionIdx -= START_FAT0;
         // logval("sidx", sectionIdx);
-        if (sectionIdx >= SECTORS_PER_FAT)
-            sectionIdx -= SECTORS_PER_FAT;
-        if (sectionIdx == 0) {
-            data[0] = 0xf0;
-            for (int i = 1; i < NUM_INFO * 2 + 4; ++i) {
-                data[i] = 0xff;
-            }
-        }
-        for (int i = 0; i < 256; ++i) {
-            uint32_t v = sectionIdx * 256 + i;
-            uint32_t sector = v - CLUSTER_OFFSET;
-            if (UF2_FIRST_SECTOR <= sector && sector <= UF2_LAST_SECTOR) {
-                ((uint16_t *)(void *)data)[i] = (sector == UF2_LAST_SECTOR) ? 0xffff : v + 1;
-            }
-#ifdef USE_CONFIGFILE
-            else if (CFGUF2_FIRST_SECTOR <= sector && sector <= CFGUF2_LAST_SECTOR) {
-                ((uint16_t *)(void *)data)[i] = (sector == CFGUF2_LAST_SECTOR) ? 0xffff : v + 1;
-            }
-            else if (CFGHTM_FIRST_SECTOR <= sector && sector <= CFGHTM_LAST_SECTOR) {
-                ((uint16_t *)(void *)data)[i] = (sector == CFGHTM_LAST_SECTOR) ? 0xffff : v + 1;
-            }
+        sectionIdx %= SECTORS_PER_FAT;
+#ifdef USE_BENCHMARK
+        rtcnt_t start = chSysGetRealtimeCounterX();
+#endif
+        fat_sector(sectionIdx, data);
+#ifdef USE_BENCHMARK
+        bench.fatSectors++;
+        bench.fatCycles += chSysGetRealtimeCounterX() - start;
 #endif
-        }
     } else if (block_no < START_CLUSTERS) {
         // Send root dir entry
         sectionIdx -= START_ROOTDIR;
@@ -297,95 +933,151 @@ int read_block(uint32_t block_no, uint8_t *data) {
             DirEntry *d = (void *)data;
             padded_memcpy(d->name, (const char *)BootBlock.VolumeLabel, 11);
             d->attrs = 0x28;
-            for (int i = 0; i < NUM_INFO; ++i) {
-                d++;
-                if (failsafe_mode && i >= 1) {
-                    break;
-                }
-                const struct TextFile *inf = &info[i];
-                if (i < START_CUSTOM_FILES) {
-                    d->size = inf->content ? fileLength(inf->content) : 0;
-                    d->startCluster = i + CLUSTER_OFFSET;
-                }
-                else if (i == UF2_INDEX) {
-                    d->size = UF2_SIZE;
-                    d->startCluster = UF2_FIRST_SECTOR + CLUSTER_OFFSET;
-                }
-#ifdef USE_CONFIGFILE
-                else if (i == CFGUF2_INDEX) {
-                    d->size = CFGUF2_SIZE;
-                    d->startCluster = CFGUF2_FIRST_SECTOR + CLUSTER_OFFSET;
+            for (unsigned i = 0; i < NUM_FILES; ++i) {
+                if (!fileListed[i]) {
+                    continue;
                 }
-                else if (i == CFGHTM_INDEX) {
-                    d->size = CFGHTM_SIZE;
-                    d->startCluster = CFGHTM_FIRST_SECTOR + CLUSTER_OFFSET;
+                d++;
+                const VirtualFile *f = &files[i];
+                d->size = f->size(f);
+                d->startCluster = fileCluster[i];
+                if (f->flags & FILE_MAPPED) {
+                    d->attrs = 0x01; // read-only
                 }
-#endif
-                padded_memcpy(d->name, inf->name, 11);
+                padded_memcpy(d->name, f->name, 11);
             }
         }
     } else {
         // Send file contents
         sectionIdx -= START_CLUSTERS;
-        if (failsafe_mode && sectionIdx >= 1) {
-            return 0;
-        }
-        if (sectionIdx < START_CUSTOM_FILES) {
-            // Send text file content from info struct (max 1 sector per file)
-            memcpy(data, info[sectionIdx].content, fileLength(info[sectionIdx].content));
-        } else {
-            // Custom file handling
-            if (sectionIdx <= UF2_LAST_SECTOR) {
-                // Send CURRENT.UF2 file
-                uint32_t blockNo = sectionIdx - UF2_FIRST_SECTOR;
-                uint32_t addr = blockNo * 256 + 0x08000000;
-                UF2_Block *bl = (void *)data;
-                bl->magicStart0 = UF2_MAGIC_START0;
-                bl->magicStart1 = UF2_MAGIC_START1;
-                bl->flags = UF2_FLAG_FAMILYID_PRESENT;
-                bl->targetAddr = addr;
-                bl->payloadSize = 256;
-                bl->blockNo = blockNo;
-                bl->numBlocks = BOARD_FLASH_SIZE / 256;
-                bl->familyID = UF2_FAMILY;
-                bl->magicEnd = UF2_MAGIC_END;
-
-                memcpy(bl->data, (void *)addr, bl->payloadSize);
-            }
-#ifdef USE_CONFIGFILE
-            else if (sectionIdx <= CFGUF2_LAST_SECTOR) {
-                // Send CONFIG.UF2
-                uint32_t blockNo = sectionIdx - CFGUF2_FIRST_SECTOR;
-                uint32_t addr = blockNo * 256 + CFGUF2_ADDRESS;
-                UF2_Block *bl = (void *)data;
-                bl->magicStart0 = UF2_MAGIC_START0;
-                bl->magicStart1 = UF2_MAGIC_START1;
-                bl->flags = UF2_FLAG_FAMILYID_PRESENT;
-                bl->targetAddr = addr;
-                bl->payloadSize = 256;
-                bl->blockNo = blockNo;
-                bl->numBlocks = CFGUF2_SIZE / 256;
-                bl->familyID = UF2_FAMILY;
-                bl->magicEnd = UF2_MAGIC_END;
-
-                memcpy(bl->data, (void *)addr, bl->payloadSize);
-            }
-            else if (sectionIdx <= CFGHTM_LAST_SECTOR) {
-                // Send CONFIG.HTM
-                uint32_t blockNo = sectionIdx - CFGHTM_FIRST_SECTOR;
-                segmentedFileGetSector(CONFIGHTM_FILE, CONFIGHTM_SEGMENTS, blockNo, data);
-            }
-#endif
+        uint32_t cluster = sectionIdx / SECTORS_PER_CLUSTER + CLUSTER_OFFSET;
+        unsigned r = find_cluster_run(cluster);
+        if (r < numClusterRuns && clusterRuns[r].first <= cluster) {
+            const VirtualFile *f = &files[clusterRuns[r].file];
+            f->read(f, sectionIdx - (clusterRuns[r].first - CLUSTER_OFFSET) * SECTORS_PER_CLUSTER, data);
         }
     }
 
     return 0;
 }
 
+/*
+ * Blocks of the drive the host can read straight from flash instead of a
+ * read_block() copy. Returns the flash of block_no and cuts *n to the
+ * blocks that follow it there, or NULL when block_no isn't mapped.
+ */
+ITCM_CODE const uint8_t *ghostfat_map_blocks(uint32_t block_no, uint32_t *n) {
+    if (block_no < START_CLUSTERS) {
+        return NULL;
+    }
+    uint32_t sectionIdx = block_no - START_CLUSTERS;
+    uint32_t cluster = sectionIdx / SECTORS_PER_CLUSTER + CLUSTER_OFFSET;
+    unsigned r = find_cluster_run(cluster);
+    if (r == numClusterRuns || clusterRuns[r].first > cluster) {
+        return NULL;
+    }
+    const VirtualFile *f = &files[clusterRuns[r].file];
+    if (!(f->flags & FILE_MAPPED)) {
+        return NULL;
+    }
+    uint32_t sector = sectionIdx - (clusterRuns[r].first - CLUSTER_OFFSET) * SECTORS_PER_CLUSTER;
+    uint32_t sectors = f->size(f) / 512;
+    if (sector >= sectors) {
+        // rest of the last cluster
+        return NULL;
+    }
+    if (*n > sectors - sector) {
+        *n = sectors - sector;
+    }
+    return (const uint8_t *)(f->addr + sector * 512);
+}
+
 WriteState wrState; // zero initialized
+static systime_t updateStart;
+static uint32_t updateBytes;
+// a block for the user flash wasn't queued, the image can't be complete
+static bool writeFailed;
 
-int write_block(uint32_t block_no, const uint8_t *data) {
-    (void)block_no;
+/*
+ * Let the flash erase ahead the sectors of the update, assuming the image
+ * is contiguous: targetAddr == base + blockNo * payloadSize for all blocks.
+ */
+ITCM_CODE static void erase_ahead_hint(const UF2_Block *bl) {
+    static uint32_t imageBase;
+    static bool contiguous;
+
+    if (wrState.numWritten == 0) {
+        contiguous = true;
+    }
+    if (!contiguous || bl->payloadSize != 256 || (bl->flags & UF2_FLAG_NOFLASH)) {
+        return;
+    }
+
+    uint32_t base = bl->targetAddr - bl->blockNo * bl->payloadSize;
+    if (wrState.numWritten == 0) {
+        imageBase = base;
+    } else if (base != imageBase) {
+        // not a simple image, only erase sectors when their data arrives
+        contiguous = false;
+        flash_erase_ahead(0, 0, failsafe_mode);
+        return;
+    }
+
+    if (wrState.numWritten == 0) {
+        uint32_t start = base < USER_FLASH_START ? USER_FLASH_START : base;
+        uint32_t end = base + wrState.numBlocks * bl->payloadSize;
+#ifdef DEVSPEC_FLASH_START
+        // device specific sector is only written after UID check
+        if (end > DEVSPEC_FLASH_START) {
+            end = DEVSPEC_FLASH_START;
+        }
+#endif
+        if (end > USER_FLASH_END) {
+            end = USER_FLASH_END;
+        }
+        flash_erase_ahead(start, end, failsafe_mode);
+    }
+}
+
+/*
+ * Whether a payload may be flashed: word aligned, within a 256 byte page of
+ * the user flash and for the device specific sector starting with the UID.
+ */
+ITCM_CODE static bool payload_allowed(uint32_t addr, const uint8_t *data, uint32_t len) {
+    if (len == 0 || len > 256 || (addr & 3) || (addr & 0xff) + len > 256 ||
+        !VALID_FLASH_ADDR(addr, len)) {
+        return false;
+    }
+
+#ifdef DEVSPEC_FLASH_START
+    // last sector is used to store device specific information, and should only be written if UID matches
+    if (addr >= DEVSPEC_FLASH_START) {
+        if (len < 12 ||
+            ((uint32_t*)data)[0] != ((uint32_t*)UID_BASE)[0] ||
+            ((uint32_t*)data)[1] != ((uint32_t*)UID_BASE)[1] ||
+            ((uint32_t*)data)[2] != ((uint32_t*)UID_BASE)[2]) {
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+/*
+ * Queue a payload for flashing, also used by the bulk protocol.
+ * Returns HAL_SUCCESS when it was queued, HAL_FAILED when it isn't allowed
+ * (see payload_allowed()) or the flash refused it.
+ */
+ITCM_CODE bool write_payload(uint32_t addr, const uint8_t *data, uint32_t len) {
+    if (!payload_allowed(addr, data, len)) {
+        return HAL_FAILED;
+    }
+
+    flashChanged = true;
+    return flash_write(addr, data, len, failsafe_mode);
+}
+
+ITCM_CODE static int write_uf2_block(const uint8_t *data) {
     const UF2_Block *bl = (const void *)data;
 
     if (!is_uf2_block(bl) || !UF2_IS_MY_FAMILY(bl) ||
@@ -393,6 +1085,13 @@ int write_block(uint32_t block_no, const uint8_t *data) {
         return 0;
     }
 
+#ifdef USE_BENCHMARK
+    if (bench_mode) {
+        bench_sink(bl);
+        return 0;
+    }
+#endif
+
     if (wrState.numBlocks == 0) {
         wrState.numBlocks = bl->numBlocks;
     }
@@ -404,20 +1103,21 @@ int write_block(uint32_t block_no, const uint8_t *data) {
 
     if (bl->numBlocks != wrState.numBlocks ||
         bl->blockNo >= bl->numBlocks) {
-        return 0; // TODO: error handling?
+        // a block of another UF2 file, it doesn't belong to this update
+        return 0;
     }
 
-    bool UID_check = true;
-#ifdef DEVSPEC_FLASH_START
-    // last sector is used to store device specific information, and should only be written if UID matches
-    if (bl->targetAddr >= DEVSPEC_FLASH_START) {
-        UID_check = ((uint32_t*)bl->data)[0] == ((uint32_t*)UID_BASE)[0] &&
-                    ((uint32_t*)bl->data)[1] == ((uint32_t*)UID_BASE)[1] &&
-                    ((uint32_t*)bl->data)[2] == ((uint32_t*)UID_BASE)[2];
+    palSetLine(PORTAB_STATUS_LED);
+
+    if (wrState.numWritten == 0) {
+        updateStart = chVTGetSystemTimeX();
+        updateBytes = 0;
+        writeFailed = false;
+        updateState = UPDATE_RECEIVING;
+        chsnprintf(statusFile, sizeof(statusFile), "Update in progress\r\n");
     }
-#endif
 
-    palSetLine(PORTAB_STATUS_LED);
+    erase_ahead_hint(bl);
 
     uint8_t mask = 1 << (bl->blockNo % 8);
     uint32_t pos = bl->blockNo / 8;
@@ -425,25 +1125,52 @@ int write_block(uint32_t block_no, const uint8_t *data) {
         wrState.writtenMask[pos] |= mask;
         wrState.numWritten++;
 
-        if ((bl->flags & UF2_FLAG_NOFLASH) || bl->payloadSize > 256 || (bl->targetAddr & 0xff) ||
-            !VALID_FLASH_ADDR(bl->targetAddr, bl->payloadSize) || !UID_check) {
+        // TODO: wait with writing APP_LOAD_ADDRESS until last block is written
+        if ((bl->flags & UF2_FLAG_NOFLASH) || (bl->targetAddr & 0xff) ||
+            !payload_allowed(bl->targetAddr, bl->data, bl->payloadSize)) {
             DBG("Skip block at %x", bl->targetAddr);
             // this happens when we're trying to re-flash CURRENT.UF2 file previously
             // copied from a device; we still want to count these blocks to reset properly
+        } else if (write_payload(bl->targetAddr, bl->data, bl->payloadSize) != HAL_SUCCESS) {
+            DBG("Write error at %x", bl->targetAddr);
+            writeFailed = true;
         } else {
             DBG("Write block at %x", bl->targetAddr);
-            // TODO: wait with writing APP_LOAD_ADDRESS until last block is written
-            flash_write(bl->targetAddr, bl->data, bl->payloadSize, failsafe_mode);
+            updateBytes += bl->payloadSize;
         }
     }
     if (wrState.numWritten >= wrState.numBlocks) {
-        // wait a little bit before resetting, to avoid Windows transmit error
-        // https://github.com/Microsoft/uf2-samd21/issues/11
-        // a bit longer than 30ms to avoid Gnome transmit error
-        // Actually it feels better to have a little delay, 30ms feels
-        // too fast for firmware to really update, 500ms feels more like
-        // a realistic time :)
-        uf2_timer_start(500);
+        bool synced = flash_sync() == HAL_SUCCESS && !writeFailed;
+        bool verified = flash_verify() == HAL_SUCCESS;
+        update_status_file(synced, verified);
+        uint32_t updateMs = TIME_I2MS(chTimeDiffX(updateStart, chVTGetSystemTimeX()));
+        dbg_printf("update: %u bytes in %u ms (%u kB/s)\r\n", updateBytes, updateMs,
+                   updateMs ? updateBytes / updateMs : 0);
+        flash_print_stats();
+        uint32_t commands = 0;
+        for (unsigned i = 0; i < MSD_STATS_NUM; i++) {
+            commands += USBMSD1.stats[i].count;
+        }
+        dbg_printf("scsi: %u commands, %u writes, %u syncs\r\n", commands,
+                   USBMSD1.stats[MSD_STATS_WRITE].count, USBMSD1.stats[MSD_STATS_SYNC].count);
+        updateState = synced && verified ? UPDATE_OK : UPDATE_FAILED;
+        if (synced && verified) {
+            // wait a little bit before resetting, to avoid Windows transmit error
+            // https://github.com/Microsoft/uf2-samd21/issues/11
+            // a bit longer than 30ms to avoid Gnome transmit error
+            // Actually it feels better to have a little delay, 30ms feels
+            // too fast for firmware to really update, 500ms feels more like
+            // a realistic time :)
+            uf2_timer_start(500);
+        } else {
+            // don't reset, show the host what went wrong in STATUS.TXT
+            DBG("Write failed");
+            uf2_timer_stop();
+            remount_timer_start(100);
+            // a retry starts a new update from scratch
+            flash_reset();
+            memset(&wrState, 0, sizeof(wrState));
+        }
     } else {
         // if the next block is not received within 500 ms, reset
         uf2_timer_start(500);
@@ -454,6 +1181,57 @@ int write_block(uint32_t block_no, const uint8_t *data) {
     return 0;
 }
 
+ITCM_CODE int write_block(uint32_t block_no, const uint8_t *data) {
+    (void)block_no;
+    ghostfat_lock();
+    int ret = write_uf2_block(data);
+    ghostfat_unlock();
+    return ret;
+}
+
+/*
+ * Serializes writes to the flash between the drive and the bulk interface.
+ */
+ITCM_CODE void ghostfat_lock(void) {
+    chMtxLock(&writeMutex);
+}
+
+ITCM_CODE void ghostfat_unlock(void) {
+    chMtxUnlock(&writeMutex);
+}
+
+/*
+ * The host ejects the drive (START STOP UNIT). After a complete update the
+ * firmware is started right away instead of after the 500 ms timeout,
+ * ghostfat_handle_events() programs the pending writes before the reset. In
+ * any other state the eject is no commit: nothing is reset and a transfer in
+ * progress keeps its timeout. After a failed update the eject is refused until
+ * the drive re-enumerated, the host has to get to read STATUS.TXT.
+ * Returns false when the eject is refused.
+ */
+ITCM_CODE bool ghostfat_eject(void) {
+    if (updateState == UPDATE_FAILED) {
+        return false;
+    }
+    if (updateState == UPDATE_OK) {
+        DBG("Eject");
+        remount_timer_stop();
+        uf2_timer_start(EJECT_RESET_DELAY);
+    }
+    return true;
+}
+
+/*
+ * Boot timing for STATUS.TXT, shown until an update replaces it.
+ */
+void ghostfat_boot_status(const char *reason, uint32_t disconnect_ms, uint32_t configured_ms) {
+    if (updateState == UPDATE_NONE) {
+        chsnprintf(statusFile, sizeof(statusFile),
+                   "No update\r\nBoot: %s, USB disconnected %u ms, configured after %u ms\r\n",
+                   reason, disconnect_ms, configured_ms);
+    }
+}
+
 /* Check failsafe button */
 bool check_failsafe_button(void) {
 #ifdef PORTAB_FAILSAFE_BUTTON
@@ -471,10 +1249,22 @@ bool check_failsafe_button(void) {
 }
 
 void ghostfat_init(void) {
+    chVTObjectInit(&resetTimer);
+    chVTObjectInit(&remountTimer);
+    timerThread = chThdGetSelfX();
+
     failsafe_mode = check_failsafe_button();
+#ifdef USE_BENCHMARK
+    // both buttons select the benchmark instead of the failsafe mode
+    bench_mode = boot_stats.bench || (failsafe_mode && check_bootloader_button());
+    if (bench_mode) {
+        failsafe_mode = false;
+    }
+#endif
 #ifdef USE_CONFIGFILE
     if (!failsafe_mode) {
         cfghtm_size = segmentedFileLength(CONFIGHTM_FILE, CONFIGHTM_SEGMENTS);
     }
 #endif
+    layout_files();
 }
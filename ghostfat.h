@@ -25,14 +25,27 @@ DEALINGS IN THE SOFTWARE.
 #ifndef GHOSTFAT_H_
 #define GHOSTFAT_H_
 
+#include "ch.h"
 #include "hal.h"
 
-// called roughly every 1ms
-void ghostfat_1ms(void);
+// Events of the reset and remount timers, signalled to the thread that called
+// ghostfat_init(). It passes them to ghostfat_handle_events().
+#define GHOSTFAT_EVT_RESET      EVENT_MASK(0)
+#define GHOSTFAT_EVT_REMOUNT    EVENT_MASK(1)
+#define GHOSTFAT_EVENTS         (GHOSTFAT_EVT_RESET | GHOSTFAT_EVT_REMOUNT)
 
 void ghostfat_init(void);
+void ghostfat_handle_events(eventmask_t events);
+bool ghostfat_eject(void);
+void ghostfat_boot_status(const char *reason, uint32_t disconnect_ms, uint32_t configured_ms);
+
+extern const char infoUf2File[];
 
 int read_block(uint32_t block_no, uint8_t *data);
+const uint8_t *ghostfat_map_blocks(uint32_t block_no, uint32_t *n);
 int write_block(uint32_t block_no, const uint8_t *data);
+bool write_payload(uint32_t addr, const uint8_t *data, uint32_t len);
+void ghostfat_lock(void);
+void ghostfat_unlock(void);
 
 #endif /* GHOSTDISK_H_ */
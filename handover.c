@@ -0,0 +1,536 @@
+/**
+ * @file    handover.c
+ * @brief   UF2 mass storage handover source.
+ * @details The application can pass a WRITE(10) of a UF2 file to the
+ *          bootloader while it is running, see check_uf2_handover() in
+ *          uf2.h. The bootloader takes over the endpoints of the
+ *          application's mass storage interface as they are: the USB core
+ *          is not reset, so the host doesn't see a new device and the copy
+ *          goes on without re-enumerating and remounting. The rest of the
+ *          update is written with the usual write_block() path.
+ *
+ *          halInit() and the USB driver aren't used, they would reset the
+ *          USB core. The endpoints are polled through the core registers:
+ *          bulk-only transport for the commands a host sends to a mounted
+ *          drive, EP0 only for the few requests that come up mid-transfer.
+ *          A bus reset or a mass storage reset ends the handover, the
+ *          bootloader then restarts with its own drive.
+ *
+ * @addtogroup handover
+ * @{
+ */
+
+#include "hal.h"
+
+#include "handover.h"
+#include "bootloader.h"
+#include "flash.h"
+#include "ghostfat.h"
+#include "msd.h"
+#include "debug.h"
+#include "uf2.h"
+
+#include <string.h>
+
+/*===========================================================================*/
+/* Driver local definitions.                                                 */
+/*===========================================================================*/
+
+#define HANDOVER_VERSION                1
+#define HANDOVER_BLOCK_SIZE             512U
+
+/* USBD1 (OTG1) is the OTG_HS core, in full speed mode.*/
+#define HO_OTG                          USB1_OTG_HS
+#define HO_IN(ep)                       ((USB_OTG_INEndpointTypeDef *)        \
+    (USB1_OTG_HS_PERIPH_BASE + USB_OTG_IN_ENDPOINT_BASE + (ep) * USB_OTG_EP_REG_SIZE))
+#define HO_OUT(ep)                      ((USB_OTG_OUTEndpointTypeDef *)       \
+    (USB1_OTG_HS_PERIPH_BASE + USB_OTG_OUT_ENDPOINT_BASE + (ep) * USB_OTG_EP_REG_SIZE))
+#define HO_FIFO(ep)                     (*(volatile uint32_t *)               \
+    (USB1_OTG_HS_PERIPH_BASE + USB_OTG_FIFO_BASE + (ep) * USB_OTG_FIFO_SIZE))
+
+/* Receive status packet types, device mode.*/
+#define GRXSTSP_OUT_DATA                2U
+#define GRXSTSP_OUT_COMP                3U
+#define GRXSTSP_SETUP_COMP              4U
+#define GRXSTSP_SETUP_DATA              6U
+
+#define MSD_CBW_SIGNATURE               0x43425355
+#define MSD_CSW_SIGNATURE               0x53425355
+#define MSD_CBW_FLAGS_IN                0x80
+#define MSD_REQ_RESET                   0xFF
+#define MSD_REQ_GET_MAX_LUN             0xFE
+#define MSD_COMMAND_PASSED              0x00
+#define MSD_COMMAND_FAILED              0x01
+
+#define SCSI_CMD_TEST_UNIT_READY        0x00
+#define SCSI_CMD_REQUEST_SENSE          0x03
+#define SCSI_CMD_START_STOP_UNIT        0x1B
+#define SCSI_CMD_PREVENT_ALLOW_REMOVAL  0x1E
+#define SCSI_CMD_READ_10                0x28
+#define SCSI_CMD_WRITE_10               0x2A
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10   0x35
+
+#define SCSI_SENSE_NO_SENSE             0x00
+#define SCSI_SENSE_MEDIUM_ERROR         0x03
+#define SCSI_SENSE_ILLEGAL_REQUEST      0x05
+#define SCSI_ASC_WRITE_ERROR            0x0C
+#define SCSI_ASC_INVALID_COMMAND        0x20
+#define SCSI_ASC_MEDIUM_REMOVAL_PREVENTED 0x53
+
+/*===========================================================================*/
+/* Driver local variables.                                                   */
+/*===========================================================================*/
+
+/*
+ * Arguments and the first block, copied by the entry. In ITCM after the
+ * code, the RAM initialization doesn't touch it.
+ */
+static struct {
+  UF2_HandoverArgs args;
+  uint8_t block[HANDOVER_BLOCK_SIZE] __attribute__((aligned(4)));
+} saved __attribute__((section(".handover")));
+
+static uint8_t blkbuf[HANDOVER_BLOCK_SIZE] __attribute__((aligned(4)));
+static uint8_t cbwbuf[64] __attribute__((aligned(4)));
+
+static uint8_t ep_in;
+static uint8_t ep_out;
+static uint32_t mps;
+
+/* OUT transfer on ep_out in progress.*/
+static struct {
+  uint8_t *buf;
+  uint32_t len;
+  uint32_t n;
+  bool done;
+} rx;
+
+static uint8_t setup[8] __attribute__((aligned(4)));
+
+static uint8_t sense_key;
+static uint8_t asc;
+
+/*===========================================================================*/
+/* Driver local functions.                                                   */
+/*===========================================================================*/
+
+/*
+ * The application's device is gone, the host reset the bus or the
+ * transport. Restart with the bootloader's own drive, the host enumerates
+ * it and the copy can be repeated there.
+ */
+static void handover_abort(void) {
+  dbg_printf("handover: aborted by the host\r\n");
+  flash_sync();
+  reset_to_uf2_bootloader();
+}
+
+static void ep0_send(const uint8_t *data, uint32_t len) {
+  HO_IN(0)->DIEPTSIZ = (1U << USB_OTG_DIEPTSIZ_PKTCNT_Pos) | len;
+  HO_IN(0)->DIEPCTL |= USB_OTG_DIEPCTL_EPENA | USB_OTG_DIEPCTL_CNAK;
+  for (uint32_t i = 0; i < len; i += 4) {
+    uint32_t w = 0;
+    memcpy(&w, data + i, len - i < 4 ? len - i : 4);
+    HO_FIFO(0) = w;
+  }
+}
+
+/*
+ * Control requests that come up during a transfer. Everything with a data
+ * stage other than GET_STATUS and GET_MAX_LUN is stalled.
+ */
+static void ep0_setup(void) {
+  static const uint8_t zero[2] = {0, 0};
+  uint8_t type = setup[0];
+  uint8_t req = setup[1];
+  uint16_t value = setup[2] | (setup[3] << 8);
+  uint16_t index = setup[4] | (setup[5] << 8);
+  uint16_t length = setup[6] | (setup[7] << 8);
+  bool data = false;
+
+  if ((type & USB_RTYPE_TYPE_MASK) == USB_RTYPE_TYPE_CLASS && req == MSD_REQ_RESET) {
+    handover_abort();
+  }
+
+  if ((type & USB_RTYPE_TYPE_MASK) == USB_RTYPE_TYPE_CLASS && req == MSD_REQ_GET_MAX_LUN &&
+      length > 0) {
+    ep0_send(zero, 1);
+    data = true;
+  } else if ((type & USB_RTYPE_DIR_MASK) == USB_RTYPE_DIR_DEV2HOST &&
+             req == USB_REQ_GET_STATUS && length > 0) {
+    ep0_send(zero, length < 2 ? length : 2);
+    data = true;
+  } else if (length == 0) {
+    if (type == USB_RTYPE_RECIPIENT_ENDPOINT && req == USB_REQ_CLEAR_FEATURE &&
+        value == USB_FEATURE_ENDPOINT_HALT && (index & 0x0F) != 0) {
+      // the data toggle restarts at DATA0
+      if (index & 0x80) {
+        HO_IN(index & 0x0F)->DIEPCTL = (HO_IN(index & 0x0F)->DIEPCTL & ~USB_OTG_DIEPCTL_STALL) |
+                                       USB_OTG_DIEPCTL_SD0PID_SEVNFRM;
+      } else {
+        HO_OUT(index & 0x0F)->DOEPCTL = (HO_OUT(index & 0x0F)->DOEPCTL & ~USB_OTG_DOEPCTL_STALL) |
+                                        USB_OTG_DOEPCTL_SD0PID_SEVNFRM;
+      }
+    }
+    ep0_send(NULL, 0);
+  } else {
+    HO_IN(0)->DIEPCTL |= USB_OTG_DIEPCTL_STALL;
+    HO_OUT(0)->DOEPCTL |= USB_OTG_DOEPCTL_STALL;
+  }
+
+  HO_OUT(0)->DOEPTSIZ = (3U << USB_OTG_DOEPTSIZ_STUPCNT_Pos) |
+                        (1U << USB_OTG_DOEPTSIZ_PKTCNT_Pos) | (3U * 8U);
+  if (data) {
+    // status stage from the host
+    HO_OUT(0)->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+  }
+}
+
+/*
+ * Reads a packet from the receive FIFO, bytes past len are dropped.
+ */
+static void fifo_read(uint8_t *buf, uint32_t cnt, uint32_t len) {
+  for (uint32_t i = 0; i < cnt; i += 4) {
+    uint32_t w = HO_FIFO(0);
+    if (buf != NULL && i < len) {
+      memcpy(buf + i, &w, len - i < 4 ? len - i : 4);
+    }
+  }
+}
+
+/*
+ * Handles one event of the USB core and the timers of ghostfat.c, and
+ * sleeps for a tick when there's nothing to do. The flash workers have a
+ * lower priority, they run while this thread sleeps.
+ */
+static void handover_poll(void) {
+  uint32_t gintsts = HO_OTG->GINTSTS;
+
+  if (gintsts & (USB_OTG_GINTSTS_USBRST | USB_OTG_GINTSTS_ENUMDNE)) {
+    handover_abort();
+  }
+
+  ghostfat_handle_events(chEvtGetAndClearEvents(GHOSTFAT_EVENTS));
+
+  if (!(gintsts & USB_OTG_GINTSTS_RXFLVL)) {
+    chThdSleep(1);
+    return;
+  }
+
+  uint32_t sts = HO_OTG->GRXSTSP;
+  uint32_t ep = sts & USB_OTG_GRXSTSP_EPNUM;
+  uint32_t cnt = (sts & USB_OTG_GRXSTSP_BCNT) >> USB_OTG_GRXSTSP_BCNT_Pos;
+
+  switch ((sts & USB_OTG_GRXSTSP_PKTSTS) >> USB_OTG_GRXSTSP_PKTSTS_Pos) {
+  case GRXSTSP_OUT_DATA:
+    if (ep == ep_out && rx.buf != NULL && rx.n < rx.len) {
+      fifo_read(rx.buf + rx.n, cnt, rx.len - rx.n);
+      rx.n += cnt < rx.len - rx.n ? cnt : rx.len - rx.n;
+    } else {
+      fifo_read(NULL, cnt, 0);
+    }
+    break;
+  case GRXSTSP_OUT_COMP:
+    if (ep == ep_out) {
+      HO_OUT(ep)->DOEPINT = USB_OTG_DOEPINT_XFRC;
+      rx.done = true;
+    }
+    break;
+  case GRXSTSP_SETUP_DATA:
+    fifo_read(setup, cnt, sizeof(setup));
+    break;
+  case GRXSTSP_SETUP_COMP:
+    HO_OUT(0)->DOEPINT = USB_OTG_DOEPINT_STUP;
+    ep0_setup();
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Receives up to len bytes on ep_out, a multiple of the packet size or a
+ * single packet. Returns the number of bytes received.
+ */
+static uint32_t handover_receive(uint8_t *buf, uint32_t len) {
+  USB_OTG_OUTEndpointTypeDef *oep = HO_OUT(ep_out);
+  uint32_t pkts = (len + mps - 1) / mps;
+
+  rx.buf = buf;
+  rx.len = len;
+  rx.n = 0;
+  rx.done = false;
+  oep->DOEPTSIZ = (pkts << USB_OTG_DOEPTSIZ_PKTCNT_Pos) | (pkts * mps);
+  oep->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+  while (!rx.done) {
+    handover_poll();
+  }
+  rx.buf = NULL;
+  return rx.n;
+}
+
+/*
+ * Sends len bytes on ep_in, a zero length packet when len is 0.
+ */
+static void handover_transmit(const uint8_t *buf, uint32_t len) {
+  USB_OTG_INEndpointTypeDef *iep = HO_IN(ep_in);
+  uint32_t pkts = len == 0 ? 1 : (len + mps - 1) / mps;
+
+  iep->DIEPINT = USB_OTG_DIEPINT_XFRC;
+  iep->DIEPTSIZ = (pkts << USB_OTG_DIEPTSIZ_PKTCNT_Pos) | len;
+  iep->DIEPCTL |= USB_OTG_DIEPCTL_EPENA | USB_OTG_DIEPCTL_CNAK;
+  for (uint32_t i = 0; i < len;) {
+    uint32_t n = len - i < mps ? len - i : mps;
+    while ((iep->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV) < (n + 3) / 4) {
+      handover_poll();
+    }
+    for (uint32_t j = 0; j < n; j += 4) {
+      uint32_t w = 0;
+      memcpy(&w, buf + i + j, n - j < 4 ? n - j : 4);
+      HO_FIFO(ep_in) = w;
+    }
+    i += n;
+  }
+  while (!(iep->DIEPINT & USB_OTG_DIEPINT_XFRC)) {
+    handover_poll();
+  }
+  iep->DIEPINT = USB_OTG_DIEPINT_XFRC;
+}
+
+static void handover_csw(uint32_t tag, uint32_t residue, uint8_t status) {
+  msd_csw_t csw = {MSD_CSW_SIGNATURE, tag, residue, status};
+
+  handover_transmit((const uint8_t *)&csw, sizeof(csw));
+}
+
+static void handover_sense(uint8_t key, uint8_t code) {
+  sense_key = key;
+  asc = code;
+}
+
+/*
+ * Receives a CBW and executes it. The commands are those a host sends to a
+ * mounted drive, the rest fails with INVALID COMMAND. The host still moves
+ * the data it announced: missing IN data is ended with a short packet,
+ * extra OUT data is dropped.
+ */
+static void handover_command(void) {
+  const msd_cbw_t *cbw = (const msd_cbw_t *)cbwbuf;
+
+  if (handover_receive(cbwbuf, sizeof(cbwbuf)) != sizeof(msd_cbw_t) ||
+      cbw->signature != MSD_CBW_SIGNATURE) {
+    handover_abort();
+  }
+
+  const uint8_t *cb = cbw->cb;
+  bool in = cbw->flags & MSD_CBW_FLAGS_IN;
+  uint32_t lba = (cb[2] << 24) | (cb[3] << 16) | (cb[4] << 8) | cb[5];
+  uint32_t blocks = (cb[7] << 8) | cb[8];
+  uint32_t done = 0;
+  bool ok = true;
+  // counted with the commands of the drive, for the update report
+  msd_stats_group_t group = MSD_STATS_OTHER;
+
+  switch (cb[0]) {
+  case SCSI_CMD_TEST_UNIT_READY:
+  case SCSI_CMD_PREVENT_ALLOW_REMOVAL:
+    break;
+
+  case SCSI_CMD_REQUEST_SENSE: {
+    uint8_t sense[18] = {0x70, 0, sense_key, 0, 0, 0, 0, 10, 0, 0, 0, 0, asc};
+    done = cbw->data_len < sizeof(sense) ? cbw->data_len : sizeof(sense);
+    handover_transmit(sense, done);
+    handover_sense(SCSI_SENSE_NO_SENSE, 0);
+    break;
+  }
+
+  case SCSI_CMD_START_STOP_UNIT:
+    // an eject after a complete update starts the firmware, as with the
+    // bootloader's own drive
+    if ((cb[4] & 0x03) == 0x02 && !ghostfat_eject()) {
+      handover_sense(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_MEDIUM_REMOVAL_PREVENTED);
+      ok = false;
+    }
+    break;
+
+  case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+    group = MSD_STATS_SYNC;
+    if (flash_sync() != HAL_SUCCESS) {
+      handover_sense(SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR);
+      ok = false;
+    }
+    break;
+
+  case SCSI_CMD_READ_10:
+    // the bootloader's drive now, as after a remount
+    for (uint32_t i = 0; in && i < blocks && done < cbw->data_len; i++) {
+      read_block(lba + i, blkbuf);
+      handover_transmit(blkbuf, HANDOVER_BLOCK_SIZE);
+      done += HANDOVER_BLOCK_SIZE;
+    }
+    break;
+
+  case SCSI_CMD_WRITE_10:
+    group = MSD_STATS_WRITE;
+    for (uint32_t i = 0; !in && i < blocks && done < cbw->data_len; i++) {
+      handover_receive(blkbuf, HANDOVER_BLOCK_SIZE);
+      write_block(lba + i, blkbuf);
+      done += HANDOVER_BLOCK_SIZE;
+    }
+    break;
+
+  default:
+    handover_sense(SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_COMMAND);
+    ok = false;
+    break;
+  }
+  USBMSD1.stats[group].count++;
+
+  if (done < cbw->data_len) {
+    if (in) {
+      if (done % mps == 0) {
+        handover_transmit(NULL, 0);
+      }
+    } else {
+      uint32_t n = done;
+      while (n < cbw->data_len) {
+        uint32_t len = handover_receive(blkbuf, HANDOVER_BLOCK_SIZE);
+        if (len < HANDOVER_BLOCK_SIZE) {
+          break;
+        }
+        n += len;
+      }
+    }
+  }
+
+  handover_csw(cbw->tag, cbw->data_len - done, ok ? MSD_COMMAND_PASSED : MSD_COMMAND_FAILED);
+}
+
+/*
+ * Runs from flash on the bootloader's stacks, sets up the RAM like the
+ * startup code does and starts the system. The application's clock
+ * configuration stays, it is the bootloader's one for firmware built for
+ * the same board. Not static, handover_msc() branches to it by name.
+ */
+void handover_start(void) __attribute__((noreturn, used));
+void handover_start(void) {
+  extern uint32_t _vectors[];
+  extern uint32_t __textdata_base__[], __data_base__[], __data_end__[];
+  extern uint32_t __bss_base__[], __bss_end__[];
+  extern void __init_ram_areas(void);
+  extern void itcm_init(void);
+  extern void __late_init(void);
+
+  // __late_init() copies the vectors from here
+  SCB->VTOR = (uint32_t)_vectors;
+  // replaces the application's code in ITCM, memcpy() included
+  itcm_init();
+
+  const uint32_t *src = __textdata_base__;
+  for (volatile uint32_t *dst = __data_base__; dst < __data_end__; dst++) {
+    *dst = *src++;
+  }
+  for (volatile uint32_t *dst = __bss_base__; dst < __bss_end__; dst++) {
+    *dst = 0;
+  }
+  __init_ram_areas();
+  __late_init();
+
+  handover_main();
+  while (true)
+    ;
+}
+
+/*
+ * The handoverMSC entry, called by the application with a UF2 block from a
+ * WRITE(10), never returns. Runs from flash on the application's stack
+ * until the stacks are switched.
+ */
+static void handover_msc(UF2_HandoverArgs *args) {
+  extern uint32_t __main_stack_end__[], __process_stack_end__[];
+
+  if (args->version != HANDOVER_VERSION) {
+    return;
+  }
+
+  __disable_irq();
+
+  // stop what the application left running
+  SysTick->CTRL = 0;
+  for (unsigned i = 0; i < 8; i++) {
+    NVIC->ICER[i] = 0xFFFFFFFF;
+    NVIC->ICPR[i] = 0xFFFFFFFF;
+  }
+  SCB->ICSR = SCB_ICSR_PENDSVCLR_Msk | SCB_ICSR_PENDSTCLR_Msk;
+  // DMA would keep writing to the RAM the bootloader is about to use
+  RCC->AHB1RSTR |= RCC_AHB1RSTR_DMA1RST | RCC_AHB1RSTR_DMA2RST;
+  RCC->AHB1RSTR &= ~(RCC_AHB1RSTR_DMA1RST | RCC_AHB1RSTR_DMA2RST);
+  RCC->AHB3RSTR |= RCC_AHB3RSTR_MDMARST;
+  RCC->AHB3RSTR &= ~RCC_AHB3RSTR_MDMARST;
+  RCC->AHB4RSTR |= RCC_AHB4RSTR_BDMARST;
+  RCC->AHB4RSTR &= ~RCC_AHB4RSTR_BDMARST;
+
+  // ITCM still holds the application's code, memcpy() is not there yet
+  saved.args = *args;
+  const uint32_t *src = (const uint32_t *)args->buffer;
+  for (volatile uint32_t *dst = (uint32_t *)saved.block;
+       dst < (uint32_t *)(saved.block + sizeof(saved.block)); dst++) {
+    *dst = *src++;
+  }
+
+  // thread mode on the process stack, like the startup code
+  __asm volatile (
+    "msr     msp, %0         \n"
+    "msr     psp, %1         \n"
+    "msr     control, %2     \n"
+    "isb                     \n"
+    "b       handover_start  \n"
+    : : "r" (__main_stack_end__), "r" (__process_stack_end__), "r" (2U) : "memory");
+  while (true)
+    ;
+}
+
+/*===========================================================================*/
+/* Driver exported variables.                                                */
+/*===========================================================================*/
+
+/**
+ * @brief   Handover table, found by the application at UF2_BINFO.
+ */
+const UF2_BInfo handover_binfo __attribute__((section(".binfo"), used)) = {
+  .reserved0 = NULL,
+  .handoverHID = NULL,
+  .handoverMSC = handover_msc,
+  .info_uf2 = infoUf2File,
+};
+
+/*===========================================================================*/
+/* Driver exported functions.                                                */
+/*===========================================================================*/
+
+/**
+ * @brief   Finishes the WRITE(10) the application handed over and serves
+ *          the drive until ghostfat.c resets, never returns.
+ *
+ * @api
+ */
+void handoverRun(void) {
+  ep_in = saved.args.ep_in & 0x0F;
+  ep_out = saved.args.ep_out & 0x0F;
+  mps = HO_OUT(ep_out)->DOEPCTL & USB_OTG_DOEPCTL_MPSIZ;
+
+  dbg_printf("handover: %u blocks remaining\r\n", saved.args.blocks_remaining);
+
+  write_block(0, saved.block);
+  for (uint32_t i = 0; i < saved.args.blocks_remaining; i++) {
+    handover_receive(blkbuf, HANDOVER_BLOCK_SIZE);
+    write_block(0, blkbuf);
+  }
+  handover_csw(saved.args.cbw_tag, 0, MSD_COMMAND_PASSED);
+
+  while (true) {
+    handover_command();
+  }
+}
+
+/** @} */
@@ -0,0 +1,42 @@
+/**
+ * @file    handover.h
+ * @brief   UF2 mass storage handover header.
+ *
+ * @addtogroup handover
+ * @{
+ */
+
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include "hal.h"
+
+/*===========================================================================*/
+/* Driver constants.                                                         */
+/*===========================================================================*/
+
+/*===========================================================================*/
+/* Driver pre-compile time settings.                                         */
+/*===========================================================================*/
+
+/*===========================================================================*/
+/* Derived constants and error checks.                                       */
+/*===========================================================================*/
+
+/*===========================================================================*/
+/* External declarations.                                                    */
+/*===========================================================================*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  void handoverRun(void);
+  /* In main.c, brings up the system after a handover.*/
+  void handover_main(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HANDOVER_H */
+
+/** @} */
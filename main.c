@@ -21,18 +21,32 @@
 #include "hal.h"
 
 #include "usbcfg.h"
-#include "hal_usb_msd.h"
+#include "msd.h"
+#include "bulk.h"
+#include "handover.h"
 
 #include "portab.h"
 
 #include "uf2.h"
 #include "ghostdisk.h"
 #include "ghostfat.h"
+#include "flash.h"
+#include "debug.h"
 
 #include "bootloader.h"
 
 #define GHOSTDISK_BLOCK_SIZE    512U
 #define GHOSTDISK_BLOCK_CNT     UF2_NUM_BLOCKS
+// Blocks in the READ(10)/WRITE(10) buffer, used as two halves that are
+// transferred alternately. At most 127 blocks per half: a full speed USB
+// transfer can't be longer than 1023 packets of 64 bytes
+#ifndef GHOSTDISK_TRANSFER_BLOCKS
+#define GHOSTDISK_TRANSFER_BLOCKS  64U
+#endif
+
+#if GHOSTDISK_TRANSFER_BLOCKS < 2 || GHOSTDISK_TRANSFER_BLOCKS > 254
+#error "GHOSTDISK_TRANSFER_BLOCKS out of range"
+#endif
 
 /**
  * SCSI inquiry response structure.
@@ -40,7 +54,7 @@
 static const scsi_inquiry_response_t scsi_inquiry_response = {
     0x00,           /* direct access block device     */
     0x80,           /* removable                      */
-    0x04,           /* SPC-2                          */
+    0x05,           /* SPC-3, hosts ask for VPD pages */
     0x02,           /* response data format           */
     0x20,           /* response has 0x20 + 4 bytes    */
     0x00,
@@ -52,26 +66,25 @@ static const scsi_inquiry_response_t scsi_inquiry_response = {
 };
 
 /*
- * Red LED blinker thread, times are in milliseconds.
+ * Red LED blinker, toggled by a virtual timer so no thread has to wake up
+ * for it. Fast while the host has configured the device.
  */
-static THD_WORKING_AREA(waThread1, 128);
-static THD_FUNCTION(Thread1, arg) {
+static virtual_timer_t blinker;
+ITCM_CODE static void blinker_cb(void *arg) {
 
   (void)arg;
-  chRegSetThreadName("blinker");
-  while (true) {
-    systime_t time;
-
-    time = USBD1.state == USB_ACTIVE ? 100 : 500;
-    palSetLine(PORTAB_BLINK_LED);
-    chThdSleepMilliseconds(time);
-    palClearLine(PORTAB_BLINK_LED);
-    chThdSleepMilliseconds(time);
-  }
+  chSysLockFromISR();
+  palToggleLine(PORTAB_BLINK_LED);
+  chVTSetI(&blinker, TIME_MS2I(USBD1.state == USB_ACTIVE ? 100 : 500), blinker_cb, NULL);
+  chSysUnlockFromISR();
 }
 
+/* main() thread events, next to GHOSTFAT_EVENTS */
+#define EVT_USB_CONFIGURED      EVENT_MASK(2)
+
 GhostDisk ghostdisk;
-static uint8_t blkbuf[GHOSTDISK_BLOCK_SIZE];
+// aligned so UF2 header fields can be read with word loads
+static uint8_t blkbuf[GHOSTDISK_BLOCK_SIZE * GHOSTDISK_TRANSFER_BLOCKS] __attribute__((aligned(32)));
 
 BaseSequentialStream *GlobalDebugChannel;
 
@@ -94,6 +107,22 @@ bool check_bootloader_button(void) {
   return (vote * 100) > (samples * 90);
 }
 
+/*
+ * Copies the code running during flash operations to ITCM, see
+ * STM32H743xI_bootloader.ld. It includes the newlib mem* functions, so this
+ * runs before the RAM initialization of the startup code, which may call
+ * them, and before handover_start() sets up the RAM. Volatile so the copy
+ * loop isn't turned into a memcpy() call.
+ */
+void itcm_init(void) {
+  extern uint32_t __itcm_init_text__[], __itcm_init__[], __itcm_init_end__[];
+
+  const uint32_t *src = __itcm_init_text__;
+  for (volatile uint32_t *dst = __itcm_init__; dst < __itcm_init_end__; dst++) {
+    *dst = *src++;
+  }
+}
+
 /*
  * Bootloader function, should be called from __early_init() in board.c,
  * just after stm32_gpio_init() and before stm32_clock_init()
@@ -115,24 +144,65 @@ void pre_clock_init(void) {
     try_boot = true;
   }
 
-  /* Check backup register for soft boot into bootloader */
-  if (RTC->BKP0R == BOOTLOADER_RTC_SIGNATURE) {
-    // Enable writing to backup domain
-    PWR->CR1 |= PWR_CR1_DBP;
-    // reset signature
-    RTC->BKP0R = 0;
+  /* Check backup register for soft boot into bootloader, the signature is
+     reset by boot_get_reason() in main() */
+  if (RTC->BKP0R == BOOTLOADER_RTC_SIGNATURE || RTC->BKP0R == BENCH_RTC_SIGNATURE) {
     try_boot = false;
   }
 
   if (try_boot) {
     jump_to_app();
   }
+
+  itcm_init();
+}
+
+/*
+ * Called by the startup code after RAM initialization, before main(). Moves
+ * the vectors to ITCM next to the code copied by itcm_init(). Volatile so the
+ * copy loop isn't turned into a memcpy() call.
+ */
+void __late_init(void) {
+  extern uint32_t __itcm_vectors__[];
+
+  const uint32_t *src = (const uint32_t *)SCB->VTOR;
+  volatile uint32_t *vectors = __itcm_vectors__;
+  for (unsigned i = 0; i < 16 + CORTEX_NUM_VECTORS; i++) {
+    vectors[i] = src[i];
+  }
+  SCB->VTOR = (uint32_t)__itcm_vectors__;
+  __DSB();
+  __ISB();
 }
 
 /*
- * Application entry point.
+ * Entered from handover.c when the application hands a running transfer to
+ * the bootloader, with the RAM and ITCM set up. halInit() is skipped, it
+ * would reset the USB core the host is talking to: only the system timer,
+ * the debug serial port and the flash path are started.
  */
-int main(void) {
+void handover_main(void) {
+  stInit();
+  sdInit();
+  chSysInit();
+
+  sdStart(&SD3, &sercfg);
+  GlobalDebugChannel = (BaseSequentialStream *)&SD3;
+
+  flash_init();
+  ghostfat_init();
+
+  handoverRun();
+}
+
+/*
+ * Application entry point, stays in ITCM as its loop handles the reset timer
+ * during flash operations.
+ */
+ITCM_CODE int main(void) {
+  /* Before halInit(), it may reset the backup domain with the signature */
+  boot_reason_t reason = boot_get_reason();
+
   /*
    * System initializations.
    * - HAL initialization, this also initializes the configured device drivers
@@ -145,17 +215,24 @@ int main(void) {
 
   palClearLine(PORTAB_BLINK_LED);
 
-  sdStart(&SD3, &sercfg);
-  GlobalDebugChannel = (BaseSequentialStream *)&SD3;
-
   /*
-   * Activates the USB driver and then the USB bus pull-up on D+.
-   * Note, a delay is inserted in order to not have to disconnect the cable
-   * after a reset.
+   * Activates the USB driver, the USB bus pull-up on D+ stays off until
+   * usbConnectBus(). It has been off since the reset, after a reset that may
+   * have left the host with a stale session it stays off a while longer, see
+   * boot_disconnect_ms(). The rest of the initialization runs in the
+   * meantime.
    */
-  usbDisconnectBus(&USBD1);
-  chThdSleepMilliseconds(1500);
+  systime_t start = chVTGetSystemTimeX();
+  boot_stats.disconnect_ms = boot_disconnect_ms(reason);
+  event_listener_t configured_listener;
+  chEvtRegisterMask(&usb_configured_event, &configured_listener, EVT_USB_CONFIGURED);
   usbStart(&USBD1, &usbcfg);
+  usbDisconnectBus(&USBD1);
+
+  /*
+   * start flash erase-ahead thread
+   */
+  flash_init();
 
   /*
    * start Ghost Disk
@@ -168,25 +245,49 @@ int main(void) {
    * start mass storage
    */
   msdObjectInit(&USBMSD1);
-  msdStart(&USBMSD1, &USBD1, (BaseBlockDevice *)&ghostdisk, blkbuf, &scsi_inquiry_response, NULL);
+  msdSetMap(&USBMSD1, ghostfat_map_blocks);
+  msdStart(&USBMSD1, &USBD1, (BaseBlockDevice *)&ghostdisk, blkbuf, sizeof(blkbuf), &scsi_inquiry_response);
+
+  /*
+   * start raw bulk flashing interface
+   */
+  bulkStart(&USBD1);
 
   /*
-   *
+   * connect when the disconnect time is over
    */
+  sysinterval_t elapsed = chTimeDiffX(start, chVTGetSystemTimeX());
+  if (elapsed < TIME_MS2I(boot_stats.disconnect_ms)) {
+    chThdSleep(TIME_MS2I(boot_stats.disconnect_ms) - elapsed);
+  }
   usbConnectBus(&USBD1);
 
   /*
-   * Starting threads.
+   * Starting the blinker, and the debug output now that the host can
+   * enumerate.
    */
-  chThdCreateStatic(waThread1, sizeof(waThread1), NORMALPRIO, Thread1, NULL);
+  chVTObjectInit(&blinker);
+  chVTSet(&blinker, TIME_MS2I(500), blinker_cb, NULL);
+
+  sdStart(&SD3, &sercfg);
+  GlobalDebugChannel = (BaseSequentialStream *)&SD3;
 
   /*
-   * Normal main() thread activity, in this demo it does nothing except
-   * sleeping in a loop and check the button state.
+   * Normal main() thread activity, it sleeps until a timer of ghostfat.c
+   * expires or the host configures the device.
    */
+  bool boot_reported = false;
   while (true) {
-    chThdSleepMilliseconds(1);
-    ghostfat_1ms();
+    eventmask_t events = chEvtWaitAny(ALL_EVENTS);
+    ghostfat_handle_events(events);
+
+    if ((events & EVT_USB_CONFIGURED) && !boot_reported) {
+      boot_reported = true;
+      dbg_printf("boot: %s, disconnected %u ms, configured after %u ms\r\n",
+                 boot_reason_name(reason), boot_stats.disconnect_ms, boot_stats.configured_ms);
+      ghostfat_boot_status(boot_reason_name(reason), boot_stats.disconnect_ms,
+                           boot_stats.configured_ms);
+    }
   }
 
   msdStop(&USBMSD1);
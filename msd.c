@@ -0,0 +1,708 @@
+/**
+ * @file    msd.c
+ * @brief   USB mass storage (bulk only transport, SCSI) driver source.
+ * @details Replaces the ChibiOS-Contrib driver, which moves a single block
+ *          per block device call. READ(10) and WRITE(10) are handled here
+ *          in transfers of up to half the buffer given to msdStart(), the
+ *          USB transfer of one half overlaps the block device access of
+ *          the other.
+ *
+ * @addtogroup msd
+ * @{
+ */
+
+#include "hal.h"
+
+#include "msd.h"
+#include "uf2cfg.h"
+
+#include <string.h>
+
+/*===========================================================================*/
+/* Driver local definitions.                                                 */
+/*===========================================================================*/
+
+#define MSD_CBW_SIGNATURE               0x43425355
+#define MSD_CSW_SIGNATURE               0x53425355
+#define MSD_CBW_FLAGS_IN                0x80
+
+#define MSD_REQ_RESET                   0xFF
+#define MSD_REQ_GET_MAX_LUN             0xFE
+
+#define MSD_COMMAND_PASSED              0x00
+#define MSD_COMMAND_FAILED              0x01
+#define MSD_COMMAND_PHASE_ERROR         0x02
+
+#define SCSI_CMD_TEST_UNIT_READY        0x00
+#define SCSI_CMD_REQUEST_SENSE          0x03
+#define SCSI_CMD_INQUIRY                0x12
+#define SCSI_CMD_MODE_SENSE_6           0x1A
+#define SCSI_CMD_START_STOP_UNIT        0x1B
+#define SCSI_CMD_PREVENT_ALLOW_REMOVAL  0x1E
+#define SCSI_CMD_READ_FORMAT_CAPACITIES 0x23
+#define SCSI_CMD_READ_CAPACITY_10       0x25
+#define SCSI_CMD_READ_10                0x28
+#define SCSI_CMD_WRITE_10               0x2A
+#define SCSI_CMD_VERIFY_10              0x2F
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10   0x35
+#define SCSI_CMD_MODE_SENSE_10          0x5A
+
+#define SCSI_VPD_SUPPORTED_PAGES        0x00
+#define SCSI_VPD_BLOCK_LIMITS           0xB0
+
+#define SCSI_MODE_PAGE_CACHING          0x08
+#define SCSI_MODE_PAGE_ALL              0x3F
+#define SCSI_MODE_PC_CHANGEABLE         0x01
+
+#define SCSI_SENSE_NO_SENSE             0x00
+#define SCSI_SENSE_NOT_READY            0x02
+#define SCSI_SENSE_MEDIUM_ERROR         0x03
+#define SCSI_SENSE_ILLEGAL_REQUEST      0x05
+
+#define SCSI_ASC_WRITE_ERROR            0x0C
+#define SCSI_ASC_READ_ERROR             0x11
+#define SCSI_ASC_INVALID_COMMAND        0x20
+#define SCSI_ASC_LBA_OUT_OF_RANGE       0x21
+#define SCSI_ASC_INVALID_FIELD_IN_CDB   0x24
+#define SCSI_ASC_WRITE_PROTECTED        0x27
+#define SCSI_ASC_MEDIUM_NOT_PRESENT     0x3A
+#define SCSI_ASC_MEDIUM_REMOVAL_PREVENTED 0x53
+#define SCSI_ASCQ_MEDIUM_REMOVAL_PREVENTED 0x02
+
+/*===========================================================================*/
+/* Driver exported variables.                                                */
+/*===========================================================================*/
+
+USBMassStorageDriver USBMSD1;
+
+/*===========================================================================*/
+/* Driver local variables.                                                   */
+/*===========================================================================*/
+
+static THD_WORKING_AREA(waMSD, MSD_THREAD_STACK_SIZE);
+
+/*===========================================================================*/
+/* Driver local functions.                                                   */
+/*===========================================================================*/
+
+/*
+ * SCSI fields are big endian.
+ */
+ITCM_CODE static uint32_t get_be16(const uint8_t *p) {
+  return ((uint32_t)p[0] << 8) | p[1];
+}
+
+ITCM_CODE static uint32_t get_be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+ITCM_CODE static void put_be32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+ITCM_CODE static uint32_t min_u32(uint32_t a, uint32_t b) {
+  return a < b ? a : b;
+}
+
+ITCM_CODE static void msd_sense(USBMassStorageDriver *msdp, uint8_t key,
+                                uint8_t asc, uint8_t ascq) {
+  msdp->sense_key = key;
+  msdp->asc = asc;
+  msdp->ascq = ascq;
+}
+
+ITCM_CODE static void msd_stall(USBMassStorageDriver *msdp, bool in, bool out) {
+  osalSysLock();
+  if (in) {
+    usbStallTransmitI(msdp->usbp, USB_MSD_DATA_EP);
+  }
+  if (out) {
+    usbStallReceiveI(msdp->usbp, USB_MSD_DATA_EP);
+  }
+  osalSysUnlock();
+}
+
+/*
+ * Data phase to the host, false on a USB reset.
+ */
+ITCM_CODE static bool msd_data_in(USBMassStorageDriver *msdp,
+                                  const uint8_t *data, uint32_t len) {
+  if (len == 0) {
+    return true;
+  }
+  if (usbTransmit(msdp->usbp, USB_MSD_DATA_EP, data, len) != MSG_OK) {
+    return false;
+  }
+  msdp->transferred += len;
+  return true;
+}
+
+/*
+ * Reply with a small data structure, cut to what the host asks for.
+ */
+ITCM_CODE static uint8_t msd_reply(USBMassStorageDriver *msdp,
+                                   const uint8_t *data, uint32_t len) {
+  len = min_u32(len, msdp->cbw.data_len);
+  if (len > 0 && !(msdp->cbw.flags & MSD_CBW_FLAGS_IN)) {
+    return MSD_COMMAND_PHASE_ERROR;
+  }
+  return msd_data_in(msdp, data, len) ? MSD_COMMAND_PASSED : MSD_COMMAND_FAILED;
+}
+
+/*
+ * Non-blocking data phase for the READ(10)/WRITE(10) pipeline. The wait
+ * functions return false when the USB was reset.
+ */
+ITCM_CODE static bool msd_start_in(USBMassStorageDriver *msdp,
+                                   const uint8_t *data, uint32_t len) {
+  bool active;
+
+  osalSysLock();
+  active = usbGetDriverStateI(msdp->usbp) == USB_ACTIVE;
+  if (active) {
+    usbStartTransmitI(msdp->usbp, USB_MSD_DATA_EP, data, len);
+  }
+  osalSysUnlock();
+  return active;
+}
+
+ITCM_CODE static bool msd_wait_in(USBMassStorageDriver *msdp, uint32_t len) {
+  USBDriver *usbp = msdp->usbp;
+  msg_t msg = MSG_OK;
+
+  osalSysLock();
+  if (usbGetDriverStateI(usbp) != USB_ACTIVE) {
+    msg = MSG_RESET;
+  } else if (usbGetTransmitStatusI(usbp, USB_MSD_DATA_EP)) {
+    msg = osalThreadSuspendS(&usbp->epc[USB_MSD_DATA_EP]->in_state->thread);
+  }
+  osalSysUnlock();
+  if (msg != MSG_OK) {
+    return false;
+  }
+  msdp->transferred += len;
+  return true;
+}
+
+ITCM_CODE static bool msd_start_out(USBMassStorageDriver *msdp,
+                                    uint8_t *data, uint32_t len) {
+  bool active;
+
+  osalSysLock();
+  active = usbGetDriverStateI(msdp->usbp) == USB_ACTIVE;
+  if (active) {
+    usbStartReceiveI(msdp->usbp, USB_MSD_DATA_EP, data, len);
+  }
+  osalSysUnlock();
+  return active;
+}
+
+ITCM_CODE static bool msd_wait_out(USBMassStorageDriver *msdp, uint32_t len) {
+  USBDriver *usbp = msdp->usbp;
+  msg_t msg;
+
+  osalSysLock();
+  if (usbGetDriverStateI(usbp) != USB_ACTIVE) {
+    msg = MSG_RESET;
+  } else if (usbGetReceiveStatusI(usbp, USB_MSD_DATA_EP)) {
+    msg = osalThreadSuspendS(&usbp->epc[USB_MSD_DATA_EP]->out_state->thread);
+  } else {
+    msg = (msg_t)usbGetReceiveTransactionSizeX(usbp, USB_MSD_DATA_EP);
+  }
+  osalSysUnlock();
+  if (msg < 0) {
+    return false;
+  }
+  msdp->transferred += msg;
+  return (uint32_t)msg == len;
+}
+
+/*
+ * Up to n blocks for the host: mapped blocks are sent from where they are,
+ * the others are read into buf. NULL on a read error.
+ */
+ITCM_CODE static const uint8_t *msd_read_blocks(USBMassStorageDriver *msdp,
+                                                uint32_t lba, uint8_t *buf,
+                                                uint32_t *n) {
+  if (msdp->map != NULL) {
+    const uint8_t *p = msdp->map(lba, n);
+    if (p != NULL) {
+      return p;
+    }
+  }
+  if (blkRead(msdp->bbdp, lba, buf, *n) != HAL_SUCCESS) {
+    return NULL;
+  }
+  return buf;
+}
+
+/*
+ * READ(10) and WRITE(10). The buffer is used as two halves: while the block
+ * device reads into or writes from one half, the USB transfer of the other
+ * half is in flight.
+ */
+ITCM_CODE static uint8_t msd_read_write(USBMassStorageDriver *msdp, bool write) {
+  const uint8_t *cb = msdp->cbw.cb;
+  uint32_t lba = get_be32(&cb[2]);
+  uint32_t count = get_be16(&cb[7]);
+  uint32_t blk_size = msdp->info.blk_size;
+  uint32_t max = msdp->bufsize / 2 / blk_size;
+  uint8_t *buf[2] = {msdp->buf, msdp->buf + max * blk_size};
+  uint8_t status = MSD_COMMAND_PASSED;
+
+  if (lba + count > msdp->info.blk_num || lba + count < lba) {
+    msd_sense(msdp, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_LBA_OUT_OF_RANGE, 0);
+    return MSD_COMMAND_FAILED;
+  }
+  if (count > 0 && (msdp->cbw.data_len < count * blk_size ||
+                    !(msdp->cbw.flags & MSD_CBW_FLAGS_IN) != write)) {
+    // host and device disagree on the data phase
+    return MSD_COMMAND_PHASE_ERROR;
+  }
+  if (write && blkIsWriteProtected(msdp->bbdp)) {
+    msd_sense(msdp, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_WRITE_PROTECTED, 0);
+    return MSD_COMMAND_FAILED;
+  }
+  if (count == 0) {
+    return MSD_COMMAND_PASSED;
+  }
+
+  unsigned cur = 0;
+  uint32_t n = min_u32(count, max);
+
+  if (write) {
+    if (!msd_start_out(msdp, buf[cur], n * blk_size)) {
+      return MSD_COMMAND_FAILED;
+    }
+    while (count > 0) {
+      if (!msd_wait_out(msdp, n * blk_size)) {
+        return MSD_COMMAND_FAILED;
+      }
+      uint32_t next = min_u32(count - n, max);
+      if (next > 0 && !msd_start_out(msdp, buf[cur ^ 1], next * blk_size)) {
+        return MSD_COMMAND_FAILED;
+      }
+      // after an error keep receiving, the host sends the data anyway
+      if (status == MSD_COMMAND_PASSED &&
+          blkWrite(msdp->bbdp, lba, buf[cur], n) != HAL_SUCCESS) {
+        msd_sense(msdp, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR, 0);
+        status = MSD_COMMAND_FAILED;
+      }
+      lba += n;
+      count -= n;
+      n = next;
+      cur ^= 1;
+    }
+  } else {
+    const uint8_t *src = msd_read_blocks(msdp, lba, buf[cur], &n);
+    if (src == NULL) {
+      msd_sense(msdp, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_READ_ERROR, 0);
+      return MSD_COMMAND_FAILED;
+    }
+    while (count > 0) {
+      if (!msd_start_in(msdp, src, n * blk_size)) {
+        return MSD_COMMAND_FAILED;
+      }
+      uint32_t next = min_u32(count - n, max);
+      const uint8_t *next_src = NULL;
+      if (next > 0) {
+        next_src = msd_read_blocks(msdp, lba + n, buf[cur ^ 1], &next);
+        if (next_src == NULL) {
+          msd_sense(msdp, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_READ_ERROR, 0);
+          status = MSD_COMMAND_FAILED;
+          next = 0;
+        }
+      }
+      if (!msd_wait_in(msdp, n * blk_size)) {
+        return MSD_COMMAND_FAILED;
+      }
+      if (status != MSD_COMMAND_PASSED) {
+        break;
+      }
+      lba += n;
+      count -= n;
+      n = next;
+      src = next_src;
+      cur ^= 1;
+    }
+  }
+  return status;
+}
+
+/*
+ * Vital product data: the supported pages and the block limits, which tell
+ * the host to send writes of a whole transfer buffer at once.
+ */
+ITCM_CODE static uint8_t msd_inquiry_vpd(USBMassStorageDriver *msdp) {
+  const uint8_t *cb = msdp->cbw.cb;
+  uint8_t *buf = msdp->buf;
+  uint32_t len;
+
+  switch (cb[2]) {
+  case SCSI_VPD_SUPPORTED_PAGES:
+    memset(buf, 0, 6);
+    buf[3] = 2;
+    buf[4] = SCSI_VPD_SUPPORTED_PAGES;
+    buf[5] = SCSI_VPD_BLOCK_LIMITS;
+    len = 6;
+    break;
+  case SCSI_VPD_BLOCK_LIMITS:
+    memset(buf, 0, 64);
+    buf[1] = SCSI_VPD_BLOCK_LIMITS;
+    buf[3] = 0x3C;
+    if (blkGetInfo(msdp->bbdp, &msdp->info) == HAL_SUCCESS) {
+      uint32_t blocks = msdp->bufsize / msdp->info.blk_size;
+      // granularity a half of the buffer, optimal the whole buffer, the
+      // maximum transfer length is left at 0: no limit
+      buf[6] = (blocks / 2) >> 8;
+      buf[7] = blocks / 2;
+      put_be32(&buf[12], blocks);
+    }
+    len = 64;
+    break;
+  default:
+    msd_sense(msdp, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB, 0);
+    return MSD_COMMAND_FAILED;
+  }
+  return msd_reply(msdp, buf, min_u32(len, get_be16(&cb[3])));
+}
+
+/*
+ * MODE SENSE(6) and (10), without block descriptors. The caching page
+ * reports a write cache: writes are collected per flash sector in RAM and
+ * SYNCHRONIZE CACHE programs them. Nothing can be changed with MODE SELECT.
+ */
+ITCM_CODE static uint8_t msd_mode_sense(USBMassStorageDriver *msdp, bool ten) {
+  const uint8_t *cb = msdp->cbw.cb;
+  uint8_t *buf = msdp->buf;
+  uint8_t page = cb[2] & 0x3F;
+  uint8_t pc = cb[2] >> 6;
+  uint32_t hdr = ten ? 8 : 4;
+  uint32_t len = hdr;
+
+  memset(buf, 0, hdr + 20);
+  if (page == SCSI_MODE_PAGE_CACHING || page == SCSI_MODE_PAGE_ALL) {
+    uint8_t *p = buf + hdr;
+    p[0] = SCSI_MODE_PAGE_CACHING;
+    p[1] = 0x12;
+    if (pc != SCSI_MODE_PC_CHANGEABLE) {
+      p[2] = 0x04; // WCE
+    }
+    len += 20;
+  }
+  if (ten) {
+    buf[1] = len - 2;
+    buf[3] = blkIsWriteProtected(msdp->bbdp) ? 0x80 : 0x00;
+    return msd_reply(msdp, buf, min_u32(len, get_be16(&cb[7])));
+  }
+  buf[0] = len - 1;
+  buf[2] = blkIsWriteProtected(msdp->bbdp) ? 0x80 : 0x00;
+  return msd_reply(msdp, buf, min_u32(len, cb[4]));
+}
+
+/*
+ * START STOP UNIT, an eject disconnects the block device unless the host
+ * prevented medium removal. The block device can refuse it as well.
+ */
+ITCM_CODE static uint8_t msd_start_stop(USBMassStorageDriver *msdp) {
+  const uint8_t *cb = msdp->cbw.cb;
+  bool loej = cb[4] & 0x02;
+  bool start = cb[4] & 0x01;
+
+  if (!loej) {
+    return MSD_COMMAND_PASSED;
+  }
+  if (start) {
+    return blkConnect(msdp->bbdp) == HAL_SUCCESS ?
+           MSD_COMMAND_PASSED : MSD_COMMAND_FAILED;
+  }
+  if (msdp->prevent || blkDisconnect(msdp->bbdp) != HAL_SUCCESS) {
+    msd_sense(msdp, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_MEDIUM_REMOVAL_PREVENTED,
+              SCSI_ASCQ_MEDIUM_REMOVAL_PREVENTED);
+    return MSD_COMMAND_FAILED;
+  }
+  return MSD_COMMAND_PASSED;
+}
+
+ITCM_CODE static uint8_t msd_scsi_command(USBMassStorageDriver *msdp) {
+  const uint8_t *cb = msdp->cbw.cb;
+  uint8_t *buf = msdp->buf;
+
+  if (cb[0] != SCSI_CMD_REQUEST_SENSE && cb[0] != SCSI_CMD_INQUIRY &&
+      cb[0] != SCSI_CMD_START_STOP_UNIT) {
+    if (!blkIsInserted(msdp->bbdp) ||
+        blkGetInfo(msdp->bbdp, &msdp->info) != HAL_SUCCESS) {
+      msd_sense(msdp, SCSI_SENSE_NOT_READY, SCSI_ASC_MEDIUM_NOT_PRESENT, 0);
+      return MSD_COMMAND_FAILED;
+    }
+  }
+
+  switch (cb[0]) {
+  case SCSI_CMD_TEST_UNIT_READY:
+  case SCSI_CMD_VERIFY_10:
+    return MSD_COMMAND_PASSED;
+
+  case SCSI_CMD_START_STOP_UNIT:
+    return msd_start_stop(msdp);
+
+  case SCSI_CMD_PREVENT_ALLOW_REMOVAL:
+    msdp->prevent = cb[4] & 0x01;
+    return MSD_COMMAND_PASSED;
+
+  case SCSI_CMD_REQUEST_SENSE:
+    // fixed format sense data
+    memset(buf, 0, 18);
+    buf[0] = 0x70;
+    buf[2] = msdp->sense_key;
+    buf[7] = 10;
+    buf[12] = msdp->asc;
+    buf[13] = msdp->ascq;
+    msd_sense(msdp, SCSI_SENSE_NO_SENSE, 0, 0);
+    return msd_reply(msdp, buf, min_u32(18, cb[4]));
+
+  case SCSI_CMD_INQUIRY:
+    if (cb[1] & 0x01) {
+      return msd_inquiry_vpd(msdp);
+    }
+    return msd_reply(msdp, (const uint8_t *)msdp->inquiry,
+                     min_u32(sizeof(*msdp->inquiry), get_be16(&cb[3])));
+
+  case SCSI_CMD_MODE_SENSE_6:
+    return msd_mode_sense(msdp, false);
+
+  case SCSI_CMD_MODE_SENSE_10:
+    return msd_mode_sense(msdp, true);
+
+  case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+    // written sectors collected in RAM are programmed before this passes
+    if (blkSync(msdp->bbdp) != HAL_SUCCESS) {
+      msd_sense(msdp, SCSI_SENSE_MEDIUM_ERROR, SCSI_ASC_WRITE_ERROR, 0);
+      return MSD_COMMAND_FAILED;
+    }
+    return MSD_COMMAND_PASSED;
+
+  case SCSI_CMD_READ_FORMAT_CAPACITIES:
+    memset(buf, 0, 12);
+    buf[3] = 8;
+    put_be32(&buf[4], msdp->info.blk_num);
+    put_be32(&buf[8], msdp->info.blk_size);
+    buf[8] = 0x02; // formatted media
+    return msd_reply(msdp, buf, min_u32(12, get_be16(&cb[7])));
+
+  case SCSI_CMD_READ_CAPACITY_10:
+    put_be32(&buf[0], msdp->info.blk_num - 1);
+    put_be32(&buf[4], msdp->info.blk_size);
+    return msd_reply(msdp, buf, 8);
+
+  case SCSI_CMD_READ_10:
+    return msd_read_write(msdp, false);
+
+  case SCSI_CMD_WRITE_10:
+    return msd_read_write(msdp, true);
+
+  default:
+    msd_sense(msdp, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_COMMAND, 0);
+    return MSD_COMMAND_FAILED;
+  }
+}
+
+ITCM_CODE static void msd_stats_add(USBMassStorageDriver *msdp, rtcnt_t start) {
+  msd_stats_group_t group;
+  uint32_t us = RTC2US(STM32_SYS_CK, chSysGetRealtimeCounterX() - start);
+
+  switch (msdp->cbw.cb[0]) {
+  case SCSI_CMD_READ_10:
+    group = MSD_STATS_READ;
+    break;
+  case SCSI_CMD_WRITE_10:
+    group = MSD_STATS_WRITE;
+    break;
+  case SCSI_CMD_TEST_UNIT_READY:
+    group = MSD_STATS_TEST_UNIT_READY;
+    break;
+  case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+    group = MSD_STATS_SYNC;
+    break;
+  default:
+    group = MSD_STATS_OTHER;
+    break;
+  }
+
+  msd_cmd_stats_t *st = &msdp->stats[group];
+  st->count++;
+  st->bytes += msdp->transferred;
+  st->total_us += us;
+  if (us > st->max_us) {
+    st->max_us = us;
+  }
+}
+
+/*
+ * Bulk only transport: command block, optional data, command status.
+ */
+ITCM_CODE static THD_FUNCTION(msd_thread, arg) {
+  USBMassStorageDriver *msdp = arg;
+
+  chRegSetThreadName("usb_msd");
+
+  while (!chThdShouldTerminateX()) {
+    msg_t msg = usbReceive(msdp->usbp, USB_MSD_DATA_EP,
+                           (uint8_t *)&msdp->cbw, sizeof(msdp->cbw));
+    if (msg == MSG_RESET) {
+      // not configured yet, or reset by the host
+      chThdSleepMilliseconds(10);
+      continue;
+    }
+    if (msg != sizeof(msdp->cbw) || msdp->cbw.signature != MSD_CBW_SIGNATURE) {
+      // stays stalled until the host does a reset recovery
+      msd_stall(msdp, true, true);
+      continue;
+    }
+
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    msdp->transferred = 0;
+    uint8_t status;
+    if (msdp->cbw.lun == 0) {
+      status = msd_scsi_command(msdp);
+    } else {
+      msd_sense(msdp, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB, 0);
+      status = MSD_COMMAND_FAILED;
+    }
+
+    if (msdp->transferred < msdp->cbw.data_len) {
+      // less data than the host expects, end the data phase
+      if (!(msdp->cbw.flags & MSD_CBW_FLAGS_IN)) {
+        msd_stall(msdp, false, true);
+      } else if (msdp->transferred % msdp->usbp->epc[USB_MSD_DATA_EP]->in_maxsize == 0) {
+        // no short packet to end it
+        msd_stall(msdp, true, false);
+      }
+    }
+
+    msdp->csw.signature = MSD_CSW_SIGNATURE;
+    msdp->csw.tag = msdp->cbw.tag;
+    msdp->csw.residue = msdp->cbw.data_len - msdp->transferred;
+    msdp->csw.status = status;
+    usbTransmit(msdp->usbp, USB_MSD_DATA_EP,
+                (const uint8_t *)&msdp->csw, sizeof(msdp->csw));
+    msd_stats_add(msdp, start);
+  }
+}
+
+/*===========================================================================*/
+/* Driver exported functions.                                                */
+/*===========================================================================*/
+
+/**
+ * @brief   Mass storage driver object initialization.
+ *
+ * @param[out] msdp     pointer to @p USBMassStorageDriver object
+ *
+ * @init
+ */
+void msdObjectInit(USBMassStorageDriver *msdp) {
+
+  memset(msdp, 0, sizeof(*msdp));
+}
+
+/**
+ * @brief   Starts the mass storage thread.
+ *
+ * @param[in] msdp      pointer to @p USBMassStorageDriver object
+ * @param[in] usbp      USB driver, its configuration must call
+ *                      @p msd_request_hook() for class requests
+ * @param[in] bbdp      block device to export
+ * @param[in] buf       transfer buffer, at least two blocks
+ * @param[in] bufsize   size of the transfer buffer
+ * @param[in] inquiry   INQUIRY response
+ *
+ * @api
+ */
+void msdStart(USBMassStorageDriver *msdp, USBDriver *usbp,
+              BaseBlockDevice *bbdp, uint8_t *buf, size_t bufsize,
+              const scsi_inquiry_response_t *inquiry) {
+
+  osalDbgCheck((msdp != NULL) && (usbp != NULL) && (bbdp != NULL) &&
+               (buf != NULL) && (inquiry != NULL));
+
+  msdp->usbp = usbp;
+  msdp->bbdp = bbdp;
+  msdp->buf = buf;
+  msdp->bufsize = bufsize;
+  msdp->inquiry = inquiry;
+  msd_sense(msdp, SCSI_SENSE_NO_SENSE, 0, 0);
+  msdp->thread = chThdCreateStatic(waMSD, sizeof(waMSD), NORMALPRIO,
+                                   msd_thread, msdp);
+}
+
+/**
+ * @brief   Lets READ(10) send memory mapped blocks in place.
+ * @details The mapped blocks are sent from their memory instead of being
+ *          copied to the transfer buffer by @p blkRead().
+ *
+ * @param[in] msdp      pointer to @p USBMassStorageDriver object
+ * @param[in] map       returns the memory of a block, NULL to disable
+ *
+ * @api
+ */
+void msdSetMap(USBMassStorageDriver *msdp, msd_map_t map) {
+
+  osalDbgCheck(msdp != NULL);
+
+  msdp->map = map;
+}
+
+/**
+ * @brief   Stops the mass storage thread.
+ * @details The thread exits at the next command or USB reset, stop or
+ *          disconnect the USB driver first.
+ *
+ * @param[in] msdp      pointer to @p USBMassStorageDriver object
+ *
+ * @api
+ */
+void msdStop(USBMassStorageDriver *msdp) {
+
+  osalDbgCheck(msdp != NULL);
+
+  if (msdp->thread != NULL) {
+    chThdTerminate(msdp->thread);
+    msdp->thread = NULL;
+  }
+}
+
+/**
+ * @brief   Handles the mass storage class requests.
+ *
+ * @param[in] usbp      pointer to the @p USBDriver object
+ * @return              true if the request was handled
+ *
+ * @iclass
+ */
+ITCM_CODE bool msd_request_hook(USBDriver *usbp) {
+  static uint8_t max_lun = 0;
+
+  if ((usbp->setup[0] & (USB_RTYPE_TYPE_MASK | USB_RTYPE_RECIPIENT_MASK)) !=
+      (USB_RTYPE_TYPE_CLASS | USB_RTYPE_RECIPIENT_INTERFACE) ||
+      usbp->setup[4] != 0) {
+    return false;
+  }
+
+  switch (usbp->setup[1]) {
+  case MSD_REQ_GET_MAX_LUN:
+    usbSetupTransfer(usbp, &max_lun, 1, NULL);
+    return true;
+  case MSD_REQ_RESET:
+    // the host clears the stalled endpoints after this
+    usbSetupTransfer(usbp, NULL, 0, NULL);
+    return true;
+  default:
+    return false;
+  }
+}
+
+/** @} */
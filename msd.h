@@ -0,0 +1,167 @@
+/**
+ * @file    msd.h
+ * @brief   USB mass storage (bulk only transport, SCSI) driver header.
+ *
+ * @addtogroup msd
+ * @{
+ */
+
+#ifndef MSD_H
+#define MSD_H
+
+#include "hal.h"
+
+/*===========================================================================*/
+/* Driver constants.                                                         */
+/*===========================================================================*/
+
+#define USB_MSD_DATA_EP                 0x01
+
+/*===========================================================================*/
+/* Driver pre-compile time settings.                                         */
+/*===========================================================================*/
+
+/**
+ * @brief   Stack size of the mass storage thread.
+ */
+#if !defined(MSD_THREAD_STACK_SIZE)
+#define MSD_THREAD_STACK_SIZE           1024
+#endif
+
+/*===========================================================================*/
+/* Derived constants and error checks.                                       */
+/*===========================================================================*/
+
+#if !HAL_USE_USB || !USB_USE_WAIT
+#error "msd.c requires HAL_USE_USB and USB_USE_WAIT"
+#endif
+
+/*===========================================================================*/
+/* Driver data structures and types.                                         */
+/*===========================================================================*/
+
+/**
+ * @brief   Standard INQUIRY data.
+ */
+typedef struct {
+  uint8_t peripheral;
+  uint8_t removable;
+  uint8_t version;
+  uint8_t response_data_format;
+  uint8_t additional_length;
+  uint8_t sccstp;
+  uint8_t bqueetc;
+  uint8_t cmdque;
+  uint8_t vendorid[8];
+  uint8_t productid[16];
+  uint8_t productrev[4];
+} __attribute__((packed)) scsi_inquiry_response_t;
+
+/**
+ * @brief   Command block wrapper.
+ */
+typedef struct {
+  uint32_t signature;
+  uint32_t tag;
+  uint32_t data_len;
+  uint8_t  flags;
+  uint8_t  lun;
+  uint8_t  cb_len;
+  uint8_t  cb[16];
+} __attribute__((packed)) msd_cbw_t;
+
+/**
+ * @brief   Command status wrapper.
+ */
+typedef struct {
+  uint32_t signature;
+  uint32_t tag;
+  uint32_t residue;
+  uint8_t  status;
+} __attribute__((packed)) msd_csw_t;
+
+/**
+ * @brief   Command groups of the command statistics.
+ */
+typedef enum {
+  MSD_STATS_READ,
+  MSD_STATS_WRITE,
+  MSD_STATS_TEST_UNIT_READY,
+  MSD_STATS_SYNC,
+  MSD_STATS_OTHER,
+  MSD_STATS_NUM
+} msd_stats_group_t;
+
+/**
+ * @brief   Memory mapped blocks of the block device.
+ * @details Returns the memory of block @p lba and cuts @p n to the blocks
+ *          that follow it there, or NULL leaving @p n alone when @p lba
+ *          has to be read with @p blkRead().
+ */
+typedef const uint8_t *(*msd_map_t)(uint32_t lba, uint32_t *n);
+
+/**
+ * @brief   Time the commands of a group took, from the CBW to the CSW.
+ */
+typedef struct {
+  uint32_t count;
+  uint32_t bytes;
+  uint32_t total_us;
+  uint32_t max_us;
+} msd_cmd_stats_t;
+
+/**
+ * @brief   USB mass storage driver.
+ */
+typedef struct {
+  USBDriver                     *usbp;
+  BaseBlockDevice               *bbdp;
+  /* Transfer buffer, READ(10) and WRITE(10) use it as two halves.*/
+  uint8_t                       *buf;
+  size_t                        bufsize;
+  const scsi_inquiry_response_t *inquiry;
+  /* Optional, READ(10) sends mapped blocks without copying them.*/
+  msd_map_t                     map;
+  thread_t                      *thread;
+  BlockDeviceInfo               info;
+  /* Current command.*/
+  msd_cbw_t                     cbw __attribute__((aligned(4)));
+  msd_csw_t                     csw __attribute__((aligned(4)));
+  uint32_t                      transferred;
+  /* Medium removal prevented by the host.*/
+  bool                          prevent;
+  /* Sense data reported by the next REQUEST SENSE.*/
+  uint8_t                       sense_key;
+  uint8_t                       asc;
+  uint8_t                       ascq;
+  /* Per command group, for the benchmark report.*/
+  msd_cmd_stats_t               stats[MSD_STATS_NUM];
+} USBMassStorageDriver;
+
+/*===========================================================================*/
+/* Driver macros.                                                            */
+/*===========================================================================*/
+
+/*===========================================================================*/
+/* External declarations.                                                    */
+/*===========================================================================*/
+
+extern USBMassStorageDriver USBMSD1;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  void msdObjectInit(USBMassStorageDriver *msdp);
+  void msdStart(USBMassStorageDriver *msdp, USBDriver *usbp,
+                BaseBlockDevice *bbdp, uint8_t *buf, size_t bufsize,
+                const scsi_inquiry_response_t *inquiry);
+  void msdSetMap(USBMassStorageDriver *msdp, msd_map_t map);
+  void msdStop(USBMassStorageDriver *msdp);
+  bool msd_request_hook(USBDriver *usbp);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MSD_H */
+
+/** @} */
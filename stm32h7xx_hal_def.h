@@ -30,6 +30,7 @@
 // #include "stm32h7xx.h"
 // #include "Legacy/stm32_hal_legacy.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <math.h>
 
 /* Exported types ------------------------------------------------------------*/
@@ -72,8 +73,8 @@ typedef enum
 #define assert_param     UNUSED
 #define USE_RTOS         0
 
-// TODO: timeouts are disabled now
-#define HAL_GetTick(x)   (0)
+// millisecond tick for the HAL timeouts, wraps at 2^32 ms, see bootloader.c
+uint32_t HAL_GetTick(void);
 
 /** @brief Reset the Handle's State field.
   * @param __HANDLE__: specifies the Peripheral Handle.
@@ -0,0 +1,349 @@
+/*
+ * Command handling of bulk.c. Transfers are handed to the protocol thread
+ * like the host sends them and every reply is checked against the framing
+ * of bulkproto.h: one transfer per command, the header echoing the command
+ * and tag, the data length in the header and a zero length packet after a
+ * reply of whole packets. The flash path below bulk.c writes the mapped
+ * flash directly and records what it was asked to do.
+ */
+#include "bulk.c"
+#include "host.h"
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define PACKET_SIZE 64
+#define SECTOR_SIZE (128 * 1024)
+
+static int failures;
+
+/* calls into the flash path */
+static struct {
+  unsigned writes;              // write_payload() calls
+  uint32_t written;             // bytes passed to write_payload()
+  unsigned erases;
+  uint32_t erase_start;         // of the last erase
+  uint32_t erase_end;
+  unsigned syncs;
+  unsigned verifies;
+  unsigned locks;
+  bool write_fail;              // write_payload() refuses
+  bool sync_fail;               // flash_sync() reports an error
+} rec;
+
+bool write_payload(uint32_t addr, const uint8_t *data, uint32_t len) {
+  rec.writes++;
+  if (rec.write_fail) {
+    return HAL_FAILED;
+  }
+  rec.written += len;
+  memcpy((void *)(uintptr_t)addr, data, len);
+  return HAL_SUCCESS;
+}
+
+bool flash_erase(uint32_t start, uint32_t end) {
+  rec.erases++;
+  rec.erase_start = start;
+  rec.erase_end = end;
+  if (start % SECTOR_SIZE || end % SECTOR_SIZE || end <= start) {
+    return HAL_FAILED;
+  }
+  memset((void *)(uintptr_t)start, 0xff, end - start);
+  return HAL_SUCCESS;
+}
+
+bool flash_sync(void) {
+  rec.syncs++;
+  return rec.sync_fail ? HAL_FAILED : HAL_SUCCESS;
+}
+
+bool flash_verify(void) {
+  rec.verifies++;
+  return HAL_SUCCESS;
+}
+
+uint32_t flash_crc32(uint32_t crc, const uint8_t *data, uint32_t len) {
+  return bulk_crc32(crc, data, len);
+}
+
+void ghostfat_lock(void) { rec.locks++; }
+void ghostfat_unlock(void) { rec.locks--; }
+
+/*
+ * The endpoint. usbReceive() hands the next transfer to the thread once,
+ * the call after that returns to the test.
+ */
+static const USBEndpointConfig ep_config = {PACKET_SIZE, PACKET_SIZE};
+static USBDriver usbd = {USB_ACTIVE, {[USB_BULK_DATA_EP] = &ep_config}};
+static jmp_buf received;
+static struct {
+  uint8_t buf[1024];
+  size_t len;
+  msg_t msg;                    // MSG_OK, or what usbReceive() returns instead
+  bool taken;
+} in;
+static struct {
+  uint8_t buf[BULK_MAX_TRANSFER];
+  size_t len;
+  unsigned transfers;           // not counting zero length packets
+  unsigned zlps;
+} out;
+
+msg_t usbReceive(USBDriver *usbp, usbep_t ep, uint8_t *buf, size_t n) {
+  CHECK(usbp == &usbd && ep == USB_BULK_DATA_EP, "receive on endpoint %u", ep);
+  if (in.taken) {
+    longjmp(received, 1);
+  }
+  in.taken = true;
+  if (in.msg != MSG_OK) {
+    return in.msg;
+  }
+  // the driver ends the transfer when the buffer is full
+  size_t len = in.len < n ? in.len : n;
+  memcpy(buf, in.buf, len);
+  return len;
+}
+
+msg_t usbTransmit(USBDriver *usbp, usbep_t ep, const uint8_t *buf, size_t n) {
+  CHECK(usbp == &usbd && ep == USB_BULK_DATA_EP, "transmit on endpoint %u", ep);
+  if (n == 0) {
+    out.zlps++;
+    return MSG_OK;
+  }
+  CHECK(out.zlps == 0 && n <= sizeof(out.buf), "transfer of %zu bytes", n);
+  out.transfers++;
+  out.len = n <= sizeof(out.buf) ? n : sizeof(out.buf);
+  memcpy(out.buf, buf, out.len);
+  return MSG_OK;
+}
+
+/* runs the thread for one received transfer */
+static void transfer(const void *data, size_t len, msg_t msg) {
+  memcpy(in.buf, data, len);
+  in.len = len;
+  in.msg = msg;
+  in.taken = false;
+  memset(&out, 0, sizeof(out));
+  if (!setjmp(received)) {
+    bulk_thread(&usbd);
+  }
+  CHECK(rec.locks == 0, "%u locks held", rec.locks);
+}
+
+/* reply to a transfer that isn't a well formed command */
+static void check_malformed(const char *what, const void *data, size_t len) {
+  const bulk_rsp_t *rsp = (const bulk_rsp_t *)out.buf;
+  unsigned writes = rec.writes;
+
+  transfer(data, len, MSG_OK);
+  CHECK(out.transfers == 1 && out.len == sizeof(*rsp) && rsp->len == 0, "%s: %u transfers of %zu bytes",
+        what, out.transfers, out.len);
+  CHECK(rsp->status == BULK_ERR_CMD && rsp->cmd == 0 && rsp->tag == 0, "%s: status %u", what, rsp->status);
+  CHECK(rec.writes == writes && !dirty, "%s: the command was executed", what);
+}
+
+/*
+ * Sends a command, checks the framing of the reply and returns its header,
+ * the reply data follows it.
+ */
+static const bulk_rsp_t *command(uint8_t c, uint32_t addr, uint32_t size, const void *data, uint16_t len) {
+  static uint8_t tag;
+  uint8_t buf[sizeof(bulk_cmd_t) + BULK_MAX_PAYLOAD];
+  bulk_cmd_t cmd = {c, ++tag, len, addr, size};
+  const bulk_rsp_t *rsp = (const bulk_rsp_t *)out.buf;
+
+  memcpy(buf, &cmd, sizeof(cmd));
+  if (len) {
+    memcpy(buf + sizeof(cmd), data, len);
+  }
+  transfer(buf, sizeof(cmd) + len, MSG_OK);
+  CHECK(out.transfers == 1, "command %u: %u transfers", c, out.transfers);
+  CHECK(rsp->cmd == c && rsp->tag == tag, "command %u: reply to %u tag %u", c, rsp->cmd, rsp->tag);
+  CHECK(out.len == sizeof(*rsp) + rsp->len, "command %u: %zu bytes for %u data bytes", c, out.len, rsp->len);
+  CHECK(out.zlps == (out.len % PACKET_SIZE == 0), "command %u: %u zero length packets after %zu bytes", c,
+        out.zlps, out.len);
+  return rsp;
+}
+
+static void expect(const char *what, const bulk_rsp_t *rsp, uint8_t status, uint16_t len) {
+  CHECK(rsp->status == status && rsp->len == len, "%s: status %u, %u bytes", what, rsp->status, rsp->len);
+}
+
+static uint8_t pattern[2 * BULK_MAX_PAYLOAD];
+
+static void test_framing(void) {
+  bulk_cmd_t cmd = {BULK_CMD_WRITE, 7, 8, USER_FLASH_START, 0};
+  uint8_t buf[sizeof(cmd) + BULK_MAX_TRANSFER];
+
+  memcpy(buf, &cmd, sizeof(cmd));
+  check_malformed("empty transfer", buf, 0);
+  check_malformed("truncated header", buf, sizeof(cmd) - 1);
+  check_malformed("truncated data", buf, sizeof(cmd) + 4);
+  check_malformed("extra data", buf, sizeof(cmd) + 12);
+
+  cmd.len = BULK_MAX_PAYLOAD + 4;
+  memcpy(buf, &cmd, sizeof(cmd));
+  check_malformed("oversized payload", buf, sizeof(cmd) + cmd.len);
+  // more than the buffer, the driver cuts the transfer short
+  check_malformed("oversized transfer", buf, sizeof(buf));
+
+  transfer(buf, sizeof(cmd), MSG_RESET);
+  CHECK(out.transfers == 0 && out.zlps == 0, "bus reset: %u transfers", out.transfers);
+
+  expect("unknown command", command(0, 0, 0, NULL, 0), BULK_ERR_CMD, 0);
+  expect("unknown command", command(BULK_CMD_RESET + 1, 0, 0, NULL, 0), BULK_ERR_CMD, 0);
+}
+
+static void test_info(void) {
+  const bulk_rsp_t *rsp = command(BULK_CMD_INFO, 0, 0, NULL, 0);
+  bulk_info_t info;
+
+  expect("info", rsp, BULK_OK, sizeof(info));
+  memcpy(&info, rsp + 1, sizeof(info));
+  CHECK(info.version == BULK_PROTO_VERSION && info.flash_start == USER_FLASH_START &&
+        info.flash_end == USER_FLASH_END && info.max_payload == BULK_MAX_PAYLOAD &&
+        info.family == UF2_FAMILY, "info: fields");
+  CHECK(!strcmp(info.board, BOARD_ID), "info: board %.32s", info.board);
+}
+
+static void test_write(void) {
+  uint32_t addr = USER_FLASH_START + SECTOR_SIZE;
+
+  expect("write below the user flash", command(BULK_CMD_WRITE, USER_FLASH_START - 4, 0, pattern, 8),
+         BULK_ERR_ARG, 0);
+  expect("write past the end", command(BULK_CMD_WRITE, USER_FLASH_END - 4, 0, pattern, 8), BULK_ERR_ARG, 0);
+  expect("write wrapping around", command(BULK_CMD_WRITE, 0xfffffffc, 0, pattern, 8), BULK_ERR_ARG, 0);
+  expect("unaligned write", command(BULK_CMD_WRITE, addr + 2, 0, pattern, 8), BULK_ERR_ARG, 0);
+  expect("partial word write", command(BULK_CMD_WRITE, addr, 0, pattern, 6), BULK_ERR_ARG, 0);
+  expect("empty write", command(BULK_CMD_WRITE, addr, 0, pattern, 0), BULK_ERR_ARG, 0);
+  CHECK(rec.writes == 0 && !dirty, "refused writes were queued");
+
+  // consecutive writes are queued in whole pages, the rest on the sync
+  expect("write", command(BULK_CMD_WRITE, addr, 0, pattern, BULK_MAX_PAYLOAD), BULK_OK, 0);
+  CHECK(rec.writes == 1 && rec.written == 256, "first write: %u pages queued", rec.writes);
+  expect("write", command(BULK_CMD_WRITE, addr + BULK_MAX_PAYLOAD, 0, pattern + BULK_MAX_PAYLOAD,
+                          BULK_MAX_PAYLOAD), BULK_OK, 0);
+  CHECK(rec.writes == 3 && rec.written == 768, "second write: %u pages queued", rec.writes);
+  rec.syncs = rec.verifies = 0;
+  expect("sync", command(BULK_CMD_SYNC, 0, 0, NULL, 0), BULK_OK, 0);
+  CHECK(rec.writes == 4 && rec.written == sizeof(pattern), "sync: %u bytes queued", rec.written);
+  CHECK(rec.syncs == 1 && rec.verifies == 1 && !dirty, "sync: %u syncs, %u verifies", rec.syncs, rec.verifies);
+  CHECK(!memcmp((const void *)(uintptr_t)addr, pattern, sizeof(pattern)), "written flash differs");
+
+  // a refused page is reported by the next sync only
+  rec.write_fail = true;
+  expect("refused write", command(BULK_CMD_WRITE, addr, 0, pattern, 256), BULK_OK, 0);
+  rec.write_fail = false;
+  expect("sync after a refused write", command(BULK_CMD_SYNC, 0, 0, NULL, 0), BULK_ERR_FLASH, 0);
+  expect("sync", command(BULK_CMD_SYNC, 0, 0, NULL, 0), BULK_OK, 0);
+
+  rec.sync_fail = true;
+  expect("failed sync", command(BULK_CMD_SYNC, 0, 0, NULL, 0), BULK_ERR_FLASH, 0);
+  // reset only after a good sync, the host stub would abort
+  expect("reset after a failed sync", command(BULK_CMD_RESET, 0, 0, NULL, 0), BULK_ERR_FLASH, 0);
+  rec.sync_fail = false;
+}
+
+static void test_erase(void) {
+  uint32_t addr = USER_FLASH_START + 2 * SECTOR_SIZE;
+
+  rec.erases = 0;
+  expect("erase below the user flash", command(BULK_CMD_ERASE, USER_FLASH_START - SECTOR_SIZE, SECTOR_SIZE,
+                                               NULL, 0), BULK_ERR_ARG, 0);
+  expect("erase past the end", command(BULK_CMD_ERASE, USER_FLASH_END - SECTOR_SIZE, 2 * SECTOR_SIZE,
+                                       NULL, 0), BULK_ERR_ARG, 0);
+  expect("erase wrapping around", command(BULK_CMD_ERASE, addr, 0 - addr, NULL, 0), BULK_ERR_ARG, 0);
+#ifdef DEVSPEC_FLASH_START
+  expect("erase of device specific flash", command(BULK_CMD_ERASE, DEVSPEC_FLASH_START - SECTOR_SIZE,
+                                                   2 * SECTOR_SIZE, NULL, 0), BULK_ERR_ARG, 0);
+#endif
+  CHECK(rec.erases == 0, "out of range erases were queued");
+  expect("unaligned erase", command(BULK_CMD_ERASE, addr + 256, SECTOR_SIZE, NULL, 0), BULK_ERR_ARG, 0);
+
+  // the pending page goes first, the erase covers it
+  unsigned writes = rec.writes;
+  expect("write", command(BULK_CMD_WRITE, addr, 0, pattern, 100), BULK_OK, 0);
+  CHECK(rec.writes == writes, "partial page queued before the sync");
+  expect("erase", command(BULK_CMD_ERASE, addr, SECTOR_SIZE, NULL, 0), BULK_OK, 0);
+  CHECK(rec.writes == writes + 1, "pending page not queued before the erase");
+  CHECK(rec.erase_start == addr && rec.erase_end == addr + SECTOR_SIZE, "erase of %x-%x", rec.erase_start,
+        rec.erase_end);
+  CHECK(dirty, "erase isn't synced");
+  expect("sync", command(BULK_CMD_SYNC, 0, 0, NULL, 0), BULK_OK, 0);
+}
+
+static void test_read(void) {
+  uint32_t addr = USER_FLASH_START + 3 * SECTOR_SIZE;
+  const bulk_rsp_t *rsp;
+
+  expect("read too long", command(BULK_CMD_READ, addr, BULK_MAX_PAYLOAD + 4, NULL, 0), BULK_ERR_ARG, 0);
+  expect("read below the flash", command(BULK_CMD_READ, BOARD_FLASH_BASE - 4, 8, NULL, 0), BULK_ERR_ARG, 0);
+  expect("read past the end", command(BULK_CMD_READ, BOARD_FLASH_BASE + BOARD_FLASH_SIZE - 4, 8, NULL, 0),
+         BULK_ERR_ARG, 0);
+  expect("read wrapping around", command(BULK_CMD_READ, 0xfffffff0, 0x20, NULL, 0), BULK_ERR_ARG, 0);
+
+  // the bootloader's own flash can be read
+  rsp = command(BULK_CMD_READ, BOARD_FLASH_BASE, 16, NULL, 0);
+  expect("read of the bootloader", rsp, BULK_OK, 16);
+
+  // queued writes are programmed first
+  expect("write", command(BULK_CMD_WRITE, addr, 0, pattern, 100), BULK_OK, 0);
+  rec.syncs = 0;
+  rsp = command(BULK_CMD_READ, addr, 100, NULL, 0);
+  expect("read after a write", rsp, BULK_OK, 100);
+  CHECK(rec.syncs == 1 && !dirty, "read: %u syncs", rec.syncs);
+  CHECK(!memcmp(rsp + 1, pattern, 100), "read: data differs");
+
+  // a reply of whole packets is followed by a zero length packet
+  rsp = command(BULK_CMD_READ, addr, PACKET_SIZE - sizeof(*rsp), NULL, 0);
+  expect("read of a packet", rsp, BULK_OK, PACKET_SIZE - sizeof(*rsp));
+  rsp = command(BULK_CMD_READ, addr, BULK_MAX_PAYLOAD, NULL, 0);
+  expect("longest read", rsp, BULK_OK, BULK_MAX_PAYLOAD);
+  CHECK(!memcmp(rsp + 1, (const void *)(uintptr_t)addr, BULK_MAX_PAYLOAD), "longest read: data differs");
+
+  rec.sync_fail = true;
+  expect("write", command(BULK_CMD_WRITE, addr, 0, pattern, 100), BULK_OK, 0);
+  expect("read after a failed sync", command(BULK_CMD_READ, addr, 100, NULL, 0), BULK_ERR_FLASH, 100);
+  rec.sync_fail = false;
+}
+
+static void test_crc(void) {
+  uint32_t addr = USER_FLASH_START + SECTOR_SIZE;
+  const bulk_rsp_t *rsp;
+
+  expect("unaligned crc", command(BULK_CMD_CRC, addr + 2, 8, NULL, 0), BULK_ERR_ARG, 0);
+  expect("crc of partial words", command(BULK_CMD_CRC, addr, 6, NULL, 0), BULK_ERR_ARG, 0);
+  expect("crc below the flash", command(BULK_CMD_CRC, BOARD_FLASH_BASE - 4, 8, NULL, 0), BULK_ERR_ARG, 0);
+  expect("crc past the end", command(BULK_CMD_CRC, BOARD_FLASH_BASE, BOARD_FLASH_SIZE + 4, NULL, 0),
+         BULK_ERR_ARG, 0);
+  expect("crc wrapping around", command(BULK_CMD_CRC, 0xfffffff0, 0x20, NULL, 0), BULK_ERR_ARG, 0);
+
+  rsp = command(BULK_CMD_CRC, addr, sizeof(pattern), NULL, 0);
+  expect("crc", rsp, BULK_OK, 0);
+  CHECK(rsp->value == bulk_crc32(0, pattern, sizeof(pattern)), "crc: %08x", rsp->value);
+  rsp = command(BULK_CMD_CRC, BOARD_FLASH_BASE, BOARD_FLASH_SIZE, NULL, 0);
+  expect("crc of the whole flash", rsp, BULK_OK, 0);
+}
+
+int main(void) {
+  host_flash_map(PROT_READ | PROT_WRITE);
+  srand(1);
+  for (unsigned i = 0; i < sizeof(pattern); i++) {
+    pattern[i] = rand();
+  }
+
+  test_framing();
+  test_info();
+  test_write();
+  test_erase();
+  test_read();
+  test_crc();
+
+  if (failures) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("bulk: ok\n");
+  return 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * Flash word programming of flash.c against a mock flash controller.
+ *
+ * The flash is mapped read-only at its device address. A store to it faults,
+ * the fault handler lets the store through and single steps it, the trap
+ * handler takes the stored word, puts the flash back and hands the word to
+ * the mock controller. Like the STM32H7 write buffer the controller collects
+ * the eight 32-bit words of a 256-bit flash word and programs the flash word
+ * once it is complete, it flags the programming errors the hardware would.
+ *
+ * Needs x86-64 Linux for the single stepping.
+ */
+#define _GNU_SOURCE
+#include "flash.c"
+#include "bulkproto.h"
+#include "host.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "the mock flash controller needs x86-64 Linux"
+#endif
+
+#define EFLAGS_TF 0x100
+
+static int failures;
+
+static struct {
+	uint32_t store_addr;        // store being single stepped
+	uint32_t store_old;
+	uint32_t buf_addr;          // flash word in the write buffer
+	uint32_t buf[FLASH_NB_32BITWORD_IN_FLASHWORD];
+	uint8_t buf_mask;
+	unsigned stores;
+	unsigned programs;          // flash words programmed
+	unsigned reprograms;        // flash words programmed that weren't blank
+	uint32_t inject;            // error flags for the next program
+} mock;
+
+static void flash_protect(uint32_t addr, uint32_t len, int prot) {
+	uint32_t page = addr & ~(uint32_t)(getpagesize() - 1);
+	mprotect((void *)(uintptr_t)page, addr + len - page, prot);
+}
+
+static void mock_reset(void) {
+	flash_protect(FLASH_BASE, FLASH_SIZE, PROT_READ | PROT_WRITE);
+	memset((void *)FLASH_BASE, 0xff, FLASH_SIZE);
+	flash_protect(FLASH_BASE, FLASH_SIZE, PROT_READ);
+	memset(&mock, 0, sizeof(mock));
+	FLASH->CR1 = FLASH->CR2 = FLASH_CR_LOCK;
+	FLASH->SR1 = FLASH->SR2 = 0;
+}
+
+/* error flags are cleared by writing them to CCR */
+static void mock_clear(void) {
+	FLASH->SR1 &= ~FLASH->CCR1;
+	FLASH->SR2 &= ~FLASH->CCR2;
+	FLASH->CCR1 = FLASH->CCR2 = 0;
+}
+
+static void mock_store(uint32_t addr, uint32_t value) {
+	bool bank2 = addr >= FLASH_BANK2_BASE;
+	uint32_t cr = bank2 ? FLASH->CR2 : FLASH->CR1;
+	volatile uint32_t *sr = bank2 ? &FLASH->SR2 : &FLASH->SR1;
+	uint32_t word = addr & ~(uint32_t)(FLASH_WORD_SIZE - 1);
+	unsigned i = (addr - word) / sizeof(uint32_t);
+
+	mock_clear();
+	mock.stores++;
+	if ((cr & FLASH_CR_LOCK) || !(cr & FLASH_CR_PG)) {
+		*sr |= FLASH_SR_PGSERR;
+		return;
+	}
+	if (mock.buf_mask && (mock.buf_addr != word || (mock.buf_mask & (1 << i)))) {
+		// a store to another flash word before the buffer was complete
+		*sr |= FLASH_SR_INCERR;
+		mock.buf_mask = 0;
+		return;
+	}
+	mock.buf_addr = word;
+	mock.buf[i] = value;
+	mock.buf_mask |= 1 << i;
+	if (mock.buf_mask != 0xff) {
+		return;
+	}
+
+	mock.buf_mask = 0;
+	if (mock.inject) {
+		*sr |= mock.inject;
+		mock.inject = 0;
+		return;
+	}
+	uint32_t *flash = (uint32_t *)(uintptr_t)word;
+	for (unsigned w = 0; w < FLASH_NB_32BITWORD_IN_FLASHWORD; w++) {
+		if (flash[w] != 0xffffffff) {
+			mock.reprograms++;
+			break;
+		}
+	}
+	flash_protect(word, FLASH_WORD_SIZE, PROT_READ | PROT_WRITE);
+	memcpy(flash, mock.buf, FLASH_WORD_SIZE);
+	flash_protect(word, FLASH_WORD_SIZE, PROT_READ);
+	mock.programs++;
+	*sr |= FLASH_SR_EOP;
+}
+
+static void segv_handler(int sig, siginfo_t *si, void *ctx) {
+	uintptr_t addr = (uintptr_t)si->si_addr;
+	ucontext_t *uc = ctx;
+
+	if (addr < FLASH_BASE || addr >= FLASH_BASE + FLASH_SIZE || mock.store_addr) {
+		signal(sig, SIG_DFL);
+		return;
+	}
+	mock.store_addr = addr & ~(uintptr_t)3;
+	mock.store_old = *(uint32_t *)(uintptr_t)mock.store_addr;
+	flash_protect(mock.store_addr, sizeof(uint32_t), PROT_READ | PROT_WRITE);
+	uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+}
+
+static void trap_handler(int sig, siginfo_t *si, void *ctx) {
+	ucontext_t *uc = ctx;
+	(void)sig;
+	(void)si;
+
+	uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+	if (!mock.store_addr) {
+		return;
+	}
+	uint32_t *p = (uint32_t *)(uintptr_t)mock.store_addr;
+	uint32_t value = *p;
+	*p = mock.store_old;
+	flash_protect(mock.store_addr, sizeof(uint32_t), PROT_READ);
+	mock_store(mock.store_addr, value);
+	mock.store_addr = 0;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Unlock_Bank1(void) { FLASH->CR1 &= ~FLASH_CR_LOCK; return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASHEx_Lock_Bank1(void) { FLASH->CR1 |= FLASH_CR_LOCK; return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASHEx_Unlock_Bank2(void) { FLASH->CR2 &= ~FLASH_CR_LOCK; return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASHEx_Lock_Bank2(void) { FLASH->CR2 |= FLASH_CR_LOCK; return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASHEx_ComputeCRC(FLASH_CRCInitTypeDef *pCRCInit, uint32_t *CRC_Result) {
+	(void)pCRCInit;
+	(void)CRC_Result;
+	return HAL_ERROR;
+}
+
+static uint8_t pattern[FLASH_SECTOR_MAX_SIZE + 8];
+
+static bool flash_equals(uint32_t addr, const uint8_t *data, uint32_t len) {
+	return memcmp((const void *)(uintptr_t)addr, data, len) == 0;
+}
+
+/*
+ * Program len bytes from pattern + src_offset to dst and check the flash
+ * words programmed and the flash up to the end of the last flash word,
+ * which is padded with the erased value. inject fails the first program.
+ */
+static void test_program(const char *name, uint32_t dst, uint32_t src_offset, uint32_t len,
+		uint32_t inject, bool result, unsigned programs) {
+	const uint8_t *src = pattern + src_offset;
+	static uint8_t expected[2 * FLASH_WORD_SIZE + 256];
+
+	memset(expected, 0xff, sizeof(expected));
+	memcpy(expected, src, len);
+
+	mock_reset();
+	mock.inject = inject;
+	HAL_FLASHEx_Unlock_Bank1();
+	bool err = flash_program(FLASH_BANK_1, dst, src, len);
+	HAL_FLASHEx_Lock_Bank1();
+	mock_clear();
+
+	printf("%-24s %4u stores, %4u flash words programmed\n", name, mock.stores, mock.programs);
+	CHECK(err == result, "%s: returned %d", name, err);
+	CHECK(mock.programs == programs, "%s: %u flash words programmed, expected %u",
+		name, mock.programs, programs);
+	CHECK(mock.buf_mask == 0, "%s: partial flash word left in the write buffer", name);
+	CHECK(!(FLASH->CR1 & FLASH_CR_PG), "%s: PG left set", name);
+	CHECK((FLASH->SR1 & ~FLASH_SR_EOP) == 0, "%s: SR1 %08x", name, FLASH->SR1);
+	if (result == HAL_SUCCESS) {
+		// the flash word after the last one stays blank
+		uint32_t end = (len + FLASH_WORD_SIZE - 1) / FLASH_WORD_SIZE * FLASH_WORD_SIZE;
+		CHECK(flash_equals(dst, expected, end + FLASH_WORD_SIZE), "%s: flash differs", name);
+	}
+}
+
+/*
+ * Program a collected sector over blank flash, then again over itself:
+ * only the flash words that differ are programmed, each of them once.
+ */
+static void test_program_sector(void) {
+	uint32_t addr = USER_FLASH_START;
+	uint32_t size = flash_func_sector_size(FLASH_SECTOR_INDEX(addr));
+	static uint8_t buf[FLASH_SECTOR_MAX_SIZE];
+	unsigned words = 0;
+
+	mock_reset();
+	memset(buf, 0xff, sizeof(buf));
+	// UF2 payloads: a full one, a short one, one that ends the sector
+	memcpy(buf + 0x1000, pattern, 256);
+	memcpy(buf + 0x2100, pattern + 3, 100);
+	memcpy(buf + size - 256, pattern + 1, 256);
+	static const uint8_t blank[FLASH_WORD_SIZE] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	};
+	for (uint32_t i = 0; i < size; i += FLASH_WORD_SIZE) {
+		if (memcmp(buf + i, blank, FLASH_WORD_SIZE) != 0) {
+			words++;
+		}
+	}
+
+	bool err = flash_program_sector(FLASH_BANK_1, buf, addr, size);
+	printf("%-24s %4u stores, %4u flash words programmed\n", "sector", mock.stores, mock.programs);
+	CHECK(err == HAL_SUCCESS, "sector: returned %d", err);
+	CHECK(mock.programs == words, "sector: %u flash words programmed, expected %u", mock.programs, words);
+	CHECK(mock.reprograms == 0, "sector: %u flash words programmed twice", mock.reprograms);
+	CHECK(flash_equals(addr, buf, size), "sector: data differs");
+	CHECK(FLASH->CR1 & FLASH_CR_LOCK, "sector: bank left unlocked");
+
+	mock.programs = 0;
+	err = flash_program_sector(FLASH_BANK_1, buf, addr, size);
+	CHECK(err == HAL_SUCCESS && mock.programs == 0,
+		"sector: %u flash words programmed again", mock.programs);
+}
+
+/*
+ * The table driven CRC against the bitwise one of the bulk protocol, the
+ * expected CRC of a sector has to match the flash CRC unit.
+ */
+static void test_crc32(void) {
+	uint32_t crc = flash_crc32(0, pattern, FLASH_SECTOR_MAX_SIZE);
+	CHECK(crc == bulk_crc32(0, pattern, FLASH_SECTOR_MAX_SIZE), "crc32: %08x", crc);
+	crc = flash_crc32(flash_crc32(0, pattern, 1000), pattern + 1000, 24);
+	CHECK(crc == bulk_crc32(0, pattern, 1024), "crc32 in parts: %08x", crc);
+	CHECK(flash_crc32(0, pattern, 0) == 0, "crc32 of nothing");
+}
+
+int main(void) {
+	struct sigaction sa = {.sa_flags = SA_SIGINFO};
+	sa.sa_sigaction = segv_handler;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = trap_handler;
+	sigaction(SIGTRAP, &sa, NULL);
+
+	host_flash_map(PROT_READ);
+	flash_init();
+	srand(1);
+	for (unsigned i = 0; i < sizeof(pattern); i++) {
+		pattern[i] = rand();
+	}
+
+	uint32_t dst = USER_FLASH_START + 0x1000;
+	// one UF2 payload is eight flash words
+	test_program("aligned payload", dst, 0, 256, 0, HAL_SUCCESS, 8);
+	test_program("unaligned source", dst, 1, 256, 0, HAL_SUCCESS, 8);
+	test_program("partial last word", dst, 0, 250, 0, HAL_SUCCESS, 8);
+	test_program("unaligned tail", dst, 3, 77, 0, HAL_SUCCESS, 3);
+	test_program("single byte", dst, 2, 1, 0, HAL_SUCCESS, 1);
+	test_program("unaligned destination", dst + 4, 0, 256, 0, HAL_FAILED, 0);
+	test_program("write protection error", dst, 0, 256, FLASH_SR_WRPERR, HAL_FAILED, 0);
+
+	test_program_sector();
+	test_crc32();
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("flash: ok\n");
+	return 0;
+}
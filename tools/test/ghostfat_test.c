@@ -0,0 +1,411 @@
+/*
+ * Drive image of ghostfat.c. The image is read with read_block() like a host
+ * would, its FAT file system is checked and the files are compared with the
+ * flash they export. Blocks mapped by ghostfat_map_blocks() have to match
+ * what read_block() returns for them. Ejecting the untouched drive must not
+ * reset. An update the flash refuses has to fail. In normal mode the drive is laid out again after a write and checked
+ * once more.
+ *
+ * ghostfat_test [normal|failsafe|bench]
+ */
+#include "hal.h"
+#include "portab.h"
+#include "uf2.h"
+#include "flash.h"
+#include "bootloader.h"
+#include "ghostfat.h"
+#include "msd.h"
+#include "host.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static int failures;
+
+USBMassStorageDriver USBMSD1;
+boot_stats_t boot_stats;
+flash_crc_t flash_crc[BOARD_FLASH_SECTORS];
+
+bool check_bootloader_button(void) { return host_buttons[PORTAB_BOOTLOADER_BUTTON]; }
+void reset_to_uf2_bootloader(void) { abort(); }
+void flash_erase_ahead(uint32_t start, uint32_t end, bool failsafe) { (void)start; (void)end; (void)failsafe; }
+void flash_print_stats(void) {}
+bool flash_sync(void) { return HAL_SUCCESS; }
+void flash_reset(void) {}
+bool flash_verify(void) { return HAL_SUCCESS; }
+static bool flash_write_fails;
+bool flash_write(uint32_t dst, const uint8_t *src, int len, bool failsafe) {
+    (void)failsafe;
+    if (flash_write_fails) {
+        return HAL_FAILED;
+    }
+    memcpy((void *)(uintptr_t)dst, src, len);
+    return HAL_SUCCESS;
+}
+
+static const char fwVersion[] = "Firmware v1.2.3\r\n";
+#define CONFIGHTM_ADDR 0x08050000
+#define CONFIGHTM_LEN 20000
+
+/*
+ * Flash with a firmware version, a CONFIG.HTM segment and an application
+ * with blank holes, plus some scattered words in the rest of the flash.
+ */
+static void fill_flash(void) {
+    uint32_t *seg = (uint32_t *)CONFIGHTM_FILE;
+
+    srand(1);
+    strcpy((char *)FWVERSIONFILE, fwVersion);
+    seg[0] = CONFIGHTM_ADDR;
+    seg[1] = CONFIGHTM_LEN;
+    for (unsigned i = 0; i < CONFIGHTM_LEN; i++) {
+        ((char *)CONFIGHTM_ADDR)[i] = 'a' + i % 26;
+    }
+    for (uint32_t a = APP_LOAD_ADDRESS; a < APP_LOAD_ADDRESS + 300000; a += 4) {
+        if ((a / 256) % 7 != 3) {
+            *(uint32_t *)(uintptr_t)a = rand();
+        }
+    }
+    for (unsigned i = 0; i < 300; i++) {
+        uint32_t a = BOARD_FLASH_BASE + (rand() % (BOARD_FLASH_SIZE / 4)) * 4;
+        if (a >= CFGUF2_ADDRESS && a < DEVSPEC_FLASH_START &&
+            (a < FWVERSIONFILE || a >= CONFIGHTM_ADDR + CONFIGHTM_LEN)) {
+            *(uint32_t *)(uintptr_t)a = rand();
+        }
+    }
+}
+
+static bool is_blank(uint32_t addr, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        if (((const uint8_t *)(uintptr_t)addr)[i] != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint8_t *image;
+static struct {
+    uint16_t bytesPerSector;
+    uint8_t sectorsPerCluster;
+    uint16_t reserved;
+    uint8_t fats;
+    uint16_t rootEntries;
+    uint32_t totalSectors;
+    uint16_t sectorsPerFat;
+    uint32_t dataStart;
+    uint32_t clusters;
+    uint32_t fatBits;
+} bpb;
+
+static uint16_t get16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+static uint32_t fat_entry(uint32_t c) {
+    const uint8_t *fat = image + bpb.reserved * 512;
+    if (bpb.fatBits == 16) {
+        return get16(fat + c * 2);
+    }
+    uint16_t v = get16(fat + c * 3 / 2);
+    return c & 1 ? v >> 4 : v & 0xfff;
+}
+
+static void check_boot_sector(void) {
+    const uint8_t *bs = image;
+
+    bpb.bytesPerSector = get16(bs + 11);
+    bpb.sectorsPerCluster = bs[13];
+    bpb.reserved = get16(bs + 14);
+    bpb.fats = bs[16];
+    bpb.rootEntries = get16(bs + 17);
+    bpb.totalSectors = get16(bs + 19) ? get16(bs + 19) : get32(bs + 32);
+    bpb.sectorsPerFat = get16(bs + 22);
+    bpb.dataStart = bpb.reserved + bpb.fats * bpb.sectorsPerFat + bpb.rootEntries * 32 / 512;
+    bpb.clusters = (bpb.totalSectors - bpb.dataStart) / bpb.sectorsPerCluster;
+    // the FAT type only depends on the number of clusters
+    bpb.fatBits = bpb.clusters < 4085 ? 12 : 16;
+
+    printf("%u sectors, %u sectors per cluster, %u FATs of %u sectors, %u clusters, FAT%u\n",
+           bpb.totalSectors, bpb.sectorsPerCluster, bpb.fats, bpb.sectorsPerFat,
+           bpb.clusters, bpb.fatBits);
+    CHECK(bs[510] == 0x55 && bs[511] == 0xaa, "boot signature");
+    CHECK(bpb.bytesPerSector == 512, "%u bytes per sector", bpb.bytesPerSector);
+    CHECK(bpb.totalSectors <= UF2_NUM_BLOCKS, "larger than the drive");
+    CHECK(bpb.clusters <= 65524, "too many clusters for FAT16");
+    CHECK(memcmp(bs + 54, bpb.fatBits == 12 ? "FAT12   " : "FAT16   ", 8) == 0,
+          "file system type %.8s for FAT%u", bs + 54, bpb.fatBits);
+    CHECK(bpb.sectorsPerFat * 512 * 8 / bpb.fatBits >= bpb.clusters + 2, "FAT too small");
+    for (unsigned i = 1; i < bpb.fats; i++) {
+        CHECK(memcmp(image + bpb.reserved * 512, image + (bpb.reserved + i * bpb.sectorsPerFat) * 512,
+                     bpb.sectorsPerFat * 512) == 0, "FAT copy %u differs", i);
+    }
+}
+
+/*
+ * Follow the cluster chain of a file, check it and gather its contents.
+ * Returns the contents, size bytes.
+ */
+static uint8_t *read_file(const char *name, uint32_t cluster, uint32_t size, const char **owner) {
+    uint32_t clusterSize = bpb.sectorsPerCluster * 512;
+    uint32_t eoc = bpb.fatBits == 12 ? 0xff8 : 0xfff8;
+    uint8_t *data = calloc(1, size + clusterSize);
+    uint32_t n = 0;
+
+    for (uint32_t c = cluster; size && c < eoc; c = fat_entry(c), n++) {
+        if (c < 2 || c >= bpb.clusters + 2) {
+            CHECK(false, "%s: cluster %u out of range", name, c);
+            break;
+        }
+        if (owner[c]) {
+            CHECK(false, "%s: cluster %u cross-linked with %s", name, c, owner[c]);
+            break;
+        }
+        owner[c] = name;
+        if (n * clusterSize < size) {
+            memcpy(data + n * clusterSize, image + (bpb.dataStart + (c - 2) * bpb.sectorsPerCluster) * 512,
+                   clusterSize);
+        }
+    }
+    CHECK(n == (size + clusterSize - 1) / clusterSize, "%s: %u clusters for %u bytes", name, n, size);
+    return data;
+}
+
+/*
+ * UF2 export of the flash region [addr, addr + len), with GHOSTFAT_SPARSE_UF2
+ * only the 256 byte blocks that aren't blank.
+ */
+static void check_uf2(const char *name, const uint8_t *data, uint32_t size, uint32_t addr, uint32_t len) {
+    uint32_t blocks = size / 512;
+    uint32_t expected = 0;
+    uint32_t prev = 0;
+
+    for (uint32_t a = addr; a < addr + len; a += 256) {
+#ifdef GHOSTFAT_SPARSE_UF2
+        expected += !is_blank(a, 256);
+#else
+        expected++;
+#endif
+    }
+    CHECK(size % 512 == 0 && blocks == expected, "%s: %u blocks, %u expected", name, blocks, expected);
+    for (uint32_t i = 0; i < blocks; i++) {
+        const UF2_Block *bl = (const UF2_Block *)(data + i * 512);
+        if (!is_uf2_block(bl) || bl->blockNo != i || bl->numBlocks != blocks || bl->payloadSize != 256 ||
+            bl->familyID != UF2_FAMILY || !(bl->flags & UF2_FLAG_FAMILYID_PRESENT)) {
+            CHECK(false, "%s: block %u header", name, i);
+            break;
+        }
+        if (bl->targetAddr < addr || bl->targetAddr >= addr + len || bl->targetAddr % 256 ||
+            (i && bl->targetAddr <= prev)) {
+            CHECK(false, "%s: block %u address %08x", name, i, bl->targetAddr);
+            break;
+        }
+        if (memcmp(bl->data, (const void *)(uintptr_t)bl->targetAddr, 256) != 0) {
+            CHECK(false, "%s: block %u payload differs from flash", name, i);
+            break;
+        }
+        prev = bl->targetAddr;
+    }
+}
+
+static void check_file(const char *name, const uint8_t *data, uint32_t size, bool bench) {
+    if (!strcmp(name, "INFO_FW.TXT")) {
+        CHECK(size == strlen(fwVersion) && !memcmp(data, fwVersion, size), "%s: contents", name);
+    } else if (!strcmp(name, "CURRENT.UF2")) {
+        check_uf2(name, data, size, BOARD_FLASH_BASE, BOARD_FLASH_SIZE);
+    } else if (!strcmp(name, "CONFIG.UF2")) {
+        check_uf2(name, data, size, CFGUF2_ADDRESS, 128 * 1024);
+    } else if (!strcmp(name, "CONFIG.HTM")) {
+        CHECK(size == CONFIGHTM_LEN && !memcmp(data, (const void *)CONFIGHTM_ADDR, size), "%s: contents", name);
+    } else if (!strcmp(name, "CURRENT.BIN")) {
+#ifdef GHOSTFAT_SPARSE_UF2
+        // up to the last flash that isn't blank, in whole sectors
+        CHECK(size % 512 == 0 && size <= USER_FLASH_END - APP_LOAD_ADDRESS, "%s: size %u", name, size);
+        CHECK(is_blank(APP_LOAD_ADDRESS + size, USER_FLASH_END - APP_LOAD_ADDRESS - size),
+              "%s: flash after the end isn't blank", name);
+        CHECK(size == 0 || !is_blank(APP_LOAD_ADDRESS + size - 512, 512), "%s: ends with a blank sector", name);
+#else
+        CHECK(size == USER_FLASH_END - APP_LOAD_ADDRESS, "%s: size %u", name, size);
+#endif
+        CHECK(!memcmp(data, (const void *)APP_LOAD_ADDRESS, size), "%s: contents", name);
+    } else if (!strcmp(name, "BENCH.BIN")) {
+        CHECK(bench && size == 4 * 1024 * 1024, "%s: size %u", name, size);
+        for (uint32_t i = 0; i < size; i += 4) {
+            if (get32(data + i) != i) {
+                CHECK(false, "%s: word at %u", name, i);
+                break;
+            }
+        }
+    } else if (!strcmp(name, "BENCH.TXT")) {
+        CHECK(bench, "%s outside benchmark mode", name);
+    }
+}
+
+static void check_files(const char *mode) {
+    const uint8_t *root = image + (bpb.reserved + bpb.fats * bpb.sectorsPerFat) * 512;
+    const char **owner = calloc(bpb.clusters + 2, sizeof(*owner));
+    static char names[16][13];
+    unsigned files = 0;
+    bool failsafe = !strcmp(mode, "failsafe");
+    bool bench = !strcmp(mode, "bench");
+
+    for (unsigned i = 0; i < bpb.rootEntries && root[i * 32] != 0; i++) {
+        const uint8_t *d = root + i * 32;
+        if (d[11] & 0x08) {
+            continue; // volume label
+        }
+        char *name = names[files++ % 16];
+        int n = 0;
+        for (unsigned j = 0; j < 8 && d[j] != ' '; j++) {
+            name[n++] = d[j];
+        }
+        name[n++] = '.';
+        for (unsigned j = 8; j < 11 && d[j] != ' '; j++) {
+            name[n++] = d[j];
+        }
+        name[n] = 0;
+
+        uint32_t cluster = get16(d + 26);
+        uint32_t size = get32(d + 28);
+        uint8_t *data = read_file(name, cluster, size, owner);
+        printf("  %-12s %8u bytes at cluster %5u\n", name, size, cluster);
+        check_file(name, data, size, bench);
+        free(data);
+    }
+
+    CHECK(files > 0 && !strcmp(names[0], "INFO_UF2.TXT"), "INFO_UF2.TXT isn't the first file");
+    CHECK(!failsafe || files == 1, "%u files in failsafe mode", files);
+    CHECK(failsafe || files >= 7 + 2 * (unsigned)bench, "%u files", files);
+
+    uint32_t freeClusters = 0;
+    for (uint32_t c = 2; c < bpb.clusters + 2; c++) {
+        if (fat_entry(c) == 0) {
+            freeClusters++;
+        } else if (!owner[c]) {
+            CHECK(false, "lost cluster %u", c);
+            break;
+        }
+    }
+    printf("  %u clusters free, %u bytes\n", freeClusters, freeClusters * bpb.sectorsPerCluster * 512);
+    free(owner);
+}
+
+static void check_mapped(void) {
+    static uint8_t block[512];
+    uint32_t mapped = 0;
+
+    for (uint32_t b = 0; b < UF2_NUM_BLOCKS; b++) {
+        uint32_t n = 16;
+        const uint8_t *p = ghostfat_map_blocks(b, &n);
+        if (!p) {
+            continue;
+        }
+        CHECK(n > 0 && n <= 16, "block %u: %u blocks mapped", b, n);
+        for (uint32_t k = 0; k < n; k++) {
+            read_block(b + k, block);
+            CHECK(!memcmp(block, p + k * 512, 512), "block %u: mapped block %u differs", b, k);
+        }
+        mapped++;
+    }
+    printf("  %u blocks mapped\n", mapped);
+}
+
+static void read_image(void) {
+    for (uint32_t b = 0; b < UF2_NUM_BLOCKS; b++) {
+        read_block(b, image + b * 512);
+    }
+}
+
+/*
+ * Without an update an eject is no commit, nothing may be reset.
+ */
+static void check_eject(void) {
+    int timers = host_timers_set;
+
+    CHECK(ghostfat_eject(), "eject refused");
+    CHECK(host_timers_set == timers, "eject without an update armed a timer");
+}
+
+/*
+ * Flash written past the end of CURRENT.BIN, the files are laid out again as
+ * on a remount and have to include it. With GHOSTFAT_SPARSE_UF2 the files
+ * grow.
+ */
+/*
+ * A one block update, the block is sent like the host writes it.
+ */
+static void write_update(uint32_t addr) {
+    static UF2_Block bl;
+
+    bl.magicStart0 = UF2_MAGIC_START0;
+    bl.magicStart1 = UF2_MAGIC_START1;
+    bl.flags = UF2_FLAG_FAMILYID_PRESENT;
+    bl.targetAddr = addr;
+    bl.payloadSize = 256;
+    bl.numBlocks = 1;
+    bl.familyID = UF2_FAMILY;
+    bl.magicEnd = UF2_MAGIC_END;
+    memcpy(bl.data, (const void *)(uintptr_t)addr, 256);
+    write_block(0, (const uint8_t *)&bl);
+}
+
+/*
+ * A block the flash refuses fails the update, the eject is refused so the
+ * host gets to read STATUS.TXT. Blocks outside the user flash are skipped.
+ */
+static void check_write_error(void) {
+    flash_write_fails = true;
+    write_update(APP_LOAD_ADDRESS);
+    flash_write_fails = false;
+    CHECK(!ghostfat_eject(), "update with a write error didn't fail");
+
+    write_update(BOARD_FLASH_BASE);
+    CHECK(ghostfat_eject(), "update of the bootloader's flash failed");
+}
+
+static void check_relayout(const char *mode) {
+    static uint8_t page[256];
+    uint32_t addr = DEVSPEC_FLASH_START - sizeof(page);
+
+    CHECK(is_blank(addr, sizeof(page)), "flash at %x isn't blank", addr);
+    memset(page, 0x5a, sizeof(page));
+    CHECK(write_payload(addr, page, sizeof(page)) == HAL_SUCCESS, "write at %x refused", addr);
+    ghostfat_init();
+
+    printf("%s, after a write: ", mode);
+    read_image();
+    check_boot_sector();
+    check_files(mode);
+}
+
+int main(int argc, char **argv) {
+    const char *mode = argc > 1 ? argv[1] : "normal";
+
+    if (!strcmp(mode, "failsafe") || !strcmp(mode, "bench")) {
+        host_buttons[PORTAB_FAILSAFE_BUTTON] = true;
+    }
+    if (!strcmp(mode, "bench")) {
+        host_buttons[PORTAB_BOOTLOADER_BUTTON] = true;
+    }
+    host_flash_map(PROT_READ | PROT_WRITE);
+    fill_flash();
+    ghostfat_init();
+
+    printf("%s: ", mode);
+    image = malloc((size_t)UF2_NUM_BLOCKS * 512);
+    read_image();
+    check_boot_sector();
+    check_files(mode);
+    check_mapped();
+    check_eject();
+    if (!strcmp(mode, "normal")) {
+        check_write_error();
+        check_relayout(mode);
+    }
+
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
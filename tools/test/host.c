@@ -0,0 +1,115 @@
+/*
+ * Kernel and board stand-ins shared by the host tests. Nothing runs
+ * concurrently on the host, so locks are no-ops and time stands still.
+ * The parts of the kernel a test doesn't simulate abort when called.
+ */
+#define _GNU_SOURCE
+#include "host.h"
+#include "chprintf.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+FLASH_TypeDef host_flash_regs;
+USBDriver USBD1;
+BaseSequentialStream *GlobalDebugChannel;
+bool host_buttons[8];
+
+static void unsupported(const char *what) {
+	fprintf(stderr, "%s is not simulated on the host\n", what);
+	abort();
+}
+
+void host_flash_map(int prot) {
+	void *p = mmap((void *)FLASH_BASE, FLASH_SIZE, PROT_READ | PROT_WRITE,
+		MAP_FIXED_NOREPLACE | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != (void *)FLASH_BASE) {
+		perror("mmap flash");
+		exit(2);
+	}
+	memset(p, 0xff, FLASH_SIZE);
+	mprotect(p, FLASH_SIZE, prot);
+}
+
+void chSysLock(void) {}
+void chSysUnlock(void) {}
+void chSysLockFromISR(void) {}
+void chSysUnlockFromISR(void) {}
+void chSchRescheduleS(void) {}
+rtcnt_t chSysGetRealtimeCounterX(void) { return 0; }
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg) {
+	(void)wsp; (void)size; (void)prio; (void)pf; (void)arg;
+	return NULL;
+}
+thread_t *chThdGetSelfX(void) { return NULL; }
+void chThdSleepMilliseconds(uint32_t ms) { (void)ms; }
+void chThdYield(void) {}
+void chRegSetThreadName(const char *name) { (void)name; }
+
+systime_t chVTGetSystemTimeX(void) { return 0; }
+sysinterval_t chTimeDiffX(systime_t start, systime_t end) { return end - start; }
+void chVTObjectInit(virtual_timer_t *vtp) { (void)vtp; }
+int host_timers_set;
+void chVTSetI(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc, void *par) {
+	(void)vtp; (void)delay; (void)vtfunc; (void)par;
+	host_timers_set++;
+}
+void chVTResetI(virtual_timer_t *vtp) { (void)vtp; }
+
+void chMtxObjectInit(mutex_t *mp) { (void)mp; }
+void chMtxLock(mutex_t *mp) { (void)mp; }
+void chMtxUnlock(mutex_t *mp) { (void)mp; }
+
+msg_t chSemWait(semaphore_t *sp) { (void)sp; unsupported("chSemWait"); return MSG_RESET; }
+void chSemSignalI(semaphore_t *sp) { (void)sp; }
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken) { bsp->cnt = taken ? 0 : 1; }
+msg_t chBSemWaitTimeoutS(binary_semaphore_t *bsp, sysinterval_t timeout) {
+	(void)bsp; (void)timeout;
+	unsupported("chBSemWaitTimeoutS");
+	return MSG_RESET;
+}
+void chBSemSignalI(binary_semaphore_t *bsp) { bsp->cnt = 1; }
+
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, size_t n) { (void)mbp; (void)buf; (void)n; }
+msg_t chMBPostTimeout(mailbox_t *mbp, msg_t msg, sysinterval_t timeout) {
+	(void)mbp; (void)msg; (void)timeout;
+	unsupported("chMBPostTimeout");
+	return MSG_RESET;
+}
+msg_t chMBFetchTimeout(mailbox_t *mbp, msg_t *msgp, sysinterval_t timeout) {
+	(void)mbp; (void)msgp; (void)timeout;
+	unsupported("chMBFetchTimeout");
+	return MSG_RESET;
+}
+
+void chPoolLoadArray(memory_pool_t *mp, void *p, size_t n) { (void)mp; (void)p; (void)n; }
+void *chPoolAlloc(memory_pool_t *mp) { (void)mp; unsupported("chPoolAlloc"); return NULL; }
+void chPoolFree(memory_pool_t *mp, void *objp) { (void)mp; (void)objp; }
+
+void chEvtSignalI(thread_t *tp, eventmask_t events) { (void)tp; (void)events; }
+
+void nvicEnableVector(uint32_t n, uint32_t prio) { (void)n; (void)prio; }
+void NVIC_SystemReset(void) { unsupported("NVIC_SystemReset"); }
+
+void palSetLine(ioline_t line) { (void)line; }
+void palClearLine(ioline_t line) { (void)line; }
+int palReadLine(ioline_t line) { return !host_buttons[line]; }
+
+void usbConnectBus(USBDriver *usbp) { (void)usbp; }
+void usbDisconnectBus(USBDriver *usbp) { (void)usbp; }
+
+int chprintf(BaseSequentialStream *chp, const char *fmt, ...) {
+	(void)chp; (void)fmt;
+	return 0;
+}
+
+int chsnprintf(char *str, size_t size, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(str, size, fmt, ap);
+	va_end(ap);
+	return n;
+}
@@ -0,0 +1,24 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include "hal.h"
+
+/* the buttons of the board, by line, true while pressed */
+extern bool host_buttons[8];
+
+/* map blank flash at its device address with the given protection */
+void host_flash_map(int prot);
+
+/* number of virtual timers started, the timers never expire */
+extern int host_timers_set;
+
+#define CHECK(cond, ...) do {                                                 \
+    if (!(cond)) {                                                            \
+        fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond);            \
+        fprintf(stderr, __VA_ARGS__);                                         \
+        fprintf(stderr, "\n");                                                \
+        failures++;                                                           \
+    }                                                                         \
+} while (0)
+
+#endif /* HOST_H */
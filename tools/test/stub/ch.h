@@ -0,0 +1,99 @@
+/*
+ * Host stand-in for the ChibiOS/RT API used by the bootloader sources, just
+ * enough to compile them for the host tests. Time is counted in 0.1 ms
+ * ticks like CH_CFG_ST_FREQUENCY 10000 of the boards.
+ */
+#ifndef CH_H
+#define CH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef int32_t msg_t;
+typedef uint32_t systime_t;
+typedef uint32_t sysinterval_t;
+typedef uint32_t time_msecs_t;
+typedef uint32_t eventmask_t;
+typedef uint32_t tprio_t;
+typedef int32_t cnt_t;
+typedef uint32_t rtcnt_t;
+typedef struct thread thread_t;
+typedef void (*vtfunc_t)(void *p);
+typedef void (*tfunc_t)(void *p);
+
+typedef struct { int dummy; } mutex_t;
+typedef struct { cnt_t cnt; } semaphore_t;
+typedef struct { cnt_t cnt; } binary_semaphore_t;
+typedef struct { int dummy; } virtual_timer_t;
+typedef struct { int dummy; } mailbox_t;
+typedef struct { void *next; size_t size; } memory_pool_t;
+
+#define MSG_OK                  0
+#define MSG_TIMEOUT             -1
+#define MSG_RESET               -2
+
+#define TIME_INFINITE           ((sysinterval_t)-1)
+#define TIME_IMMEDIATE          ((sysinterval_t)0)
+
+#define LOWPRIO                 1
+#define NORMALPRIO              128
+#define HIGHPRIO                255
+#define PORT_NATURAL_ALIGN      8
+#define CH_CFG_ST_FREQUENCY     10000
+
+#define THD_WORKING_AREA(s, n)  uint64_t s[(n) / 8]
+#define THD_FUNCTION(tname, arg) void tname(void *arg)
+#define MUTEX_DECL(name)        mutex_t name = {0}
+#define SEMAPHORE_DECL(name, n) semaphore_t name = {n}
+#define BSEMAPHORE_DECL(name, taken) binary_semaphore_t name = {(taken) ? 0 : 1}
+#define MEMORYPOOL_DECL(name, size, align, provider) memory_pool_t name = {NULL, size}
+
+#define TIME_MS2I(ms)           ((sysinterval_t)(ms) * 10)
+#define TIME_US2I(us)           ((sysinterval_t)(us) / 100)
+#define TIME_I2MS(i)            ((time_msecs_t)(i) / 10)
+#define TIME_I2US(i)            ((uint32_t)(i) * 100)
+#define RTC2US(freq, n)         ((((n) - 1UL) / ((freq) / 1000000UL)) + 1UL)
+#define EVENT_MASK(eid)         ((eventmask_t)1 << (eventmask_t)(eid))
+#define ALL_EVENTS              ((eventmask_t)-1)
+
+void chSysLock(void);
+void chSysUnlock(void);
+void chSysLockFromISR(void);
+void chSysUnlockFromISR(void);
+void chSchRescheduleS(void);
+rtcnt_t chSysGetRealtimeCounterX(void);
+
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg);
+thread_t *chThdGetSelfX(void);
+void chThdSleepMilliseconds(uint32_t ms);
+void chThdYield(void);
+void chRegSetThreadName(const char *name);
+
+systime_t chVTGetSystemTimeX(void);
+sysinterval_t chTimeDiffX(systime_t start, systime_t end);
+void chVTObjectInit(virtual_timer_t *vtp);
+void chVTSetI(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc, void *par);
+void chVTResetI(virtual_timer_t *vtp);
+
+void chMtxObjectInit(mutex_t *mp);
+void chMtxLock(mutex_t *mp);
+void chMtxUnlock(mutex_t *mp);
+
+msg_t chSemWait(semaphore_t *sp);
+void chSemSignalI(semaphore_t *sp);
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken);
+msg_t chBSemWaitTimeoutS(binary_semaphore_t *bsp, sysinterval_t timeout);
+void chBSemSignalI(binary_semaphore_t *bsp);
+
+void chMBObjectInit(mailbox_t *mbp, msg_t *buf, size_t n);
+msg_t chMBPostTimeout(mailbox_t *mbp, msg_t msg, sysinterval_t timeout);
+msg_t chMBFetchTimeout(mailbox_t *mbp, msg_t *msgp, sysinterval_t timeout);
+
+void chPoolLoadArray(memory_pool_t *mp, void *p, size_t n);
+void *chPoolAlloc(memory_pool_t *mp);
+void chPoolFree(memory_pool_t *mp, void *objp);
+
+void chEvtSignalI(thread_t *tp, eventmask_t events);
+
+#endif /* CH_H */
@@ -0,0 +1,10 @@
+/* Host stand-in for the ChibiOS chprintf.h */
+#ifndef CHPRINTF_H
+#define CHPRINTF_H
+
+#include "hal.h"
+
+int chprintf(BaseSequentialStream *chp, const char *fmt, ...);
+int chsnprintf(char *str, size_t size, const char *fmt, ...);
+
+#endif /* CHPRINTF_H */
@@ -0,0 +1,182 @@
+/*
+ * Host stand-in for the ChibiOS HAL and the STM32H7 device header, just
+ * enough to compile the bootloader sources for the host tests. FLASH is a
+ * register block in RAM that the test drives.
+ */
+#ifndef HAL_H
+#define HAL_H
+
+#include "ch.h"
+
+#define TRUE                    1
+#define FALSE                   0
+#define HAL_SUCCESS             false
+#define HAL_FAILED              true
+#define HAL_USE_USB             TRUE
+#define USB_USE_WAIT            TRUE
+
+#define __IO                    volatile
+#define __I                     volatile const
+
+#define OSAL_IRQ_HANDLER(id)    void id(void)
+#define OSAL_IRQ_PROLOGUE()
+#define OSAL_IRQ_EPILOGUE()
+#define osalSysLockFromISR      chSysLockFromISR
+#define osalSysUnlockFromISR    chSysUnlockFromISR
+
+#define STM32_SYS_CK            400000000
+#define BOARD_NAME              "Host"
+#define UID_BASE                0x1FF1E800UL
+
+static inline void __ISB(void) {}
+static inline void __DSB(void) {}
+static inline void __DMB(void) {}
+#define cacheBufferInvalidate(saddr, size)  ((void)(saddr), (void)(size))
+#define cacheBufferFlush(saddr, size)       ((void)(saddr), (void)(size))
+
+typedef enum { FLASH_IRQn = 4 } IRQn_Type;
+void nvicEnableVector(uint32_t n, uint32_t prio);
+void NVIC_SystemReset(void);
+
+typedef uint32_t ioline_t;
+#define LINE_LED_R              1
+#define LINE_LED_UP             2
+#define LINE_LED_B              3
+#define LINE_LED_G              4
+#define LINE_BUTTON_ALT         5
+#define LINE_BUTTON_PORT        6
+void palSetLine(ioline_t line);
+void palClearLine(ioline_t line);
+int palReadLine(ioline_t line);
+
+typedef struct BaseSequentialStream BaseSequentialStream;
+
+/* flash controller */
+#define FLASH_BASE              0x08000000UL
+#define FLASH_BANK1_BASE        0x08000000UL
+#define FLASH_BANK2_BASE        0x08100000UL
+#define FLASH_END               0x081FFFFFUL
+#define FLASH_SIZE              0x00200000UL
+#define FLASH_SECTOR_SIZE       0x00020000UL
+#define FLASH_SECTOR_TOTAL      8
+#define FLASH_NB_32BITWORD_IN_FLASHWORD 8U
+#define DUAL_BANK
+
+typedef struct {
+  volatile uint32_t ACR, KEYR1, OPTKEYR, CR1, SR1, CCR1, OPTCR, OPTSR_CUR, OPTSR_PRG, OPTCCR,
+    PRAR_CUR1, PRAR_PRG1, SCAR_CUR1, SCAR_PRG1, WPSN_CUR1, WPSN_PRG1, BOOT_CUR, BOOT_PRG,
+    CRCCR1, CRCSADD1, CRCEADD1, CRCDATA, ECC_FA1, KEYR2, CR2, SR2, CCR2, PRAR_CUR2, PRAR_PRG2,
+    SCAR_CUR2, SCAR_PRG2, WPSN_CUR2, WPSN_PRG2, CRCCR2, CRCSADD2, CRCEADD2, ECC_FA2;
+} FLASH_TypeDef;
+extern FLASH_TypeDef host_flash_regs;
+#define FLASH                   (&host_flash_regs)
+
+#define FLASH_CR_LOCK           (1u << 0)
+#define FLASH_CR_PG             (1u << 1)
+#define FLASH_CR_SER            (1u << 2)
+#define FLASH_CR_BER            (1u << 3)
+#define FLASH_CR_PSIZE          (3u << 4)
+#define FLASH_CR_PSIZE_0        (1u << 4)
+#define FLASH_CR_PSIZE_1        (2u << 4)
+#define FLASH_CR_FW             (1u << 6)
+#define FLASH_CR_START          (1u << 7)
+#define FLASH_CR_SNB            (7u << 8)
+#define FLASH_CR_SNB_Pos        8
+#define FLASH_CR_CRC_EN         (1u << 15)
+#define FLASH_CR_EOPIE          (1u << 16)
+#define FLASH_CR_WRPERRIE       (1u << 17)
+#define FLASH_CR_PGSERRIE       (1u << 18)
+#define FLASH_CR_STRBERRIE      (1u << 19)
+#define FLASH_CR_INCERRIE       (1u << 21)
+#define FLASH_CR_OPERRIE        (1u << 22)
+#define FLASH_CR_RDPERRIE       (1u << 23)
+#define FLASH_CR_RDSERRIE       (1u << 24)
+#define FLASH_CR_SNECCERRIE     (1u << 25)
+#define FLASH_CR_DBECCERRIE     (1u << 26)
+#define FLASH_CR_CRCENDIE       (1u << 27)
+#define FLASH_CR_CRCRDERRIE     (1u << 28)
+#define FLASH_SR_BSY            (1u << 0)
+#define FLASH_SR_WBNE           (1u << 1)
+#define FLASH_SR_QW             (1u << 2)
+#define FLASH_SR_CRC_BUSY       (1u << 3)
+#define FLASH_SR_EOP            (1u << 16)
+#define FLASH_SR_WRPERR         (1u << 17)
+#define FLASH_SR_PGSERR         (1u << 18)
+#define FLASH_SR_STRBERR        (1u << 19)
+#define FLASH_SR_INCERR         (1u << 21)
+#define FLASH_SR_OPERR          (1u << 22)
+#define FLASH_SR_RDPERR         (1u << 23)
+#define FLASH_SR_RDSERR         (1u << 24)
+#define FLASH_SR_SNECCERR       (1u << 25)
+#define FLASH_SR_DBECCERR       (1u << 26)
+#define FLASH_SR_CRCEND         (1u << 27)
+#define FLASH_SR_CRCRDERR       (1u << 28)
+#define FLASH_CCR_CLR_EOP       FLASH_SR_EOP
+#define FLASH_CCR_CLR_WRPERR    FLASH_SR_WRPERR
+#define FLASH_CCR_CLR_PGSERR    FLASH_SR_PGSERR
+#define FLASH_CCR_CLR_STRBERR   FLASH_SR_STRBERR
+#define FLASH_CCR_CLR_INCERR    FLASH_SR_INCERR
+#define FLASH_CCR_CLR_OPERR     FLASH_SR_OPERR
+#define FLASH_CCR_CLR_RDPERR    FLASH_SR_RDPERR
+#define FLASH_CCR_CLR_RDSERR    FLASH_SR_RDSERR
+#define FLASH_CCR_CLR_SNECCERR  FLASH_SR_SNECCERR
+#define FLASH_CCR_CLR_DBECCERR  FLASH_SR_DBECCERR
+#define FLASH_CCR_CLR_CRCEND    FLASH_SR_CRCEND
+#define FLASH_CCR_CLR_CRCRDERR  FLASH_SR_CRCRDERR
+#define FLASH_CRCCR_CRC_SECT    (7u << 0)
+#define FLASH_CRCCR_CRC_SECT_Pos 0
+#define FLASH_CRCCR_ALL_BANK    (1u << 7)
+#define FLASH_CRCCR_CRC_BY_SECT (1u << 8)
+#define FLASH_CRCCR_ADD_SECT    (1u << 9)
+#define FLASH_CRCCR_CLEAN_SECT  (1u << 10)
+#define FLASH_CRCCR_START_CRC   (1u << 16)
+#define FLASH_CRCCR_CLEAN_CRC   (1u << 17)
+#define FLASH_CRCCR_CRC_BURST   (3u << 20)
+#define FLASH_CRCCR_CRC_BURST_0 (1u << 20)
+#define FLASH_CRCCR_CRC_BURST_1 (2u << 20)
+#define FLASH_KEY1              0x45670123U
+#define FLASH_KEY2              0xCDEF89ABU
+#define FLASH_OPTSR_OPT_BUSY    (1u << 0)
+
+#define SET_BIT(REG, BIT)       ((REG) |= (BIT))
+#define CLEAR_BIT(REG, BIT)     ((REG) &= ~(BIT))
+#define READ_BIT(REG, BIT)      ((REG) & (BIT))
+#define WRITE_REG(REG, VAL)     ((REG) = (VAL))
+#define READ_REG(REG)           ((REG))
+#define MODIFY_REG(REG, CLEARMASK, SETMASK) \
+  WRITE_REG((REG), (((READ_REG(REG)) & (~(CLEARMASK))) | (SETMASK)))
+#define RESET                   0
+
+/* block device */
+typedef enum {
+  BLK_UNINIT = 0, BLK_STOP, BLK_ACTIVE, BLK_CONNECTING, BLK_DISCONNECTING,
+  BLK_READY, BLK_READING, BLK_WRITING, BLK_SYNCING
+} blkstate_t;
+typedef struct {
+  uint32_t blk_size;
+  uint32_t blk_num;
+} BlockDeviceInfo;
+typedef struct BaseBlockDevice BaseBlockDevice;
+
+/* USB */
+typedef enum {
+  USB_UNINIT = 0, USB_STOP, USB_READY, USB_SELECTED, USB_ACTIVE, USB_SUSPENDED
+} usbstate_t;
+typedef uint8_t usbep_t;
+typedef struct {
+  uint16_t in_maxsize;
+  uint16_t out_maxsize;
+} USBEndpointConfig;
+typedef struct {
+  usbstate_t state;
+  const USBEndpointConfig *epc[8];
+} USBDriver;
+extern USBDriver USBD1;
+void usbConnectBus(USBDriver *usbp);
+void usbDisconnectBus(USBDriver *usbp);
+msg_t usbReceive(USBDriver *usbp, usbep_t ep, uint8_t *buf, size_t n);
+msg_t usbTransmit(USBDriver *usbp, usbep_t ep, const uint8_t *buf, size_t n);
+
+#define osalDbgCheck(c)         ((void)(c))
+
+#endif /* HAL_H */
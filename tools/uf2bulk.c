@@ -0,0 +1,1142 @@
+/*
+ * Host tool for the raw bulk flashing interface of the bootloader, see
+ * bulkproto.h for the protocol.
+ *
+ * "uf2bulk flashall FILE" flashes every connected bootloader at once, one
+ * thread per device, each keeping several commands in flight with
+ * asynchronous transfers.
+ *
+ * With -s the commands run against simulated devices in this process
+ * instead of bootloaders on USB, "uf2bulk -s selftest" exercises the
+ * protocol against them.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#include "../bulkproto.h"
+
+#define DEFAULT_VID         0xF055
+#define DEFAULT_PID         0x5720
+
+#define PACKET_SIZE         64
+#define TIMEOUT_MS          30000
+// commands in flight per device
+#define PIPE_DEPTH          4
+#define MAX_DEVICES         64
+
+#define UF2_MAGIC_START0    0x0A324655UL
+#define UF2_MAGIC_START1    0x9E5D5157UL
+#define UF2_MAGIC_END       0x0AB16F30UL
+#define UF2_FLAG_NOFLASH    0x00000001
+#define UF2_FLAG_FAMILYID   0x00002000
+
+/*
+ * Simulated device: a flash of SIM_SECTORS sectors of which the first is
+ * the bootloader, behaving like bulk.c on top of flash.c.
+ */
+#define SIM_FLASH_BASE      0x08000000
+#define SIM_SECTOR_SIZE     (128 * 1024)
+#define SIM_SECTORS         16
+#define SIM_FLASH_SIZE      (SIM_SECTORS * SIM_SECTOR_SIZE)
+#define SIM_USER_START      (SIM_FLASH_BASE + SIM_SECTOR_SIZE)
+#define SIM_FAMILY          0x6db66082
+
+typedef struct {
+    uint8_t flash[SIM_FLASH_SIZE];
+    // command transfer being received, ended by a short packet
+    uint8_t rx[BULK_MAX_TRANSFER];
+    uint32_t rx_len;
+    bool rx_overflow;
+    // response transfer, read out in packets
+    uint8_t tx[BULK_MAX_TRANSFER];
+    uint32_t tx_len;
+    uint32_t tx_pos;
+    bool tx_pending;
+    bool reset;
+} sim_t;
+
+/* a command in flight */
+typedef struct {
+    uint8_t cmd;
+    uint8_t tag;
+    uint32_t addr;
+    struct libusb_transfer *out;
+    struct libusb_transfer *in;
+    int out_done;               // set by the transfer callbacks
+    int in_done;
+    int in_len;
+    uint8_t out_buf[BULK_MAX_TRANSFER];
+    uint8_t in_buf[BULK_MAX_TRANSFER];
+} slot_t;
+
+typedef struct {
+    libusb_device_handle *handle;
+    int iface;
+    uint8_t ep_in;
+    uint8_t ep_out;
+    sim_t *sim;
+    char serial[40];
+    uint8_t tag;
+    bulk_info_t info;
+    // commands in flight, oldest first
+    slot_t slots[PIPE_DEPTH];
+    unsigned head;
+    unsigned count;
+    // flash_image() results
+    double t_write;
+    double t_sync;
+    double t_verify;
+    int result;
+} bulk_dev_t;
+
+/* payloads to write and the ranges they cover */
+typedef struct {
+    uint32_t addr;
+    uint32_t len;
+    const uint8_t *data;
+} payload_t;
+
+typedef struct {
+    uint32_t addr;
+    uint32_t len;
+    uint32_t crc;
+} run_t;
+
+typedef struct {
+    payload_t *payloads;
+    unsigned n_payloads;
+    run_t *runs;
+    unsigned n_runs;
+    uint32_t bytes;
+    uint8_t *buf;               // padded copy of a binary image
+} image_t;
+
+static libusb_context *usb_ctx;
+static bool verbose;
+
+static void sim_command(sim_t *s, const uint8_t *buf, uint32_t n) {
+    const bulk_cmd_t *cmd = (const bulk_cmd_t *)buf;
+    bulk_rsp_t *rsp = (bulk_rsp_t *)s->tx;
+    uint8_t *out = s->tx + sizeof(*rsp);
+    uint32_t len = 0;
+
+    memset(rsp, 0, sizeof(*rsp));
+    if (n < sizeof(*cmd) || cmd->len > BULK_MAX_PAYLOAD || n != sizeof(*cmd) + cmd->len) {
+        rsp->status = BULK_ERR_CMD;
+        goto send;
+    }
+    rsp->cmd = cmd->cmd;
+    rsp->tag = cmd->tag;
+
+    uint32_t addr = cmd->addr;
+    uint32_t size = cmd->size;
+    uint32_t user_size = SIM_FLASH_BASE + SIM_FLASH_SIZE - SIM_USER_START;
+    bool in_flash = addr >= SIM_FLASH_BASE && size <= SIM_FLASH_SIZE &&
+                    addr - SIM_FLASH_BASE <= SIM_FLASH_SIZE - size;
+
+    switch (cmd->cmd) {
+    case BULK_CMD_INFO: {
+        bulk_info_t info;
+        memset(&info, 0, sizeof(info));
+        info.version = BULK_PROTO_VERSION;
+        info.flash_start = SIM_USER_START;
+        info.flash_end = SIM_FLASH_BASE + SIM_FLASH_SIZE;
+        info.max_payload = BULK_MAX_PAYLOAD;
+        info.family = SIM_FAMILY;
+        strcpy(info.board, "Simulated device");
+        memcpy(out, &info, sizeof(info));
+        len = sizeof(info);
+        break;
+    }
+    case BULK_CMD_WRITE:
+        if (cmd->len == 0 || cmd->len % 4 || addr % 4 || addr < SIM_USER_START ||
+            cmd->len > user_size || addr - SIM_USER_START > user_size - cmd->len) {
+            rsp->status = BULK_ERR_ARG;
+            break;
+        }
+        memcpy(s->flash + addr - SIM_FLASH_BASE, buf + sizeof(*cmd), cmd->len);
+        break;
+    case BULK_CMD_ERASE:
+        if (addr < SIM_USER_START || size == 0 || size > user_size ||
+            addr - SIM_USER_START > user_size - size ||
+            (addr - SIM_FLASH_BASE) % SIM_SECTOR_SIZE || size % SIM_SECTOR_SIZE) {
+            rsp->status = BULK_ERR_ARG;
+            break;
+        }
+        memset(s->flash + addr - SIM_FLASH_BASE, 0xff, size);
+        break;
+    case BULK_CMD_READ:
+        if (size > BULK_MAX_PAYLOAD || !in_flash) {
+            rsp->status = BULK_ERR_ARG;
+            break;
+        }
+        memcpy(out, s->flash + addr - SIM_FLASH_BASE, size);
+        len = size;
+        break;
+    case BULK_CMD_CRC:
+        if (addr % 4 || size % 4 || !in_flash) {
+            rsp->status = BULK_ERR_ARG;
+            break;
+        }
+        rsp->value = bulk_crc32(0, s->flash + addr - SIM_FLASH_BASE, size);
+        break;
+    case BULK_CMD_SYNC:
+        break;
+    case BULK_CMD_RESET:
+        s->reset = true;
+        break;
+    default:
+        rsp->status = BULK_ERR_CMD;
+        break;
+    }
+
+send:
+    rsp->len = len;
+    s->tx_len = sizeof(*rsp) + len;
+    s->tx_pos = 0;
+    s->tx_pending = true;
+}
+
+/* a packet from the host on the OUT endpoint */
+static void sim_out_packet(sim_t *s, const uint8_t *p, uint32_t n) {
+    if (s->rx_len + n > sizeof(s->rx)) {
+        s->rx_overflow = true;
+    } else if (n > 0) {
+        memcpy(s->rx + s->rx_len, p, n);
+    }
+    s->rx_len += n;
+    if (n < PACKET_SIZE) {
+        // short packet or zero length packet ends the transfer
+        sim_command(s, s->rx, s->rx_overflow ? 0 : s->rx_len);
+        s->rx_len = 0;
+        s->rx_overflow = false;
+    }
+}
+
+/* a packet to the host on the IN endpoint, -1 if there's none */
+static int sim_in_packet(sim_t *s, uint8_t *p) {
+    if (!s->tx_pending) {
+        return -1;
+    }
+    uint32_t n = s->tx_len - s->tx_pos;
+    if (n > PACKET_SIZE) {
+        n = PACKET_SIZE;
+    }
+    memcpy(p, s->tx + s->tx_pos, n);
+    s->tx_pos += n;
+    // a full last packet is followed by a zero length packet
+    if (n < PACKET_SIZE) {
+        s->tx_pending = false;
+    }
+    return n;
+}
+
+/*
+ * Send a transfer, ended with a zero length packet when it's a multiple of
+ * the packet size. Only for the simulated device, USB goes through the
+ * pipeline.
+ */
+static void sim_out(sim_t *s, const uint8_t *buf, uint32_t n) {
+    uint32_t i = 0;
+    do {
+        uint32_t len = n - i < PACKET_SIZE ? n - i : PACKET_SIZE;
+        sim_out_packet(s, buf + i, len);
+        i += len;
+        if (len == PACKET_SIZE && i == n) {
+            sim_out_packet(s, NULL, 0);
+        }
+    } while (i < n);
+}
+
+/* receive a transfer, returns its length */
+static int sim_in(sim_t *s, uint8_t *buf, uint32_t size) {
+    uint32_t n = 0;
+    uint8_t p[PACKET_SIZE];
+    int len;
+    while ((len = sim_in_packet(s, p)) >= 0) {
+        if (n + len > size) {
+            return -1;
+        }
+        memcpy(buf + n, p, len);
+        n += len;
+        if (len < PACKET_SIZE) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *t) {
+    __atomic_store_n((int *)t->user_data, 1, __ATOMIC_RELEASE);
+}
+
+static bool slot_done(slot_t *s) {
+    return __atomic_load_n(&s->out_done, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&s->in_done, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Wait for the oldest command in flight, out receives the data of the
+ * response. Returns the status, -1 on transfer errors.
+ */
+static int pipe_complete(bulk_dev_t *d, void *out, uint32_t *out_len, uint32_t *value) {
+    slot_t *s = &d->slots[d->head];
+    bulk_rsp_t *r = (bulk_rsp_t *)s->in_buf;
+
+    if (!d->sim) {
+        // callbacks run in whichever thread handles the events
+        while (!slot_done(s)) {
+            struct timeval tv = {0, 100000};
+            libusb_handle_events_timeout_completed(usb_ctx, &tv, NULL);
+        }
+        if (s->out->status != LIBUSB_TRANSFER_COMPLETED ||
+            s->in->status != LIBUSB_TRANSFER_COMPLETED) {
+            s->in_len = -1;
+        } else {
+            s->in_len = s->in->actual_length;
+        }
+    }
+    d->head = (d->head + 1) % PIPE_DEPTH;
+    d->count--;
+
+    if (s->in_len < 0) {
+        fprintf(stderr, "%s: transfer failed\n", d->serial);
+        return -1;
+    }
+    if (s->in_len < (int)sizeof(*r) || s->in_len != (int)(sizeof(*r) + r->len)) {
+        fprintf(stderr, "%s: malformed response\n", d->serial);
+        return -1;
+    }
+    if (r->cmd != s->cmd || r->tag != s->tag) {
+        fprintf(stderr, "%s: response out of sequence\n", d->serial);
+        return -1;
+    }
+    if (verbose) {
+        fprintf(stderr, "%s: cmd %u addr %08x: status %u value %08x len %u\n",
+                d->serial, s->cmd, s->addr, r->status, r->value, r->len);
+    }
+    if (out) {
+        uint32_t l = r->len < *out_len ? r->len : *out_len;
+        memcpy(out, s->in_buf + sizeof(*r), l);
+        *out_len = l;
+    }
+    if (value) {
+        *value = r->value;
+    }
+    return r->status;
+}
+
+/* wait for all commands in flight, returns the first error */
+static int pipe_drain(bulk_dev_t *d) {
+    int status = BULK_OK;
+    while (d->count > 0) {
+        int r = pipe_complete(d, NULL, NULL, NULL);
+        if (status == BULK_OK) {
+            status = r;
+        }
+    }
+    return status;
+}
+
+/*
+ * Start a command without waiting for its response. With the pipeline
+ * full, waits for the oldest command first and returns its status when it
+ * failed, without starting the new one.
+ */
+static int pipe_submit(bulk_dev_t *d, uint8_t cmd, uint32_t addr, uint32_t size,
+                       const void *data, uint32_t len) {
+    if (len > BULK_MAX_PAYLOAD) {
+        return BULK_ERR_ARG;
+    }
+    if (d->count == PIPE_DEPTH) {
+        int r = pipe_complete(d, NULL, NULL, NULL);
+        if (r != BULK_OK) {
+            return r;
+        }
+    }
+
+    slot_t *s = &d->slots[(d->head + d->count) % PIPE_DEPTH];
+    bulk_cmd_t *c = (bulk_cmd_t *)s->out_buf;
+    s->cmd = cmd;
+    s->tag = ++d->tag;
+    s->addr = addr;
+    c->cmd = cmd;
+    c->tag = s->tag;
+    c->len = len;
+    c->addr = addr;
+    c->size = size;
+    if (len) {
+        memcpy(s->out_buf + sizeof(*c), data, len);
+    }
+    uint32_t n = sizeof(*c) + len;
+    d->count++;
+
+    if (d->sim) {
+        sim_out(d->sim, s->out_buf, n);
+        s->in_len = sim_in(d->sim, s->in_buf, sizeof(s->in_buf));
+        return BULK_OK;
+    }
+
+    s->out_done = s->in_done = 0;
+    libusb_fill_bulk_transfer(s->out, d->handle, d->ep_out, s->out_buf, n,
+                              transfer_done, &s->out_done, TIMEOUT_MS);
+    s->out->flags = n % PACKET_SIZE == 0 ? LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0;
+    libusb_fill_bulk_transfer(s->in, d->handle, d->ep_in, s->in_buf, sizeof(s->in_buf),
+                              transfer_done, &s->in_done, TIMEOUT_MS);
+    int r = libusb_submit_transfer(s->out);
+    if (r == 0) {
+        r = libusb_submit_transfer(s->in);
+        if (r != 0) {
+            // the response will never be picked up, leave the device alone
+            s->in_done = 1;
+            s->in->status = LIBUSB_TRANSFER_ERROR;
+        }
+    } else {
+        s->out_done = s->in_done = 1;
+        s->out->status = LIBUSB_TRANSFER_ERROR;
+    }
+    if (r != 0) {
+        fprintf(stderr, "%s: submit failed: %s\n", d->serial, libusb_error_name(r));
+    }
+    return BULK_OK;
+}
+
+/*
+ * Run a command and wait for its response, out receives the data of the
+ * response. Returns the status, -1 on transfer errors.
+ */
+static int command(bulk_dev_t *d, uint8_t cmd, uint32_t addr, uint32_t size,
+                   const void *data, uint32_t len, void *out, uint32_t *out_len,
+                   uint32_t *value) {
+    int r = pipe_drain(d);
+    if (r == BULK_OK) {
+        r = pipe_submit(d, cmd, addr, size, data, len);
+    }
+    if (r == BULK_OK) {
+        r = pipe_complete(d, out, out_len, value);
+    }
+    return r;
+}
+
+static const char *status_str(int status) {
+    switch (status) {
+    case BULK_OK: return "ok";
+    case BULK_ERR_CMD: return "unknown command";
+    case BULK_ERR_ARG: return "invalid address or size";
+    case BULK_ERR_FLASH: return "flash error";
+    default: return "transfer error";
+    }
+}
+
+static int check(bulk_dev_t *d, int status, const char *what) {
+    if (status != BULK_OK) {
+        fprintf(stderr, "%s: %s: %s\n", d->serial, what, status_str(status));
+        return -1;
+    }
+    return 0;
+}
+
+static int dev_info(bulk_dev_t *d) {
+    uint32_t len = sizeof(d->info);
+    memset(&d->info, 0, sizeof(d->info));
+    if (check(d, command(d, BULK_CMD_INFO, 0, 0, NULL, 0, &d->info, &len, NULL), "info")) {
+        return -1;
+    }
+    if (d->info.version != BULK_PROTO_VERSION) {
+        fprintf(stderr, "%s: unsupported protocol version %u\n", d->serial, d->info.version);
+        return -1;
+    }
+    d->info.board[sizeof(d->info.board) - 1] = 0;
+    return 0;
+}
+
+/*
+ * Claim the vendor interface of an opened bootloader, the drive stays with
+ * the kernel.
+ */
+static int open_usb(bulk_dev_t *d) {
+    struct libusb_config_descriptor *config;
+
+    if (libusb_get_active_config_descriptor(libusb_get_device(d->handle), &config) != 0) {
+        fprintf(stderr, "%s: can't read configuration\n", d->serial);
+        return -1;
+    }
+    d->iface = -1;
+    for (int i = 0; i < config->bNumInterfaces && d->iface < 0; i++) {
+        const struct libusb_interface_descriptor *alt = &config->interface[i].altsetting[0];
+        if (alt->bInterfaceClass != BULK_INTERFACE_CLASS ||
+            alt->bInterfaceSubClass != BULK_INTERFACE_SUBCLASS ||
+            alt->bInterfaceProtocol != BULK_INTERFACE_PROTOCOL) {
+            continue;
+        }
+        for (int e = 0; e < alt->bNumEndpoints; e++) {
+            uint8_t ep = alt->endpoint[e].bEndpointAddress;
+            if (ep & LIBUSB_ENDPOINT_IN) {
+                d->ep_in = ep;
+            } else {
+                d->ep_out = ep;
+            }
+        }
+        d->iface = alt->bInterfaceNumber;
+    }
+    libusb_free_config_descriptor(config);
+    if (d->iface < 0) {
+        fprintf(stderr, "%s: no bulk flashing interface\n", d->serial);
+        return -1;
+    }
+
+    int r = libusb_claim_interface(d->handle, d->iface);
+    if (r != 0) {
+        fprintf(stderr, "%s: can't claim interface: %s\n", d->serial, libusb_error_name(r));
+        d->iface = -1;
+        return -1;
+    }
+    for (unsigned i = 0; i < PIPE_DEPTH; i++) {
+        d->slots[i].out = libusb_alloc_transfer(0);
+        d->slots[i].in = libusb_alloc_transfer(0);
+        if (!d->slots[i].out || !d->slots[i].in) {
+            return -1;
+        }
+    }
+    return dev_info(d);
+}
+
+static int open_sim(bulk_dev_t *d, unsigned n) {
+    snprintf(d->serial, sizeof(d->serial), "SIM%02u", n);
+    d->sim = calloc(1, sizeof(sim_t));
+    if (!d->sim) {
+        return -1;
+    }
+    memset(d->sim->flash, 0xff, sizeof(d->sim->flash));
+    // something in the bootloader sector
+    for (uint32_t i = 0; i < SIM_SECTOR_SIZE; i++) {
+        d->sim->flash[i] = i * 7;
+    }
+    return dev_info(d);
+}
+
+static void dev_close(bulk_dev_t *d) {
+    if (d->handle) {
+        pipe_drain(d);
+        if (d->iface >= 0) {
+            libusb_release_interface(d->handle, d->iface);
+        }
+        libusb_close(d->handle);
+    }
+    for (unsigned i = 0; i < PIPE_DEPTH; i++) {
+        libusb_free_transfer(d->slots[i].out);
+        libusb_free_transfer(d->slots[i].in);
+    }
+    free(d->sim);
+    memset(d, 0, sizeof(*d));
+}
+
+/*
+ * Open every bootloader with vid:pid, or only the one with the given
+ * serial number (the UID of the chip). Returns the number of devices.
+ */
+static int find_devices(bulk_dev_t *devs, unsigned max, uint16_t vid, uint16_t pid,
+                        const char *serial) {
+    libusb_device **list;
+    unsigned n = 0;
+
+    int r = libusb_init(&usb_ctx);
+    if (r != 0) {
+        fprintf(stderr, "libusb: %s\n", libusb_error_name(r));
+        return -1;
+    }
+    ssize_t cnt = libusb_get_device_list(usb_ctx, &list);
+    for (ssize_t i = 0; i < cnt && n < max; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+            desc.idVendor != vid || desc.idProduct != pid) {
+            continue;
+        }
+
+        bulk_dev_t *d = &devs[n];
+        memset(d, 0, sizeof(*d));
+        d->iface = -1;
+        snprintf(d->serial, sizeof(d->serial), "bus %u addr %u",
+                 libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+        r = libusb_open(list[i], &d->handle);
+        if (r != 0) {
+            fprintf(stderr, "%s: can't open: %s\n", d->serial, libusb_error_name(r));
+            continue;
+        }
+        unsigned char str[sizeof(d->serial)];
+        if (desc.iSerialNumber &&
+            libusb_get_string_descriptor_ascii(d->handle, desc.iSerialNumber, str, sizeof(str)) > 0) {
+            snprintf(d->serial, sizeof(d->serial), "%s", (const char *)str);
+        }
+        if ((serial && strcmp(serial, d->serial) != 0) || open_usb(d) != 0) {
+            dev_close(d);
+            continue;
+        }
+        n++;
+    }
+    if (cnt >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    return n;
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int image_add(image_t *img, uint32_t addr, const uint8_t *data, uint32_t len) {
+    if (img->n_payloads % 256 == 0) {
+        payload_t *p = realloc(img->payloads, (img->n_payloads + 256) * sizeof(*p));
+        run_t *r = realloc(img->runs, (img->n_payloads + 256) * sizeof(*r));
+        if (p) {
+            img->payloads = p;
+        }
+        if (r) {
+            img->runs = r;
+        }
+        if (!p || !r) {
+            return -1;
+        }
+    }
+    img->payloads[img->n_payloads++] = (payload_t){addr, len, data};
+    img->bytes += len;
+
+    run_t *run = img->n_runs ? &img->runs[img->n_runs - 1] : NULL;
+    if (!run || run->addr + run->len != addr) {
+        run = &img->runs[img->n_runs++];
+        *run = (run_t){addr, 0, 0};
+    }
+    run->crc = bulk_crc32(run->crc, data, len);
+    run->len += len;
+    return 0;
+}
+
+static void image_free(image_t *img) {
+    free(img->payloads);
+    free(img->runs);
+    free(img->buf);
+    memset(img, 0, sizeof(*img));
+}
+
+/* a binary at addr, padded to whole words */
+static int image_from_bin(image_t *img, uint32_t addr, const uint8_t *data, uint32_t len) {
+    uint32_t padded = (len + 3) & ~3u;
+
+    memset(img, 0, sizeof(*img));
+    img->buf = malloc(padded ? padded : 1);
+    if (!img->buf) {
+        return -1;
+    }
+    memset(img->buf, 0xff, padded);
+    memcpy(img->buf, data, len);
+    for (uint32_t i = 0; i < padded; i += BULK_MAX_PAYLOAD) {
+        uint32_t n = padded - i < BULK_MAX_PAYLOAD ? padded - i : BULK_MAX_PAYLOAD;
+        if (image_add(img, addr + i, img->buf + i, n) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* the blocks of a UF2 file for family, the image points into data */
+static int image_from_uf2(image_t *img, const uint8_t *data, uint32_t len, uint32_t family) {
+    uint32_t skipped = 0;
+
+    memset(img, 0, sizeof(*img));
+    for (uint32_t i = 0; i + 512 <= len; i += 512) {
+        const uint8_t *b = data + i;
+        uint32_t w[8];
+        uint32_t end;
+        memcpy(w, b, sizeof(w));
+        memcpy(&end, b + 508, sizeof(end));
+        if (w[0] != UF2_MAGIC_START0 || w[1] != UF2_MAGIC_START1 || end != UF2_MAGIC_END) {
+            continue;
+        }
+        uint32_t flags = w[2], addr = w[3], size = w[4], fam = w[7];
+        if ((flags & UF2_FLAG_NOFLASH) || ((flags & UF2_FLAG_FAMILYID) && fam != family)) {
+            skipped++;
+            continue;
+        }
+        if (size > BULK_MAX_PAYLOAD || size % 4 || addr % 4) {
+            fprintf(stderr, "block %u: unsupported payload at %08x\n", i / 512, addr);
+            return -1;
+        }
+        if (image_add(img, addr, b + 32, size) != 0) {
+            return -1;
+        }
+    }
+    if (skipped) {
+        printf("skipped %u blocks for other devices\n", skipped);
+    }
+    if (img->n_payloads == 0) {
+        fprintf(stderr, "no blocks for this device\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write an image with PIPE_DEPTH commands in flight, sync, which verifies
+ * the written sectors on the device, and compare the CRC of every range
+ * with the image.
+ */
+static int flash_image(bulk_dev_t *d, const image_t *img) {
+    double t = now_s();
+    int r = BULK_OK;
+
+    for (unsigned i = 0; i < img->n_payloads && r == BULK_OK; i++) {
+        const payload_t *p = &img->payloads[i];
+        r = pipe_submit(d, BULK_CMD_WRITE, p->addr, 0, p->data, p->len);
+    }
+    int drained = pipe_drain(d);
+    if (check(d, r != BULK_OK ? r : drained, "write")) {
+        return -1;
+    }
+    d->t_write = now_s() - t;
+
+    t = now_s();
+    if (check(d, command(d, BULK_CMD_SYNC, 0, 0, NULL, 0, NULL, NULL, NULL), "sync")) {
+        return -1;
+    }
+    d->t_sync = now_s() - t;
+
+    t = now_s();
+    for (unsigned i = 0; i < img->n_runs; i++) {
+        const run_t *run = &img->runs[i];
+        uint32_t value;
+        if (check(d, command(d, BULK_CMD_CRC, run->addr, run->len, NULL, 0, NULL, NULL, &value), "crc")) {
+            return -1;
+        }
+        if (value != run->crc) {
+            fprintf(stderr, "%s: crc mismatch at %08x: flash %08x, image %08x\n",
+                    d->serial, run->addr, value, run->crc);
+            return -1;
+        }
+    }
+    d->t_verify = now_s() - t;
+    return 0;
+}
+
+typedef struct {
+    bulk_dev_t *dev;
+    const image_t *img;
+    bool reset;
+} job_t;
+
+static void *flash_thread(void *arg) {
+    job_t *job = arg;
+    bulk_dev_t *d = job->dev;
+
+    d->result = flash_image(d, job->img);
+    if (d->result == 0 && job->reset) {
+        d->result = check(d, command(d, BULK_CMD_RESET, 0, 0, NULL, 0, NULL, NULL, NULL), "reset");
+    }
+    return NULL;
+}
+
+/*
+ * Flash all devices at once, one thread per device, and print the timing
+ * of every device. Returns the number of devices that failed.
+ */
+static int flash_all(bulk_dev_t *devs, unsigned n, const image_t *img, bool reset) {
+    pthread_t threads[MAX_DEVICES];
+    job_t jobs[MAX_DEVICES];
+    bool started[MAX_DEVICES];
+    int failed = 0;
+
+    double t = now_s();
+    for (unsigned i = 0; i < n; i++) {
+        jobs[i] = (job_t){&devs[i], img, reset};
+        devs[i].result = -1;
+        started[i] = pthread_create(&threads[i], NULL, flash_thread, &jobs[i]) == 0;
+        if (!started[i]) {
+            fprintf(stderr, "%s: can't start thread\n", devs[i].serial);
+        }
+    }
+    for (unsigned i = 0; i < n; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    t = now_s() - t;
+
+    printf("%-26s %-6s %8s %8s %8s %8s\n", "device", "result", "write", "sync", "verify", "kB/s");
+    for (unsigned i = 0; i < n; i++) {
+        bulk_dev_t *d = &devs[i];
+        double total = d->t_write + d->t_sync + d->t_verify;
+        if (d->result != 0) {
+            failed++;
+            printf("%-26s %-6s\n", d->serial, "FAILED");
+        } else {
+            printf("%-26s %-6s %7.2fs %7.2fs %7.2fs %8.1f\n", d->serial, "ok",
+                   d->t_write, d->t_sync, d->t_verify, total > 0 ? img->bytes / total / 1000 : 0);
+        }
+    }
+    printf("%u devices, %u bytes each, %u failed, %.2f s\n", n, img->bytes, failed, t);
+    return failed;
+}
+
+static uint8_t *read_file(const char *name, uint32_t *len) {
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = malloc(size > 0 ? size : 1);
+    if (!buf || fread(buf, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "%s: read failed\n", name);
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *len = size;
+    return buf;
+}
+
+/* load a .uf2 file, or a binary at addr_arg (default the start of the user flash) */
+static int load_image(image_t *img, const bulk_dev_t *d, const uint8_t *data, uint32_t len,
+                      const char *addr_arg) {
+    uint32_t magic = 0;
+    if (len >= 4) {
+        memcpy(&magic, data, 4);
+    }
+    if (magic == UF2_MAGIC_START0) {
+        return image_from_uf2(img, data, len, d->info.family);
+    }
+    return image_from_bin(img, addr_arg ? strtoul(addr_arg, NULL, 0) : d->info.flash_start, data, len);
+}
+
+static int cmd_flash(bulk_dev_t *devs, unsigned n, const char *name, const char *addr_arg,
+                     bool reset) {
+    uint32_t len;
+    image_t img;
+    uint8_t *data = read_file(name, &len);
+    if (!data) {
+        return -1;
+    }
+
+    // all devices are expected to be the same board
+    int r = load_image(&img, &devs[0], data, len, addr_arg);
+    if (r == 0 && n > 1) {
+        r = flash_all(devs, n, &img, reset) ? -1 : 0;
+    } else if (r == 0) {
+        double t = now_s();
+        r = flash_image(&devs[0], &img);
+        t = now_s() - t;
+        if (r == 0) {
+            printf("flashed %u bytes in %.2f s (%.1f kB/s)\n", img.bytes, t, img.bytes / t / 1000);
+        }
+        if (r == 0 && reset) {
+            r = check(&devs[0], command(&devs[0], BULK_CMD_RESET, 0, 0, NULL, 0, NULL, NULL, NULL), "reset");
+        }
+    }
+    image_free(&img);
+    free(data);
+    return r;
+}
+
+static int cmd_read(bulk_dev_t *d, uint32_t addr, uint32_t size, const char *name) {
+    FILE *f = fopen(name, "wb");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    int r = 0;
+    for (uint32_t i = 0; i < size && r == 0; i += BULK_MAX_PAYLOAD) {
+        uint8_t buf[BULK_MAX_PAYLOAD];
+        uint32_t n = size - i < BULK_MAX_PAYLOAD ? size - i : BULK_MAX_PAYLOAD;
+        uint32_t got = n;
+        r = check(d, command(d, BULK_CMD_READ, addr + i, n, NULL, 0, buf, &got, NULL), "read");
+        if (r == 0 && (got != n || fwrite(buf, 1, n, f) != n)) {
+            fprintf(stderr, "%s: write failed\n", name);
+            r = -1;
+        }
+    }
+    fclose(f);
+    return r;
+}
+
+/*
+ * Protocol checks against the simulated devices.
+ */
+#define EXPECT(cond)                                                        \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+            return -1;                                                      \
+        }                                                                   \
+    } while (0)
+
+static int selftest(bulk_dev_t *devs, unsigned n) {
+    bulk_dev_t *d = &devs[0];
+    uint32_t start = d->info.flash_start;
+    uint8_t img[3000];
+    uint8_t buf[BULK_MAX_PAYLOAD];
+    uint32_t len, value;
+    image_t image;
+
+    EXPECT(d->info.max_payload == BULK_MAX_PAYLOAD);
+    EXPECT(d->info.flash_start < d->info.flash_end);
+
+    // 476 byte writes across 256 byte pages, read back and CRC
+    for (unsigned i = 0; i < sizeof(img); i++) {
+        img[i] = rand();
+    }
+    EXPECT(image_from_bin(&image, start, img, sizeof(img)) == 0);
+    EXPECT(image.n_runs == 1 && image.runs[0].len == sizeof(img));
+    EXPECT(flash_image(d, &image) == 0);
+    image_free(&image);
+    for (uint32_t i = 0; i < sizeof(img); i += BULK_MAX_PAYLOAD) {
+        uint32_t n = sizeof(img) - i < BULK_MAX_PAYLOAD ? sizeof(img) - i : BULK_MAX_PAYLOAD;
+        len = sizeof(buf);
+        EXPECT(command(d, BULK_CMD_READ, start + i, n, NULL, 0, buf, &len, NULL) == BULK_OK);
+        EXPECT(len == n && memcmp(buf, img + i, n) == 0);
+    }
+    EXPECT(command(d, BULK_CMD_CRC, start, sizeof(img), NULL, 0, NULL, NULL, &value) == BULK_OK);
+    EXPECT(value == bulk_crc32(0, img, sizeof(img)));
+
+    // transfers of a multiple of the packet size end with a zero length packet
+    memset(buf, 0x5a, sizeof(buf));
+    EXPECT(command(d, BULK_CMD_WRITE, start + 4096, 0, buf,
+                   2 * PACKET_SIZE - sizeof(bulk_cmd_t), NULL, NULL, NULL) == BULK_OK);
+    len = 2 * PACKET_SIZE - sizeof(bulk_rsp_t);
+    EXPECT(command(d, BULK_CMD_READ, start + 4096, len, NULL, 0, buf, &len, NULL) == BULK_OK);
+    EXPECT(len == 2 * PACKET_SIZE - sizeof(bulk_rsp_t) && buf[0] == 0x5a && buf[len - 1] == 0x5a);
+
+    // UF2 blocks, including one for another family that must be skipped
+    uint8_t uf2[3 * 512];
+    memset(uf2, 0, sizeof(uf2));
+    for (uint32_t i = 0; i < 3; i++) {
+        uint32_t w[8] = {UF2_MAGIC_START0, UF2_MAGIC_START1, UF2_FLAG_FAMILYID,
+                         start + 8192 + i * 256, 256, i, 3,
+                         i == 2 ? d->info.family ^ 1 : d->info.family};
+        uint32_t end = UF2_MAGIC_END;
+        memcpy(uf2 + i * 512, w, sizeof(w));
+        memset(uf2 + i * 512 + 32, 0x10 + i, 256);
+        memcpy(uf2 + i * 512 + 508, &end, sizeof(end));
+    }
+    EXPECT(image_from_uf2(&image, uf2, sizeof(uf2), d->info.family) == 0);
+    EXPECT(image.n_payloads == 2 && image.n_runs == 1);
+    EXPECT(flash_image(d, &image) == 0);
+    image_free(&image);
+    len = 4;
+    EXPECT(command(d, BULK_CMD_READ, start + 8192 + 256, 4, NULL, 0, buf, &len, NULL) == BULK_OK);
+    EXPECT(buf[0] == 0x11);
+    len = 4;
+    EXPECT(command(d, BULK_CMD_READ, start + 8192 + 512, 4, NULL, 0, buf, &len, NULL) == BULK_OK);
+    EXPECT(buf[0] == 0xff);
+
+    // erase works on whole sectors
+    EXPECT(command(d, BULK_CMD_ERASE, start, 128 * 1024, NULL, 0, NULL, NULL, NULL) == BULK_OK);
+    len = 16;
+    EXPECT(command(d, BULK_CMD_READ, start, 16, NULL, 0, buf, &len, NULL) == BULK_OK);
+    for (unsigned i = 0; i < 16; i++) {
+        EXPECT(buf[i] == 0xff);
+    }
+    EXPECT(command(d, BULK_CMD_ERASE, start + 256, 128 * 1024, NULL, 0, NULL, NULL, NULL) == BULK_ERR_ARG);
+
+    // the bootloader can be read, not written or erased
+    len = 16;
+    EXPECT(command(d, BULK_CMD_READ, start - 16, 16, NULL, 0, buf, &len, NULL) == BULK_OK);
+    EXPECT(command(d, BULK_CMD_WRITE, start - 256, 0, buf, 256, NULL, NULL, NULL) == BULK_ERR_ARG);
+    EXPECT(command(d, BULK_CMD_ERASE, start - 128 * 1024, 128 * 1024, NULL, 0, NULL, NULL, NULL) == BULK_ERR_ARG);
+
+    // argument checks
+    EXPECT(command(d, BULK_CMD_WRITE, start + 2, 0, buf, 4, NULL, NULL, NULL) == BULK_ERR_ARG);
+    EXPECT(command(d, BULK_CMD_WRITE, start, 0, buf, 6, NULL, NULL, NULL) == BULK_ERR_ARG);
+    EXPECT(command(d, BULK_CMD_WRITE, d->info.flash_end - 4, 0, buf, 8, NULL, NULL, NULL) == BULK_ERR_ARG);
+    EXPECT(command(d, BULK_CMD_READ, start, BULK_MAX_PAYLOAD + 4, NULL, 0, NULL, NULL, NULL) == BULK_ERR_ARG);
+    EXPECT(command(d, BULK_CMD_READ, 0x20000000, 4, NULL, 0, NULL, NULL, NULL) == BULK_ERR_ARG);
+    EXPECT(command(d, BULK_CMD_CRC, start + 1, 4, NULL, 0, NULL, NULL, NULL) == BULK_ERR_ARG);
+    EXPECT(command(d, 0x7f, 0, 0, NULL, 0, NULL, NULL, NULL) == BULK_ERR_CMD);
+
+    // a command with a length that doesn't match its transfer
+    uint8_t raw[sizeof(bulk_cmd_t) + 8];
+    bulk_cmd_t *c = (bulk_cmd_t *)raw;
+    memset(raw, 0, sizeof(raw));
+    c->cmd = BULK_CMD_WRITE;
+    c->len = 16;
+    c->addr = start;
+    sim_out(d->sim, raw, sizeof(raw));
+    EXPECT(sim_in(d->sim, buf, sizeof(buf)) == sizeof(bulk_rsp_t));
+    EXPECT(((bulk_rsp_t *)buf)->status == BULK_ERR_CMD);
+
+    // a failing write in the pipeline is reported
+    EXPECT(pipe_submit(d, BULK_CMD_WRITE, start, 0, buf, 4) == BULK_OK);
+    EXPECT(pipe_submit(d, BULK_CMD_WRITE, start + 2, 0, buf, 4) == BULK_OK);
+    EXPECT(pipe_submit(d, BULK_CMD_WRITE, start + 4, 0, buf, 4) == BULK_OK);
+    EXPECT(pipe_drain(d) == BULK_ERR_ARG && d->count == 0);
+
+    // all devices at once, with a reset afterwards
+    uint8_t *big = malloc(300 * 1024);
+    EXPECT(big != NULL);
+    for (unsigned i = 0; i < 300 * 1024; i++) {
+        big[i] = i * 13 + (i >> 10);
+    }
+    EXPECT(image_from_bin(&image, start, big, 300 * 1024) == 0);
+    EXPECT(flash_all(devs, n, &image, true) == 0);
+    image_free(&image);
+    for (unsigned i = 0; i < n; i++) {
+        EXPECT(devs[i].sim->reset);
+        EXPECT(memcmp(devs[i].sim->flash + start - SIM_FLASH_BASE, big, 300 * 1024) == 0);
+    }
+    free(big);
+
+    printf("selftest passed\n");
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: uf2bulk [-s] [-n N] [-v] [-r] [-d vid:pid] [-S serial] command\n"
+        "  info                   show device information\n"
+        "  list                   list the connected devices\n"
+        "  flash FILE [ADDR]      write a .uf2 file, or a binary at ADDR\n"
+        "  flashall FILE [ADDR]   flash all connected devices at once\n"
+        "  read ADDR SIZE FILE    save flash contents\n"
+        "  erase ADDR SIZE        erase whole sectors\n"
+        "  crc ADDR SIZE          CRC of a flash range\n"
+        "  reset                  start the application\n"
+        "  selftest               protocol checks, simulated devices only\n"
+        "options:\n"
+        "  -s                     use simulated devices instead of USB\n"
+        "  -n N                   number of simulated devices, default 4 for\n"
+        "                         flashall, list and selftest, otherwise 1\n"
+        "  -v                     print every command\n"
+        "  -r                     start the application after flashing\n"
+        "  -d vid:pid             devices to open, default %04x:%04x\n"
+        "  -S serial              only the device with this serial number\n",
+        DEFAULT_VID, DEFAULT_PID);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    static bulk_dev_t devs[MAX_DEVICES];
+    uint16_t vid = DEFAULT_VID, pid = DEFAULT_PID;
+    const char *serial = NULL;
+    bool sim = false;
+    bool reset = false;
+    unsigned sims = 0;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-s")) {
+            sim = true;
+        } else if (!strcmp(argv[i], "-v")) {
+            verbose = true;
+        } else if (!strcmp(argv[i], "-r")) {
+            reset = true;
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            sims = strtoul(argv[++i], NULL, 0);
+            if (sims < 1 || sims > MAX_DEVICES) {
+                usage();
+            }
+        } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            unsigned v, p;
+            if (sscanf(argv[++i], "%x:%x", &v, &p) != 2) {
+                usage();
+            }
+            vid = v;
+            pid = p;
+        } else if (!strcmp(argv[i], "-S") && i + 1 < argc) {
+            serial = argv[++i];
+        } else {
+            usage();
+        }
+    }
+    if (i >= argc) {
+        usage();
+    }
+    const char *cmd = argv[i++];
+    int nargs = argc - i;
+    char **args = argv + i;
+    bool all = !strcmp(cmd, "flashall") || !strcmp(cmd, "list") || !strcmp(cmd, "selftest");
+
+    if (!strcmp(cmd, "selftest") && !sim) {
+        fprintf(stderr, "selftest runs against simulated devices only, use -s\n");
+        return 2;
+    }
+
+    int n = 0;
+    if (sim) {
+        if (sims == 0) {
+            sims = all ? 4 : 1;
+        }
+        for (; n < (int)sims && open_sim(&devs[n], n) == 0; n++) {
+        }
+    } else {
+        n = find_devices(devs, MAX_DEVICES, vid, pid, serial);
+    }
+    if (n <= 0) {
+        fprintf(stderr, "no device %04x:%04x found\n", vid, pid);
+        return 1;
+    }
+    if (n > 1 && !all) {
+        fprintf(stderr, "%d devices found, select one with -S\n", n);
+        for (int j = 0; j < n; j++) {
+            fprintf(stderr, "  %s\n", devs[j].serial);
+        }
+        return 2;
+    }
+
+    bulk_dev_t *d = &devs[0];
+    int r;
+    uint32_t value;
+    if (!strcmp(cmd, "info") && nargs == 0) {
+        printf("serial:  %s\n", d->serial);
+        printf("board:   %s\n", d->info.board);
+        printf("family:  0x%08x\n", d->info.family);
+        printf("flash:   0x%08x - 0x%08x\n", d->info.flash_start, d->info.flash_end);
+        printf("payload: %u bytes\n", d->info.max_payload);
+        r = 0;
+    } else if (!strcmp(cmd, "list") && nargs == 0) {
+        for (int j = 0; j < n; j++) {
+            printf("%-26s %s\n", devs[j].serial, devs[j].info.board);
+        }
+        r = 0;
+    } else if ((!strcmp(cmd, "flash") || !strcmp(cmd, "flashall")) && (nargs == 1 || nargs == 2)) {
+        r = cmd_flash(devs, n, args[0], nargs == 2 ? args[1] : NULL, reset);
+    } else if (!strcmp(cmd, "read") && nargs == 3) {
+        r = cmd_read(d, strtoul(args[0], NULL, 0), strtoul(args[1], NULL, 0), args[2]);
+    } else if (!strcmp(cmd, "erase") && nargs == 2) {
+        r = check(d, command(d, BULK_CMD_ERASE, strtoul(args[0], NULL, 0), strtoul(args[1], NULL, 0),
+                             NULL, 0, NULL, NULL, NULL), "erase");
+        if (r == 0) {
+            r = check(d, command(d, BULK_CMD_SYNC, 0, 0, NULL, 0, NULL, NULL, NULL), "sync");
+        }
+    } else if (!strcmp(cmd, "crc") && nargs == 2) {
+        r = check(d, command(d, BULK_CMD_CRC, strtoul(args[0], NULL, 0), strtoul(args[1], NULL, 0),
+                             NULL, 0, NULL, NULL, &value), "crc");
+        if (r == 0) {
+            printf("0x%08x\n", value);
+        }
+    } else if (!strcmp(cmd, "reset") && nargs == 0) {
+        r = check(d, command(d, BULK_CMD_RESET, 0, 0, NULL, 0, NULL, NULL, NULL), "reset");
+    } else if (!strcmp(cmd, "selftest") && nargs == 0) {
+        r = selftest(devs, n);
+    } else {
+        usage();
+    }
+
+    for (int j = 0; j < n; j++) {
+        dev_close(&devs[j]);
+    }
+    if (usb_ctx) {
+        libusb_exit(usb_ctx);
+    }
+    return r == 0 ? 0 : 1;
+}
@@ -69,6 +69,7 @@ typedef struct {
     uint32_t magicEnd;
 } UF2_Block;
 
+// passed by the application to the MSC handover, see check_uf2_handover()
 typedef struct {
     uint8_t version;
     uint8_t ep_in;
@@ -81,7 +82,6 @@ typedef struct {
 
 int write_block(uint32_t lba, const uint8_t *copy_from);
 int read_block(uint32_t block_no, uint8_t *data);
-void ghostfat_1ms(void);
 
 typedef void (*UF2_MSC_Handover_Handler)(UF2_HandoverArgs *handover);
 typedef void (*UF2_HID_Handover_Handler)(int ep);
@@ -94,7 +94,8 @@ typedef struct {
     const char *info_uf2;
 } UF2_BInfo;
 
-#define UF2_BINFO ((UF2_BInfo *)(APP_START_ADDRESS - sizeof(UF2_BInfo)))
+// at the end of the bootloader sector, just before the user flash
+#define UF2_BINFO ((UF2_BInfo *)(USER_FLASH_START - sizeof(UF2_BInfo)))
 
 static inline bool is_uf2_block(const void *data) {
     const UF2_Block *bl = (const UF2_Block *)data;
@@ -103,7 +104,7 @@ static inline bool is_uf2_block(const void *data) {
 }
 
 static inline bool in_uf2_bootloader_space(const void *addr) {
-    return USER_FLASH_END <= (uint32_t)addr && (uint32_t)addr < BOARD_FLASH_SIZE;
+    return BOARD_FLASH_BASE <= (uint32_t)addr && (uint32_t)addr < USER_FLASH_START;
 }
 
 
@@ -127,6 +128,10 @@ static inline void hf2_handover(uint8_t ep) {
 
 // the ep_in/ep_out are without the 0x80 mask
 // cbw_tag is in the same bit format as it came
+// buffer holds a block of a WRITE(10) that was just received, blocks_remaining
+// is the number of blocks of that WRITE(10) still to come after it
+// call before the next block is requested from the host, with the OUT endpoint
+// idle; the bootloader takes over the USB core without re-enumerating
 static inline void check_uf2_handover(uint8_t *buffer, uint32_t blocks_remaining, uint8_t ep_in,
                                       uint8_t ep_out, uint32_t cbw_tag) {
     if (!is_uf2_block(buffer))
@@ -9,9 +9,17 @@
 #define VOLUME_LABEL "StrisoFW"
 // Size of the USB drive
 #define UF2_NUM_BLOCKS (16000000/512)
+// Sectors per cluster of the drive, larger clusters make a smaller FAT for the
+// host to read. With 8 the drive is FAT12 with 12 sectors per FAT, instead of
+// FAT16 with 123 sectors per FAT for 1 sector clusters
+#ifndef GHOSTFAT_SECTORS_PER_CLUSTER
+#define GHOSTFAT_SECTORS_PER_CLUSTER 8
+#endif
+// Copies of the FAT
+#define GHOSTFAT_FAT_COPIES 2
 // Where the UF2 files are allowed to write data
 #define USER_FLASH_START 0x08020000
-#define USER_FLASH_END (0x08000000+BOARD_FLASH_SIZE)
+#define USER_FLASH_END (BOARD_FLASH_BASE+BOARD_FLASH_SIZE)
 // Address where the executable code is located
 #define APP_LOAD_ADDRESS 0x08041000
 // Address where firmware info string is put
@@ -24,3 +32,26 @@
 #define CONFIGHTM_SEGMENTS 8
 // Address after which the flash is protected for writing only device specific data (every 256 bytes should start with the UID)
 #define DEVSPEC_FLASH_START 0x081e0000
+// Sleep on the flash interrupt during erase/program instead of polling
+#define FLASH_USE_IRQ TRUE
+// Only erase and rewrite sectors whose contents differ from the update. A
+// sector can only be compared once its data arrived, so this turns off the
+// erase-ahead outside failsafe mode: it saves erases when an update mostly
+// matches the flash, but a full update waits for every erase
+// #define USE_DIFFERENTIAL_FLASH
+// Benchmark mode, started with the bootloader and failsafe buttons held or
+// with BENCH_RTC_SIGNATURE: the drive has BENCH.BIN to read and BENCH.TXT
+// with the measured speed, UF2 files written to it are checked and discarded
+// #define USE_BENCHMARK
+// CURRENT.UF2 and CONFIG.UF2 only hold the flash blocks that aren't blank
+// (0xff). The flash is scanned when the drive is set up and again after a write.
+// Copying such a backup back doesn't erase the blank blocks, flash written
+// there since the backup stays
+// #define GHOSTFAT_SPARSE_UF2
+// CURRENT.BIN with the flash from APP_LOAD_ADDRESS as plain binary, read by
+// the host straight from flash
+#define USE_CURRENTBIN
+// Code that runs while a flash bank is erased or programmed. Fetching it from
+// bank 1 would stall the core until the flash is done, so the linker script
+// puts it in ITCM. Not inlined into callers that stay in flash
+#define ITCM_CODE __attribute__((section(".itcm_text"), noinline))
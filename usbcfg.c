@@ -16,15 +16,22 @@
 
 #include "ch.h"
 #include "hal.h"
+#include "uf2cfg.h"
 
-#include "hal_usb_msd.h"
+#include "msd.h"
+#include "bulk.h"
+#include "bulkproto.h"
 #include "usbcfg.h"
+#include "flash.h"
+#include "bootloader.h"
 
 /*
  * must be 64 for full speed and 512 for high speed
  */
 #define USB_MSD_EP_SIZE                 64U
 
+EVENTSOURCE_DECL(usb_configured_event);
+
 /*
  * USB Device Descriptor.
  */
@@ -52,10 +59,10 @@ static const USBDescriptor vcom_device_descriptor = {
 };
 
 /* Configuration Descriptor tree.*/
-static const uint8_t vcom_configuration_descriptor_data[67] = {
+static const uint8_t vcom_configuration_descriptor_data[55] = {
     /* Configuration Descriptor.*/
-    USB_DESC_CONFIGURATION(0x0020,        /* wTotalLength.                    */
-                           0x01,          /* bNumInterfaces.                  */
+    USB_DESC_CONFIGURATION(0x0037,        /* wTotalLength.                    */
+                           0x02,          /* bNumInterfaces.                  */
                            0x01,          /* bConfigurationValue.             */
                            0,             /* iConfiguration.                  */
                            0x80,          /* bmAttributes (bus powered).      */
@@ -76,6 +83,24 @@ static const uint8_t vcom_configuration_descriptor_data[67] = {
                            0x00),         /* bInterval. 1ms                   */
     /* Mass Storage Data Out Endpoint Descriptor.*/
     USB_DESC_ENDPOINT     (USB_MSD_DATA_EP,
+                           0x02,          /* bmAttributes (Bulk).             */
+                           USB_MSD_EP_SIZE,            /* wMaxPacketSize.                  */
+                           0x00),         /* bInterval. 1ms                   */
+    /* Raw bulk flashing Interface Descriptor, see bulkproto.h.*/
+    USB_DESC_INTERFACE    (0x01,          /* bInterfaceNumber.                */
+                           0x00,          /* bAlternateSetting.               */
+                           0x02,          /* bNumEndpoints.                   */
+                           BULK_INTERFACE_CLASS,    /* bInterfaceClass (Vendor)  */
+                           BULK_INTERFACE_SUBCLASS, /* bInterfaceSubClass.       */
+                           BULK_INTERFACE_PROTOCOL, /* bInterfaceProtocol.       */
+                           0),            /* iInterface. (none)               */
+    /* Raw bulk Data In Endpoint Descriptor.*/
+    USB_DESC_ENDPOINT     (USB_BULK_DATA_EP | 0x80,
+                           0x02,          /* bmAttributes (Bulk).             */
+                           USB_MSD_EP_SIZE,            /* wMaxPacketSize.                  */
+                           0x00),         /* bInterval. 1ms                   */
+    /* Raw bulk Data Out Endpoint Descriptor.*/
+    USB_DESC_ENDPOINT     (USB_BULK_DATA_EP,
                            0x02,          /* bmAttributes (Bulk).             */
                            USB_MSD_EP_SIZE,            /* wMaxPacketSize.                  */
                            0x00)          /* bInterval. 1ms                   */
@@ -158,7 +183,7 @@ void inttohex(uint32_t v, unsigned char *p){
  * Handles the GET_DESCRIPTOR callback. All required descriptors must be
  * handled here.
  */
-static const USBDescriptor *get_descriptor(USBDriver *usbp,
+ITCM_CODE static const USBDescriptor *get_descriptor(USBDriver *usbp,
                                            uint8_t dtype,
                                            uint8_t dindex,
                                            uint16_t lang) {
@@ -209,23 +234,61 @@ static const USBEndpointConfig ep1config = {
   NULL
 };
 
+/**
+ * @brief   IN EP2 state.
+ */
+static USBInEndpointState ep2instate;
+
+/**
+ * @brief   OUT EP2 state.
+ */
+static USBOutEndpointState ep2outstate;
+
+/**
+ * @brief   EP2 initialization structure (both IN and OUT).
+ */
+static const USBEndpointConfig ep2config = {
+  USB_EP_MODE_TYPE_BULK,
+  NULL,
+  NULL,
+  NULL,
+  USB_MSD_EP_SIZE,
+  USB_MSD_EP_SIZE,
+  &ep2instate,
+  &ep2outstate,
+  4,
+  NULL
+};
+
+#ifdef USE_BENCHMARK
+static rtcnt_t last_sof;
+#endif
+
 /*
  * Handles the USB driver global events.
  */
-static void usb_event(USBDriver *usbp, usbevent_t event) {
+ITCM_CODE static void usb_event(USBDriver *usbp, usbevent_t event) {
 
   switch (event) {
   case USB_EVENT_RESET:
+#ifdef USE_BENCHMARK
+    last_sof = 0;
+#endif
     return;
   case USB_EVENT_ADDRESS:
     return;
   case USB_EVENT_CONFIGURED:
+    if (boot_stats.configured_ms == 0) {
+      boot_stats.configured_ms = TIME_I2MS(chVTGetSystemTimeX());
+    }
     chSysLockFromISR();
     if (usbp->state == USB_ACTIVE) {
       /* Enables the endpoints specified into the configuration.
          Note, this callback is invoked from an ISR so I-Class functions
          must be used.*/
       usbInitEndpointI(usbp, USBD1_DATA_REQUEST_EP, &ep1config);
+      usbInitEndpointI(usbp, USB_BULK_DATA_EP, &ep2config);
+      chEvtBroadcastI(&usb_configured_event);
     } else if (usbp->state == USB_SELECTED) {
       usbDisableEndpointsI(usbp);
     }
@@ -234,6 +297,10 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
   case USB_EVENT_UNCONFIGURED:
     return;
   case USB_EVENT_SUSPEND:
+#ifdef USE_BENCHMARK
+    // no start of frames while suspended
+    last_sof = 0;
+#endif
     return;
   case USB_EVENT_WAKEUP:
     return;
@@ -243,6 +310,26 @@ static void usb_event(USBDriver *usbp, usbevent_t event) {
   return;
 }
 
+#ifdef USE_BENCHMARK
+/*
+ * Start of frame, every 1 ms. A longer gap means the USB interrupt was held
+ * up, e.g. by fetching code from a flash bank that is being written. Only in
+ * benchmark builds, by default the driver gets no SOF callback.
+ */
+ITCM_CODE static void usb_sof(USBDriver *usbp) {
+  (void)usbp;
+
+  rtcnt_t now = chSysGetRealtimeCounterX();
+  if (last_sof != 0) {
+    uint32_t us = RTC2US(STM32_SYS_CK, now - last_sof);
+    if (us > flash_stats.sof_gap_max_us) {
+      flash_stats.sof_gap_max_us = us;
+    }
+  }
+  last_sof = now;
+}
+#endif
+
 /*
  * USB driver configuration.
  */
@@ -250,6 +337,10 @@ const USBConfig usbcfg = {
   usb_event,
   get_descriptor,
   msd_request_hook,
+#ifdef USE_BENCHMARK
+  usb_sof
+#else
   NULL
+#endif
 };
 
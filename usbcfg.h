@@ -29,6 +29,8 @@
 #define USBD1_INTERRUPT_REQUEST_EP      2
 
 extern const USBConfig usbcfg;
+/* Broadcast when the host sets the configuration.*/
+extern event_source_t usb_configured_event;
 
 #endif  /* USBCFG_H */
 